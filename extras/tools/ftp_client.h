@@ -0,0 +1,358 @@
+/*******************************************************************************
+ **                                                                            **
+ **                  MINIMAL FTP CLIENT FOR THE HOST-SIDE TOOLS                **
+ **                                                                            **
+ *******************************************************************************/
+
+// Blocking, passive-mode FTP client shared by ftp_loadgen and ftp_replay,
+// with optional client-side emulation of a slow wireless link.
+
+#ifndef FTP_TOOLS_CLIENT_H
+#define FTP_TOOLS_CLIENT_H
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+
+struct ClientOptions
+{
+  std::string host = "127.0.0.1";
+  uint16_t port = 21;
+  std::string user = "esp32";
+  std::string pass = "esp32";
+  unsigned timeoutMs = 10000;
+
+  // Link emulation
+  unsigned rttMs = 0;
+  unsigned jitterMs = 0;
+  unsigned bandwidthKbps = 0; // 0 = unlimited
+  double lossPercent = 0;
+
+  bool impaired() const { return rttMs || jitterMs || bandwidthKbps || lossPercent > 0; }
+};
+
+// Emulated wireless link, one per session. Commands and connection setup pay
+// a round trip, data pays serialization at the link bandwidth, and each lost
+// segment costs a retransmission timeout. Losses come from a per-client RNG,
+// so a run with the same seed sees the same impairments.
+class Link
+{
+public:
+  Link(const ClientOptions &options, unsigned seed) : _options(options),
+                                                      _enabled(seed != 0 && options.impaired()),
+                                                      _rng(seed),
+                                 _freeAt(std::chrono::steady_clock::now())
+  {
+  }
+
+  void roundTrip()
+  {
+    if (!_enabled)
+      return;
+    int delay = (int)_options.rttMs;
+    if (_options.jitterMs > 0)
+      delay += (int)(_rng() % (2 * _options.jitterMs + 1)) - (int)_options.jitterMs;
+    if (delay > 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+  }
+
+  void transfer(size_t bytes)
+  {
+    if (!_enabled)
+      return;
+
+    auto now = std::chrono::steady_clock::now();
+    if (_freeAt < now)
+      _freeAt = now;
+    if (_options.bandwidthKbps > 0)
+      _freeAt += std::chrono::microseconds((uint64_t)bytes * 8000 / _options.bandwidthKbps);
+
+    if (_options.lossPercent > 0)
+    {
+      // Linux never retransmits faster than 200 ms
+      auto rto = std::chrono::milliseconds(std::max(200u, 2 * _options.rttMs));
+      unsigned threshold = (unsigned)(_options.lossPercent * 100);
+      for (size_t segments = (bytes + segmentSize - 1) / segmentSize; segments > 0; segments--)
+      {
+        if (_rng() % 10000 < threshold)
+          _freeAt += rto;
+      }
+    }
+    std::this_thread::sleep_until(_freeAt);
+  }
+
+private:
+  static const size_t segmentSize = 1460;
+  const ClientOptions &_options;
+  bool _enabled;
+  std::mt19937 _rng;
+  std::chrono::steady_clock::time_point _freeAt;
+};
+
+class Session
+{
+public:
+  // linkSeed 0 leaves the link unimpaired
+  explicit Session(const ClientOptions &options, unsigned linkSeed = 0) : _options(options),
+                                                                          _link(options, linkSeed)
+  {
+  }
+  ~Session() { close(); }
+
+  bool open()
+  {
+    close();
+    _link.roundTrip();
+    _ctrl = dial(_options.port);
+    if (_ctrl < 0)
+    {
+      return false;
+    }
+    _rxLen = 0;
+    std::string reply;
+    if (readReply(reply, true) != 220)
+    {
+      close();
+      return false;
+    }
+    if (command("USER " + _options.user, reply) != 331 ||
+        command("PASS " + _options.pass, reply) != 230 ||
+        command("TYPE I", reply) != 200)
+    {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close()
+  {
+    if (_ctrl >= 0)
+    {
+      // Wait for the server to drop the session, so the next login isn't
+      // accepted while this one is still being torn down
+      char drain[256];
+      if (sendLine("QUIT"))
+      {
+        while (recv(_ctrl, drain, sizeof(drain), 0) > 0)
+        {
+        }
+      }
+      ::close(_ctrl);
+      _ctrl = -1;
+    }
+  }
+
+  bool isOpen() const { return _ctrl >= 0; }
+
+  int command(const std::string &line, std::string &reply)
+  {
+    _link.roundTrip();
+    if (!sendLine(line))
+    {
+      return -1;
+    }
+    return readReply(reply);
+  }
+
+  // RETR/LIST/MLSD: returns bytes received or -1, optionally keeping the data
+  long download(const std::string &verb, const std::string &path, std::string *sink = nullptr)
+  {
+    std::string reply;
+    int data = openPassive();
+    if (data < 0)
+    {
+      return -1;
+    }
+    int code = command(verb + " " + path, reply);
+    if (code != 150 && code != 125)
+    {
+      ::close(data);
+      return -1;
+    }
+
+    char buffer[8192];
+    long total = 0;
+    ssize_t got;
+    while ((got = recv(data, buffer, sizeof(buffer), 0)) > 0)
+    {
+      _link.transfer(got);
+      total += got;
+      if (sink != nullptr)
+        sink->append(buffer, got);
+    }
+    ::close(data);
+    if (got < 0 || readReply(reply) != 226)
+    {
+      return -1;
+    }
+    return total;
+  }
+
+  bool upload(const std::string &path, const char *payload, size_t size)
+  {
+    std::string reply;
+    int data = openPassive();
+    if (data < 0)
+    {
+      return false;
+    }
+    int code = command("STOR " + path, reply);
+    if (code != 150 && code != 125)
+    {
+      ::close(data);
+      return false;
+    }
+
+    size_t sent = 0;
+    while (sent < size)
+    {
+      ssize_t n = send(data, payload + sent, std::min(size - sent, (size_t)8192), MSG_NOSIGNAL);
+      if (n <= 0)
+      {
+        ::close(data);
+        return false;
+      }
+      _link.transfer(n);
+      sent += n;
+    }
+    ::close(data);
+    return readReply(reply) == 226;
+  }
+
+  // Retries the login, the previous session may still be closing
+  bool openWithRetry(int attempts = 5)
+  {
+    for (int attempt = 0; attempt < attempts; attempt++)
+    {
+      if (open())
+      {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    return false;
+  }
+
+private:
+  const ClientOptions &_options;
+  Link _link;
+  int _ctrl = -1;
+  char _rx[4096];
+  size_t _rxLen = 0;
+
+  int dial(uint16_t port)
+  {
+    addrinfo hints = {}, *result = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(_options.host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0)
+    {
+      return -1;
+    }
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0)
+    {
+      timeval tv = {(time_t)(_options.timeoutMs / 1000), (suseconds_t)(_options.timeoutMs % 1000) * 1000};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (connect(fd, result->ai_addr, result->ai_addrlen) != 0)
+      {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(result);
+    return fd;
+  }
+
+  bool sendLine(const std::string &line)
+  {
+    std::string out = line + "\r\n";
+    return send(_ctrl, out.data(), out.size(), MSG_NOSIGNAL) == (ssize_t)out.size();
+  }
+
+  bool readLine(std::string &line)
+  {
+    while (true)
+    {
+      char *newline = (char *)memchr(_rx, '\n', _rxLen);
+      if (newline != nullptr)
+      {
+        size_t len = newline - _rx + 1;
+        line.assign(_rx, len > 1 && newline[-1] == '\r' ? len - 2 : len - 1);
+        memmove(_rx, _rx + len, _rxLen - len);
+        _rxLen -= len;
+        return true;
+      }
+      if (_rxLen == sizeof(_rx))
+      {
+        _rxLen = 0; // Overlong line, drop it
+      }
+      ssize_t got = recv(_ctrl, _rx + _rxLen, sizeof(_rx) - _rxLen, 0);
+      if (got <= 0)
+      {
+        return false;
+      }
+      _rxLen += got;
+    }
+  }
+
+  // Reads a complete (possibly multi-line) reply and returns its code
+  int readReply(std::string &reply, bool greeting = false)
+  {
+    std::string line;
+    reply.clear();
+    while (readLine(line))
+    {
+      reply += line + "\n";
+      if (line.size() >= 4 && isdigit(line[0]) && isdigit(line[1]) && isdigit(line[2]) && line[3] == ' ')
+      {
+        int code = atoi(line.c_str());
+        if (code != 220 || greeting)
+        {
+          return code;
+        }
+        // The server greets with more than one 220 line, skip the extras
+        reply.clear();
+      }
+    }
+    return -1;
+  }
+
+  int openPassive()
+  {
+    std::string reply;
+    if (command("PASV", reply) != 227)
+    {
+      return -1;
+    }
+    unsigned h[4], p[2];
+    const char *open = strchr(reply.c_str(), '(');
+    if (open == nullptr ||
+        sscanf(open, "(%u,%u,%u,%u,%u,%u)", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6)
+    {
+      return -1;
+    }
+    // Use the configured host, the advertised address may be unreachable
+    _link.roundTrip();
+    return dial((uint16_t)(p[0] << 8 | p[1]));
+  }
+};
+
+#endif // FTP_TOOLS_CLIENT_H
@@ -0,0 +1,468 @@
+/*******************************************************************************
+ **                                                                            **
+ **                    MULTI-CLIENT LOAD GENERATOR FOR FTP SERVER              **
+ **                                                                            **
+ *******************************************************************************/
+
+// Host-side tool: spawns N concurrent FTP clients against one server and
+// reports aggregate throughput, per-operation latency percentiles and errors.
+// Each client keeps a logged-in session and picks operations from a weighted
+// mix; the "login" operation opens a fresh connection to measure session setup.
+//
+// Soak mode (--heap-interval) samples the server heap with SITE HEAP during the
+// run and fails when fragmentation or heap loss cross the given thresholds, so
+// long runs catch the slow leaks and fragmentation that reboot units in the
+// field.
+//
+// --rtt, --jitter, --bandwidth and --loss emulate a WiFi link on the client
+// side, so tuning done on a wired LAN or on localhost sees field conditions.
+//
+// Build (Linux/macOS):
+//   g++ -std=c++17 -O2 -pthread -o ftp_loadgen ftp_loadgen.cpp
+//
+// Example:
+//   ./ftp_loadgen --host 192.168.0.50 --user esp32 --pass esp32
+//                 --clients 8 --seconds 30 --mix login=1,retr=4,stor=4,list=1
+//   ./ftp_loadgen --host 192.168.0.50 --clients 1 --seconds 86400
+//                 --heap-interval 60 --max-frag 40 --max-heap-loss 4096
+//   ./ftp_loadgen --host 127.0.0.1 --port 2121 --rtt 30 --jitter 10
+//                 --bandwidth 8000 --loss 0.5
+
+#include "ftp_client.h"
+#include <vector>
+
+enum Op
+{
+  OP_LOGIN,
+  OP_RETR,
+  OP_STOR,
+  OP_LIST,
+  OP_COUNT
+};
+
+static const char *opNames[OP_COUNT] = {"login", "retr", "stor", "list"};
+
+struct Options
+{
+  ClientOptions client;
+  std::string dir = "/loadgen";
+  std::string statsPath;
+  unsigned clients = 4;
+  unsigned seconds = 10;
+  unsigned weights[OP_COUNT] = {1, 4, 4, 1};
+  size_t retrSize = 64 * 1024;
+  size_t storSize = 512;
+  unsigned heapInterval = 0; // Seconds between SITE HEAP samples, 0 disables
+  unsigned maxFrag = 100;
+  long maxHeapLoss = -1;
+  unsigned seed = 1; // Link emulation RNG
+};
+
+struct HeapSample
+{
+  double seconds;
+  unsigned freeBytes;
+  unsigned minFreeBytes;
+  unsigned largestBlock;
+  unsigned fragmentation;
+  unsigned commands;
+};
+
+struct Stats
+{
+  std::vector<double> latency[OP_COUNT]; // Milliseconds, successful ops only
+  uint64_t errors[OP_COUNT] = {};
+  uint64_t bytes[OP_COUNT] = {};
+  uint64_t reconnects = 0;
+};
+
+static Options options;
+static std::vector<HeapSample> heapSamples; // Written by client 0 only
+
+static bool sampleHeap(Session &session, HeapSample &sample)
+{
+  std::string reply;
+  return session.command("SITE HEAP", reply) == 200 &&
+         sscanf(reply.c_str(), "200 Free=%u MinFree=%u MaxBlock=%u Frag=%u%% Commands=%u",
+                &sample.freeBytes, &sample.minFreeBytes, &sample.largestBlock,
+                &sample.fragmentation, &sample.commands) == 5;
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void runClient(unsigned id, std::chrono::steady_clock::time_point start,
+                      std::chrono::steady_clock::time_point deadline, Stats &stats)
+{
+  std::mt19937 rng(id * 7919 + 1);
+  unsigned total = 0;
+  for (unsigned w : options.weights)
+    total += w;
+  std::vector<char> payload(options.storSize, 'a' + id % 26);
+
+  unsigned linkSeed = options.seed + id;
+  Session session(options.client, linkSeed);
+  unsigned sequence = 0;
+  auto nextSample = start;
+  while (std::chrono::steady_clock::now() < deadline)
+  {
+    if (id == 0 && options.heapInterval > 0 && session.isOpen() &&
+        std::chrono::steady_clock::now() >= nextSample)
+    {
+      HeapSample sample;
+      if (sampleHeap(session, sample))
+      {
+        sample.seconds = elapsedMs(start) / 1000.0;
+        heapSamples.push_back(sample);
+      }
+      nextSample += std::chrono::seconds(options.heapInterval);
+    }
+
+    unsigned pick = rng() % total;
+    int op = 0;
+    while (pick >= options.weights[op])
+      pick -= options.weights[op++];
+
+    if (op != OP_LOGIN && !session.isOpen())
+    {
+      if (!session.open())
+      {
+        stats.errors[op]++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        continue;
+      }
+      stats.reconnects++;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    long bytes = 0;
+    bool ok = false;
+    switch (op)
+    {
+    case OP_LOGIN:
+    {
+      Session fresh(options.client, linkSeed);
+      ok = fresh.open();
+      break;
+    }
+    case OP_RETR:
+      bytes = session.download("RETR", options.dir + "/seed.bin");
+      ok = bytes == (long)options.retrSize;
+      break;
+    case OP_STOR:
+      ok = session.upload(options.dir + "/c" + std::to_string(id) + "_" + std::to_string(sequence++ % 64) + ".bin",
+                          payload.data(), payload.size());
+      bytes = payload.size();
+      break;
+    case OP_LIST:
+      bytes = session.download("MLSD", options.dir);
+      ok = bytes >= 0;
+      break;
+    }
+
+    if (ok)
+    {
+      stats.latency[op].push_back(elapsedMs(start));
+      stats.bytes[op] += bytes;
+    }
+    else
+    {
+      stats.errors[op]++;
+      session.close(); // Unknown state, start over
+    }
+  }
+}
+
+static bool prepare()
+{
+  Session session(options.client);
+  if (!session.openWithRetry())
+  {
+    fprintf(stderr, "Can't log in to %s:%u\n", options.client.host.c_str(), options.client.port);
+    return false;
+  }
+  std::string reply;
+  session.command("MKD " + options.dir, reply); // May already exist
+  std::vector<char> seed(options.retrSize);
+  for (size_t i = 0; i < seed.size(); i++)
+    seed[i] = (char)i;
+  if (!session.upload(options.dir + "/seed.bin", seed.data(), seed.size()))
+  {
+    fprintf(stderr, "Can't upload %s/seed.bin\n", options.dir.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Prints the samples and returns false if a threshold was crossed
+static bool reportHeap(double seconds)
+{
+  Session session(options.client);
+  HeapSample last;
+  if (session.openWithRetry() && sampleHeap(session, last))
+  {
+    last.seconds = seconds;
+    heapSamples.push_back(last);
+  }
+  if (heapSamples.size() < 2)
+  {
+    printf("\nHeap: not enough SITE HEAP samples\n");
+    return false;
+  }
+
+  printf("\n%9s %10s %10s %10s %6s %10s\n", "time s", "free", "min free", "max block", "frag", "commands");
+  size_t step = (heapSamples.size() + 19) / 20; // At most ~20 rows
+  unsigned worstFrag = 0;
+  for (size_t i = 0; i < heapSamples.size(); i++)
+  {
+    const HeapSample &sample = heapSamples[i];
+    worstFrag = std::max(worstFrag, sample.fragmentation);
+    if (i % step == 0 || i + 1 == heapSamples.size())
+    {
+      printf("%9.0f %10u %10u %10u %5u%% %10u\n", sample.seconds, sample.freeBytes, sample.minFreeBytes,
+             sample.largestBlock, sample.fragmentation, sample.commands);
+    }
+  }
+
+  const HeapSample &first = heapSamples.front();
+  long loss = (long)first.freeBytes - (long)heapSamples.back().freeBytes;
+  unsigned commands = heapSamples.back().commands - first.commands;
+  printf("\nheap loss: %ld bytes over %u commands (%.3f bytes/command), worst fragmentation %u%%\n",
+         loss, commands, commands ? (double)loss / commands : 0.0, worstFrag);
+
+  bool ok = true;
+  if (worstFrag > options.maxFrag)
+  {
+    printf("FAIL: fragmentation %u%% above %u%%\n", worstFrag, options.maxFrag);
+    ok = false;
+  }
+  if (options.maxHeapLoss >= 0 && loss > options.maxHeapLoss)
+  {
+    printf("FAIL: heap loss %ld bytes above %ld\n", loss, options.maxHeapLoss);
+    ok = false;
+  }
+  return ok;
+}
+
+static void scrapeStats()
+{
+  Session session(options.client);
+  if (!session.openWithRetry())
+  {
+    printf("\nServer stats: can't log in\n");
+    return;
+  }
+  std::string content;
+  printf("\nServer stats (%s):\n", options.statsPath.c_str());
+  if (session.download("RETR", options.statsPath, &content) < 0)
+  {
+    printf("  unavailable\n");
+    return;
+  }
+  fwrite(content.data(), 1, content.size(), stdout);
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+  if (values.empty())
+    return 0;
+  size_t index = std::min(values.size() - 1, (size_t)(p / 100.0 * values.size()));
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index];
+}
+
+static void report(Stats &total, double seconds)
+{
+  printf("\n%-6s %9s %8s %9s %9s %9s %9s %9s %10s\n",
+         "op", "ok", "errors", "ops/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "KB/s");
+  uint64_t allOk = 0, allErrors = 0;
+  for (int op = 0; op < OP_COUNT; op++)
+  {
+    std::vector<double> &lat = total.latency[op];
+    double max = lat.empty() ? 0 : *std::max_element(lat.begin(), lat.end());
+    printf("%-6s %9zu %8llu %9.1f %9.2f %9.2f %9.2f %9.2f %10.1f\n",
+           opNames[op], lat.size(), (unsigned long long)total.errors[op],
+           lat.size() / seconds, percentile(lat, 50), percentile(lat, 90), percentile(lat, 99), max,
+           total.bytes[op] / 1024.0 / seconds);
+    allOk += lat.size();
+    allErrors += total.errors[op];
+  }
+  printf("\ntotal: %llu ops, %llu errors, %.1f ops/s, %llu reconnects\n",
+         (unsigned long long)allOk, (unsigned long long)allErrors, allOk / seconds,
+         (unsigned long long)total.reconnects);
+}
+
+static bool parseMix(const char *mix)
+{
+  unsigned weights[OP_COUNT] = {};
+  std::string spec(mix);
+  size_t start = 0;
+  while (start < spec.size())
+  {
+    size_t end = spec.find(',', start);
+    std::string item = spec.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    size_t eq = item.find('=');
+    int op = OP_COUNT;
+    for (int i = 0; i < OP_COUNT && eq != std::string::npos; i++)
+      if (item.compare(0, eq, opNames[i]) == 0)
+        op = i;
+    if (op == OP_COUNT)
+      return false;
+    weights[op] = atoi(item.c_str() + eq + 1);
+    start = end == std::string::npos ? spec.size() : end + 1;
+  }
+  unsigned sum = 0;
+  for (int i = 0; i < OP_COUNT; i++)
+    sum += weights[i];
+  if (sum == 0)
+    return false;
+  memcpy(options.weights, weights, sizeof(weights));
+  return true;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --host <addr>        server address (127.0.0.1)\n"
+          "  --port <n>           control port (21)\n"
+          "  --user <name>        login user (esp32)\n"
+          "  --pass <password>    login password (esp32)\n"
+          "  --clients <n>        concurrent clients (4)\n"
+          "  --seconds <n>        test duration (10)\n"
+          "  --mix <spec>         op weights, e.g. login=1,retr=4,stor=4,list=1\n"
+          "  --dir <path>         server directory used by the test (/loadgen)\n"
+          "  --retr-size <bytes>  size of the file downloaded by retr (65536)\n"
+          "  --stor-size <bytes>  size of each file uploaded by stor (512)\n"
+          "  --timeout <ms>       socket timeout (10000)\n"
+          "  --stats <path>       file downloaded and printed after the run\n"
+          "  --heap-interval <s>  sample the server heap (SITE HEAP) every s seconds\n"
+          "  --max-frag <pct>     fail if heap fragmentation goes above pct\n"
+          "  --max-heap-loss <b>  fail if free heap drops by more than b bytes\n"
+          "  --rtt <ms>           emulated round trip time per command and connect\n"
+          "  --jitter <ms>        random +/- variation added to each round trip\n"
+          "  --bandwidth <kbit/s> emulated link bandwidth for data transfers\n"
+          "  --loss <pct>         segments lost, each costs a retransmission timeout\n"
+          "  --seed <n>           seed for jitter and loss (1)\n",
+          name);
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (value == nullptr)
+    {
+      usage(argv[0]);
+      return 2;
+    }
+    i++;
+    if (strcmp(arg, "--host") == 0)
+      options.client.host = value;
+    else if (strcmp(arg, "--port") == 0)
+      options.client.port = atoi(value);
+    else if (strcmp(arg, "--user") == 0)
+      options.client.user = value;
+    else if (strcmp(arg, "--pass") == 0)
+      options.client.pass = value;
+    else if (strcmp(arg, "--clients") == 0)
+      options.clients = std::max(1, atoi(value));
+    else if (strcmp(arg, "--seconds") == 0)
+      options.seconds = std::max(1, atoi(value));
+    else if (strcmp(arg, "--dir") == 0)
+      options.dir = value;
+    else if (strcmp(arg, "--retr-size") == 0)
+      options.retrSize = strtoul(value, nullptr, 10);
+    else if (strcmp(arg, "--stor-size") == 0)
+      options.storSize = strtoul(value, nullptr, 10);
+    else if (strcmp(arg, "--timeout") == 0)
+      options.client.timeoutMs = std::max(100, atoi(value));
+    else if (strcmp(arg, "--stats") == 0)
+      options.statsPath = value;
+    else if (strcmp(arg, "--heap-interval") == 0)
+      options.heapInterval = std::max(0, atoi(value));
+    else if (strcmp(arg, "--max-frag") == 0)
+      options.maxFrag = std::max(0, atoi(value));
+    else if (strcmp(arg, "--max-heap-loss") == 0)
+      options.maxHeapLoss = atol(value);
+    else if (strcmp(arg, "--rtt") == 0)
+      options.client.rttMs = std::max(0, atoi(value));
+    else if (strcmp(arg, "--jitter") == 0)
+      options.client.jitterMs = std::max(0, atoi(value));
+    else if (strcmp(arg, "--bandwidth") == 0)
+      options.client.bandwidthKbps = std::max(0, atoi(value));
+    else if (strcmp(arg, "--loss") == 0)
+      options.client.lossPercent = std::min(100.0, std::max(0.0, atof(value)));
+    else if (strcmp(arg, "--seed") == 0)
+      options.seed = std::max(1, atoi(value));
+    else if (strcmp(arg, "--mix") == 0)
+    {
+      if (!parseMix(value))
+      {
+        fprintf(stderr, "Invalid mix: %s\n", value);
+        return 2;
+      }
+    }
+    else
+    {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (!prepare())
+  {
+    return 1;
+  }
+
+  printf("%u clients for %u s against %s:%u\n", options.clients, options.seconds,
+         options.client.host.c_str(), options.client.port);
+  if (options.client.impaired())
+  {
+    printf("link: rtt %u ms +/- %u ms, %u kbit/s, %.2f%% loss, seed %u\n", options.client.rttMs, options.client.jitterMs,
+           options.client.bandwidthKbps, options.client.lossPercent, options.seed);
+  }
+
+  std::vector<Stats> stats(options.clients);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::seconds(options.seconds);
+  for (unsigned i = 0; i < options.clients; i++)
+  {
+    threads.emplace_back(runClient, i, start, deadline, std::ref(stats[i]));
+  }
+  for (std::thread &thread : threads)
+  {
+    thread.join();
+  }
+  double seconds = elapsedMs(start) / 1000.0;
+
+  Stats total;
+  for (Stats &s : stats)
+  {
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+      total.latency[op].insert(total.latency[op].end(), s.latency[op].begin(), s.latency[op].end());
+      total.errors[op] += s.errors[op];
+      total.bytes[op] += s.bytes[op];
+    }
+    total.reconnects += s.reconnects;
+  }
+  report(total, seconds);
+
+  bool heapOk = options.heapInterval == 0 || reportHeap(seconds);
+
+  if (!options.statsPath.empty())
+  {
+    scrapeStats();
+  }
+
+  uint64_t errors = 0;
+  for (int op = 0; op < OP_COUNT; op++)
+    errors += total.errors[op];
+  return errors == 0 && heapOk ? 0 : 1;
+}
@@ -0,0 +1,351 @@
+/*******************************************************************************
+ **                                                                            **
+ **                 MICROBENCHMARKS FOR FTP SERVER PROTOCOL HELPERS            **
+ **                                                                            **
+ *******************************************************************************/
+
+// Host-side harness for the per-command hot paths in src/FtpProtocol.cpp:
+// command line parsing, verb dispatch, path resolution and listing line
+// formatting, plus the FtpSpscQueue handoff between two threads and the
+// FtpLz block codec. Reports ns/op and heap allocations per op (counted by replacing
+// the global operator new), so any regression in either shows up directly.
+//
+// Build (Linux/macOS):
+//   g++ -std=c++17 -O2 -pthread -I../../src -o ftp_microbench ftp_microbench.cpp ../../src/FtpProtocol.cpp ../../src/FtpLz.cpp
+//
+// Usage: ftp_microbench [filter]   runs only benchmarks whose name contains filter
+
+#include "FtpLz.h"
+#include "FtpProtocol.h"
+#include "FtpSpscQueue.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+
+// Keeps results observable so the optimizer can't drop the work
+static volatile uintptr_t sink;
+
+struct Benchmark
+{
+  const char *name;
+  size_t (*run)(size_t iterations); // Returns ops performed
+};
+
+// Inputs
+
+static const char *commandBatch[] = {
+    "USER esp32",
+    "PASS secret",
+    "SYST",
+    "FEAT",
+    "PWD",
+    "TYPE I",
+    "CWD /data/logs/2024/january",
+    "PASV",
+    "MLSD",
+    "PASV",
+    "RETR sensor_readings_0001.csv",
+    "PASV",
+    "STOR upload with spaces in the name.bin",
+    "SIZE /data/logs/2024/january/sensor_readings_0001.csv",
+    "RNFR old name.txt",
+    "RNTO new name.txt",
+    "DELE new name.txt",
+    "MKD archive",
+    "RMD archive",
+    "QUIT",
+};
+static const size_t commandCount = sizeof(commandBatch) / sizeof(commandBatch[0]);
+
+static const char *deepCwd = "/data/logs/2024/january/week1/monday/device-0042/channel-03";
+static const char *deepRelative = "raw/samples/segment-000123/part-0007/readings.csv";
+static const char *deepAbsolute = "/data/logs/2024/january/week1/monday/device-0042/channel-03/raw/readings.csv";
+
+// Benchmarks
+
+static size_t benchParseShort(size_t iterations)
+{
+  char line[256];
+  char command[FTP_COMMAND_SIZE];
+  char *parameters;
+  for (size_t i = 0; i < iterations; i++)
+  {
+    memcpy(line, "RETR file.txt", 14);
+    FtpProtocol::parseCommandLine(line, command, sizeof(command), parameters);
+    sink = (uintptr_t)parameters + command[0];
+  }
+  return iterations;
+}
+
+static size_t benchParseLongArgument(size_t iterations)
+{
+  char source[256];
+  memset(source, 'a', sizeof(source) - 1);
+  memcpy(source, "STOR    ", 8); // Leading spaces before the argument
+  source[sizeof(source) - 1] = '\0';
+
+  char line[256];
+  char command[FTP_COMMAND_SIZE];
+  char *parameters;
+  for (size_t i = 0; i < iterations; i++)
+  {
+    memcpy(line, source, sizeof(line));
+    FtpProtocol::parseCommandLine(line, command, sizeof(command), parameters);
+    sink = (uintptr_t)parameters + command[0];
+  }
+  return iterations;
+}
+
+static size_t benchPipelinedBatch(size_t iterations)
+{
+  char line[256];
+  char command[FTP_COMMAND_SIZE];
+  char *parameters;
+  for (size_t i = 0; i < iterations; i++)
+  {
+    for (size_t c = 0; c < commandCount; c++)
+    {
+      strcpy(line, commandBatch[c]);
+      FtpProtocol::parseCommandLine(line, command, sizeof(command), parameters);
+      sink = FtpProtocol::lookupVerb(command) + (uintptr_t)parameters;
+    }
+  }
+  return iterations * commandCount;
+}
+
+static size_t benchLookupVerb(size_t iterations)
+{
+  static const char *verbs[] = {"USER", "CWD", "MLSD", "RETR", "STOR", "SYST", "QUIT", "XYZW"};
+  const size_t count = sizeof(verbs) / sizeof(verbs[0]);
+  for (size_t i = 0; i < iterations; i++)
+  {
+    sink = FtpProtocol::lookupVerb(verbs[i % count]);
+  }
+  return iterations;
+}
+
+static size_t benchMakePathRelative(size_t iterations)
+{
+  char path[512];
+  for (size_t i = 0; i < iterations; i++)
+  {
+    sink = FtpProtocol::makePath(path, sizeof(path), deepCwd, deepRelative) + path[1];
+  }
+  return iterations;
+}
+
+static size_t benchMakePathAbsolute(size_t iterations)
+{
+  char path[512];
+  for (size_t i = 0; i < iterations; i++)
+  {
+    sink = FtpProtocol::makePath(path, sizeof(path), deepCwd, deepAbsolute) + path[1];
+  }
+  return iterations;
+}
+
+static size_t benchMakePathRejected(size_t iterations)
+{
+  char path[512];
+  for (size_t i = 0; i < iterations; i++)
+  {
+    sink = FtpProtocol::makePath(path, sizeof(path), deepCwd, "../../../../etc/passwd") + path[1];
+  }
+  return iterations;
+}
+
+static size_t benchFormatMlsd(size_t iterations)
+{
+  char line[192];
+  for (size_t i = 0; i < iterations; i++)
+  {
+    sink = FtpProtocol::formatListLine(line, sizeof(line), "sensor_readings_0001.csv", (uint32_t)i, false, true);
+  }
+  return iterations;
+}
+
+static size_t benchFormatList(size_t iterations)
+{
+  char line[192];
+  for (size_t i = 0; i < iterations; i++)
+  {
+    sink = FtpProtocol::formatListLine(line, sizeof(line), "sensor_readings_0001.csv", (uint32_t)i, i & 1, false);
+  }
+  return iterations;
+}
+
+static size_t benchSpscSameThread(size_t iterations)
+{
+  static FtpSpscQueue<void *, 8> queue;
+  void *item = nullptr;
+  for (size_t i = 0; i < iterations; i++)
+  {
+    queue.push((void *)i);
+    queue.pop(item);
+    sink = (uintptr_t)item;
+  }
+  return iterations;
+}
+
+static size_t benchSpscCrossThread(size_t iterations)
+{
+  // Ping-pong: each op is a handoff to the other thread and back. Waiters
+  // yield so a single-core host still makes progress.
+  static FtpSpscQueue<size_t, 8> request;
+  static FtpSpscQueue<size_t, 8> reply;
+  std::thread worker([iterations]()
+                     {
+                       size_t item;
+                       for (size_t i = 0; i < iterations; i++)
+                       {
+                         while (!request.pop(item))
+                           std::this_thread::yield();
+                         while (!reply.push(item + 1))
+                           std::this_thread::yield();
+                       } });
+  size_t item;
+  for (size_t i = 0; i < iterations; i++)
+  {
+    while (!request.push(i))
+      std::this_thread::yield();
+    while (!reply.pop(item))
+      std::this_thread::yield();
+    sink = item;
+  }
+  worker.join();
+  return iterations;
+}
+
+// One 4 KiB block of sensor log, the kind of file the compressed directory holds
+static uint8_t lzBlock[4096];
+static uint8_t lzPacked[FTP_LZ_BOUND(sizeof(lzBlock))];
+static size_t lzPackedSize = 0;
+static uint16_t lzTable[FTP_LZ_HASH_SIZE];
+
+static void fillLzBlock()
+{
+  size_t fill = 0;
+  unsigned seed = 1;
+  for (unsigned i = 0; fill < sizeof(lzBlock); i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    char line[64];
+    int len = snprintf(line, sizeof(line), "2024-01-15 08:%02u:%02u sensor=%u temp=%u.%02u\n", i / 60 % 60, i % 60,
+                       i % 7, 20 + (seed >> 16) % 5, (seed >> 8) % 100);
+    size_t chunk = len < (int)(sizeof(lzBlock) - fill) ? len : sizeof(lzBlock) - fill;
+    memcpy(lzBlock + fill, line, chunk);
+    fill += chunk;
+  }
+  lzPackedSize = FtpLz::compress(lzBlock, sizeof(lzBlock), lzPacked, sizeof(lzPacked), lzTable);
+}
+
+static size_t benchLzCompress(size_t iterations)
+{
+  for (size_t i = 0; i < iterations; i++)
+  {
+    sink = FtpLz::compress(lzBlock, sizeof(lzBlock), lzPacked, sizeof(lzPacked), lzTable);
+  }
+  return iterations;
+}
+
+static size_t benchLzDecompress(size_t iterations)
+{
+  static uint8_t out[sizeof(lzBlock)];
+  for (size_t i = 0; i < iterations; i++)
+  {
+    sink = FtpLz::decompress(lzPacked, lzPackedSize, out, sizeof(out));
+  }
+  return iterations;
+}
+
+static const Benchmark benchmarks[] = {
+    {"parse/short", benchParseShort},
+    {"parse/long_argument", benchParseLongArgument},
+    {"parse/pipelined_batch", benchPipelinedBatch},
+    {"dispatch/lookup_verb", benchLookupVerb},
+    {"path/deep_relative", benchMakePathRelative},
+    {"path/deep_absolute", benchMakePathAbsolute},
+    {"path/traversal_rejected", benchMakePathRejected},
+    {"format/mlsd_line", benchFormatMlsd},
+    {"format/list_line", benchFormatList},
+    {"spsc/same_thread", benchSpscSameThread},
+    {"spsc/round_trip", benchSpscCrossThread},
+    {"lz/compress_4k", benchLzCompress},
+    {"lz/decompress_4k", benchLzDecompress},
+};
+
+// Grows the iteration count until a run takes long enough to time reliably
+static void runBenchmark(const Benchmark &benchmark)
+{
+  const double minSeconds = 0.2;
+  size_t iterations = 1000;
+  while (true)
+  {
+    size_t allocationsBefore = allocations;
+    auto start = std::chrono::steady_clock::now();
+    size_t ops = benchmark.run(iterations);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t allocated = allocations - allocationsBefore;
+
+    if (seconds >= minSeconds || iterations >= ((size_t)1 << 40))
+    {
+      printf("%-26s %12zu %10.1f %12.3f\n", benchmark.name, ops, seconds * 1e9 / ops, (double)allocated / ops);
+      return;
+    }
+    iterations *= seconds > 0.01 ? (size_t)(minSeconds / seconds) + 1 : 10;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *filter = argc > 1 ? argv[1] : nullptr;
+  fillLzBlock();
+  printf("%-26s %12s %10s %12s\n", "benchmark", "ops", "ns/op", "allocs/op");
+  for (const Benchmark &benchmark : benchmarks)
+  {
+    if (filter == nullptr || strstr(benchmark.name, filter) != nullptr)
+    {
+      runBenchmark(benchmark);
+    }
+  }
+  return 0;
+}
@@ -20,42 +20,94 @@
 #include "ESP32FtpServer.h"
 #include <LittleFS.h>
 #include <WiFi.h>
-
-// Static member initialization
-WiFiServer FtpServer::ftpServer(FTP_CTRL_PORT);
-WiFiServer FtpServer::dataServer(FTP_DATA_PORT_PASV);
-
-FtpServer::FtpServer() : _username(""),
+#include <errno.h>
+#include <lwip/sockets.h>
+#include <new>
+#include <stdarg.h>
+
+FtpServer::FtpServer(uint16_t ctrlPort, uint16_t passivePort, fs::FS &fs)
+                       : ftpServer(ctrlPort),
+                         dataServer(passivePort),
+                         _ctrlPort(ctrlPort),
+                         _fs(fs),
+                         _username(""),
                          _password(""),
-                         _activeTimeout(FTP_TIME_OUT * 60 * 1000),
-                         _passivePort(FTP_DATA_PORT_PASV),
                          _maxAttempts(3),
                          _currentAttempts(0),
-                         _transferStatus(0),
-                         _cmdStatus(FTP_CMD_IDLE),
+                         _tokenTtl(0),
+                         _tlsCert(nullptr),
+                         _tlsKey(nullptr),
+                         _tlsRequired(false),
+                         _tls(nullptr),
+                         _protPrivate(false),
                          _dataConnType(FTP_DATA_PASSIVE),
-                         _rnfrCmd(false),
+                         _activeTimeout(FTP_TIME_OUT * 60 * 1000),
+                         _passivePort(passivePort),
+                         _transferStatus(0),
                          _bytesTransferred(0),
+                         _bytesRemaining(0),
+                         _packTransfer(false),
+                         _packSpilled(false),
+                         _transferReplaces(false),
+                         _restartOffset(0),
+                         _transferOldSize(0),
+                         _transferOldStored(0),
+                         _lockMode(FTP_LOCK_NONE),
+                         _pack(fs),
+                         _freeBytes(0),
+                         _spaceValid(false),
+                         _millisSpaceSync(0),
+                         _shardBuckets(0),
+                         _index(fs),
+                         _hashTrees(false),
+                         _uploadTree(fs),
+                         _lazyTree(fs),
+                         _hashRemaining(0),
+                         _hashStamp(0),
+                         _traceSize(0),
+                         _statsEnabled(false),
+                         _millisSessionStart(0),
+                         _heapAtSessionStart(0),
+                         _millisLastSample(0),
+                         _loopBudget(0),
+                         _stallCount(0),
+                         _commandThisLoop(false),
+                         _asyncFs(false),
+                         _fsJob(nullptr),
+                         _fsTask(nullptr),
+                         _fsPending(false),
+                         _rnfrCmd(false),
+                         _commandCount(0),
+                         _started(false),
                          _log(FTPLog::DISABLE),
-                         _started(false)
+                         _idleSuspend(0),
+                         _millisLastActivity(0),
+                         _reclaimedBytes(0),
+                         _buffer(nullptr),
+                         _bufferSize(FTP_BUF_SIZE),
+                         _cmdStatus(FTP_CMD_IDLE)
 {
+  memset(&_counters, 0, sizeof(_counters));
+  memset(&_memory, 0, sizeof(_memory));
+  _memory.stackHighWater = UINT32_MAX;
   strlcpy(_cwd, "/", sizeof(_cwd));
+  _transferType = 'A';
+  _transferPath[0] = '\0';
+  _hashSourcePath[0] = '\0';
+}
+
+FtpServer::~FtpServer()
+{
+  end();
 }
 
 void FtpServer::begin(const String &username, const String &password)
 {
   _username = username;
   _password = password;
+  rekeyTokens();
 
-  if (!LittleFS.begin(true))
-  {
-    return;
-  }
-
-  ftpServer.begin();
-  dataServer.begin();
-  _cmdStatus = FTP_CMD_WAIT_CONNECTION;
-  _started = true;
+  startServer();
 }
 
 void FtpServer::begin(const String &username, const String &password, FTPLog log)
@@ -63,26 +115,182 @@ void FtpServer::begin(const String &username, const String &password, FTPLog log
   _username = username;
   _password = password;
   _log = log;
+  rekeyTokens();
+
+  if (startServer() && _log == FTPLog::ENABLE)
+  {
+    LOG_INFO("FTP Server initialized");
+  }
+}
+
+bool FtpServer::startServer()
+{
+  if (_started)
+  {
+    return true;
+  }
 
-  if (!LittleFS.begin(true))
+  // Other filesystems (SD, SD_MMC, ...) are mounted by the application
+  if (&_fs == &LittleFS && !LittleFS.begin(true))
   {
     if (_log == FTPLog::ENABLE)
     {
       LOG_INFO("Failed to mount LittleFS");
     }
 
-    return;
+    return false;
+  }
+
+  // Required allocations come before anything is started, so a failure
+  // only has them to undo
+  _buffer = (char *)malloc(_bufferSize);
+  if (_buffer == nullptr)
+  {
+    if (_log == FTPLog::ENABLE)
+    {
+      LOG_ERROR("Failed to allocate %u bytes for transfer buffer", (unsigned)_bufferSize);
+    }
+    return false;
+  }
+  _fsJob = (FsJob *)malloc(sizeof(FsJob));
+  if (_fsJob == nullptr)
+  {
+    if (_log == FTPLog::ENABLE)
+    {
+      LOG_ERROR("Failed to allocate the filesystem job");
+    }
+    free(_buffer);
+    _buffer = nullptr;
+    return false;
+  }
+
+  if (_shardBuckets > 0 && !_fs.exists(_shardDir.c_str()))
+  {
+    _fs.mkdir(_shardDir.c_str());
+  }
+
+  if (_packDir.length() > 0 && !_pack.begin(_packDir.c_str()) && _log == FTPLog::ENABLE)
+  {
+    LOG_WARN("Failed to open pack directory %s", _packDir.c_str());
   }
 
-  ftpServer.begin();
-  dataServer.begin();
+  if (_traceSize > 0 && !_trace.begin(_traceSize) && _log == FTPLog::ENABLE)
+  {
+    LOG_WARN("Failed to allocate %u bytes for the trace", (unsigned)_traceSize);
+  }
+
+  if (_asyncFs && !startFsTask() && _log == FTPLog::ENABLE)
+  {
+    LOG_WARN("Failed to start the filesystem task, running metadata commands inline");
+  }
+
+  if (_tlsCert != nullptr)
+  {
+    _tls = new (std::nothrow) FtpTlsContext();
+    if (_tls == nullptr || !_tls->begin(_tlsCert, _tlsKey))
+    {
+      if (_log == FTPLog::ENABLE)
+      {
+        LOG_WARN("Failed to set up TLS, AUTH TLS disabled");
+      }
+      delete _tls;
+      _tls = nullptr;
+    }
+  }
+
+  ftpServer.begin(_ctrlPort);
+  dataServer.begin(_passivePort);
   _cmdStatus = FTP_CMD_WAIT_CONNECTION;
+  _millisLastActivity = millis();
   _started = true;
+  return true;
+}
+
+FtpServer::HeapStats FtpServer::getHeapStats() const
+{
+  HeapStats stats;
+  stats.freeBytes = ESP.getFreeHeap();
+  stats.minFreeBytes = ESP.getMinFreeHeap();
+  stats.largestBlock = ESP.getMaxAllocHeap();
+  stats.fragmentation = stats.freeBytes > 0 && stats.largestBlock < stats.freeBytes
+                            ? 100 - (uint64_t)stats.largestBlock * 100 / stats.freeBytes
+                            : 0;
+  stats.commands = _commandCount;
+  return stats;
+}
+
+FtpServer::MemoryStats FtpServer::getMemoryStats() const
+{
+  MemoryStats stats = _memory;
+  if (stats.stackHighWater == UINT32_MAX)
+  {
+    stats.stackHighWater = 0; // Not sampled yet
+  }
+  return stats;
+}
+
+size_t FtpServer::end()
+{
+  if (!_started)
+  {
+    return 0;
+  }
+
+  uint32_t freeBefore = ESP.getFreeHeap();
+
+  if (_client.connected())
+  {
+    disconnectClient();
+  }
+  else
+  {
+    abortTransfer();
+  }
+  _client.stop();
+  _data.stop();
+  ftpServer.end();
+  dataServer.end();
+
+  stopFsTask();
+  free(_fsJob);
+  _fsJob = nullptr;
+  free(_buffer);
+  _buffer = nullptr;
+  _pack.end();
+  _trace.end();
+  endHashBuild(false);
+  delete _tls;
+  _tls = nullptr;
+  _cmdStatus = FTP_CMD_IDLE;
+  _started = false;
+
+  uint32_t freeAfter = ESP.getFreeHeap();
+  _reclaimedBytes = freeAfter > freeBefore ? freeAfter - freeBefore : 0;
 
   if (_log == FTPLog::ENABLE)
   {
-    LOG_INFO("FTP Server initialized");
+    LOG_INFO("FTP Server stopped, %u bytes released", (unsigned)_reclaimedBytes);
+  }
+  return _reclaimedBytes;
+}
+
+bool FtpServer::resume()
+{
+  if (_started)
+  {
+    return true;
+  }
+
+  if (!startServer())
+  {
+    return false;
   }
+
+  if (_log == FTPLog::ENABLE)
+  {
+    LOG_INFO("FTP Server resumed");
+  }
+  return true;
 }
 
 void FtpServer::setActiveTimeout(uint32_t timeout)
@@ -93,6 +301,16 @@ void FtpServer::setActiveTimeout(uint32_t timeout)
 void FtpServer::setPassivePort(uint16_t port)
 {
   _passivePort = port;
+  if (_started)
+  {
+    dataServer.end();
+    dataServer.begin(_passivePort);
+  }
+}
+
+void FtpServer::setBufferSize(size_t size)
+{
+  _bufferSize = constrain(size, (size_t)64, (size_t)FTP_BUF_MAX);
 }
 
 void FtpServer::setMaxLoginAttempts(uint8_t attempts)
@@ -100,6 +318,154 @@ void FtpServer::setMaxLoginAttempts(uint8_t attempts)
   _maxAttempts = attempts;
 }
 
+void FtpServer::setIdleSuspend(uint32_t seconds)
+{
+  _idleSuspend = seconds * 1000;
+}
+
+void FtpServer::setShardedDirectory(const char *dir, uint8_t buckets)
+{
+  _shardDir = dir;
+  if (_shardDir.length() > 1 && _shardDir[_shardDir.length() - 1] == '/')
+  {
+    _shardDir.remove(_shardDir.length() - 1);
+  }
+  _shardBuckets = buckets;
+}
+
+void FtpServer::setCompressedDirectory(const char *dir)
+{
+  _compressDir = dir;
+  if (_compressDir.length() > 1 && _compressDir[_compressDir.length() - 1] == '/')
+  {
+    _compressDir.remove(_compressDir.length() - 1);
+  }
+}
+
+void FtpServer::setListingIndex(bool enable)
+{
+  _index.setEnabled(enable);
+}
+
+void FtpServer::setTraceBuffer(size_t bytes)
+{
+  _traceSize = bytes;
+  if (_started)
+  {
+    if (bytes == 0)
+    {
+      _trace.end();
+    }
+    else if (!_trace.begin(bytes) && _log == FTPLog::ENABLE)
+    {
+      LOG_WARN("Failed to allocate %u bytes for the trace", (unsigned)bytes);
+    }
+  }
+}
+
+void FtpServer::setStats(bool enable)
+{
+  _statsEnabled = enable;
+}
+
+void FtpServer::setAsyncFilesystem(bool enable)
+{
+  _asyncFs = enable;
+}
+
+void FtpServer::setLoopBudget(uint32_t micros, StallCallback callback)
+{
+  _loopBudget = micros;
+  _stallCallback = callback;
+}
+
+size_t FtpServer::getStalls(StallRecord *records, size_t max) const
+{
+  size_t count = min((size_t)min(_stallCount, (uint32_t)FTP_STALL_LOG_SIZE), max);
+  for (size_t i = 0; i < count; i++)
+  {
+    records[i] = _stalls[(_stallCount - 1 - i) % FTP_STALL_LOG_SIZE];
+  }
+  return count;
+}
+
+void FtpServer::setSpaceCallback(SpaceCallback callback)
+{
+  _spaceCallback = callback;
+  _spaceValid = false;
+}
+
+void FtpServer::setSessionTokens(uint32_t seconds)
+{
+  _tokenTtl = seconds * 1000;
+}
+
+void FtpServer::setHashTrees(bool enable)
+{
+  _hashTrees = enable;
+  if (!enable)
+  {
+    endHashBuild(false);
+  }
+}
+
+void FtpServer::setTls(const char *certPem, const char *keyPem, bool required)
+{
+  _tlsCert = certPem;
+  _tlsKey = keyPem;
+  _tlsRequired = required && certPem != nullptr;
+}
+
+bool FtpServer::getDiskUsage(const char *dir, FtpDiskUsage::Totals &totals)
+{
+  return sumDirectory(dir, totals, 0);
+}
+
+bool FtpServer::getFreeSpace(uint64_t &bytes)
+{
+  if (!_spaceValid || millis() - _millisSpaceSync >= FTP_SPACE_RESYNC_MS)
+  {
+    // LittleFS counts used blocks by traversing the whole filesystem
+    uint64_t total = 0;
+    uint64_t used = 0;
+    if (_spaceCallback)
+    {
+      if (!_spaceCallback(total, used))
+        return false;
+    }
+    else if (&_fs == &LittleFS)
+    {
+      total = LittleFS.totalBytes();
+      used = LittleFS.usedBytes();
+    }
+    else
+    {
+      return false;
+    }
+    _freeBytes = total > used ? total - used : 0;
+    _spaceValid = true;
+    _millisSpaceSync = millis();
+  }
+
+  bytes = _freeBytes > 0 ? _freeBytes : 0;
+  return true;
+}
+
+void FtpServer::invalidateListingIndex(const char *dir)
+{
+  _index.invalidate(dir);
+  _du.invalidate(dir);
+}
+
+void FtpServer::setPackDirectory(const char *dir)
+{
+  _packDir = dir;
+  if (_started)
+  {
+    _pack.begin(dir);
+  }
+}
+
 bool FtpServer::handleFTP()
 {
   if (!_started)
@@ -112,6 +478,9 @@ bool FtpServer::handleFTP()
     return false;
   }
 
+  uint32_t startMicros = micros();
+  _commandThisLoop = false;
+
   // Handle new client connections
   if (ftpServer.hasClient())
   {
@@ -122,6 +491,11 @@ bool FtpServer::handleFTP()
     _client = ftpServer.accept();
   }
 
+  if (_fsPending)
+  {
+    pollFsJob();
+  }
+
   switch (_cmdStatus)
   {
   case FTP_CMD_IDLE:
@@ -129,6 +503,7 @@ bool FtpServer::handleFTP()
     {
       disconnectClient();
     }
+    endSession();
     _cmdStatus = FTP_CMD_WAIT_CONNECTION;
     break;
 
@@ -150,8 +525,9 @@ bool FtpServer::handleFTP()
   case FTP_CMD_WAIT_USER:
   case FTP_CMD_WAIT_PASS:
   case FTP_CMD_WAIT_COMMAND:
-    if (readCommand() > 0)
+    if (!_fsPending && readCommand() > 0)
     {
+      _commandThisLoop = true;
       processCurrentState();
     }
     break;
@@ -160,6 +536,15 @@ bool FtpServer::handleFTP()
   // Handle data transfers
   handleDataTransfers();
 
+  if (_transferStatus == FTP_TRANSFER_IDLE)
+  {
+    _pack.maintain();
+    if (_lazyTree.isActive())
+    {
+      stepHashBuild(); // Shares _buffer with transfers
+    }
+  }
+
   // Check for timeout or disconnection
   if ((_cmdStatus > FTP_CMD_READY) &&
       (!_client.connected() || (millis() > _millisEndConnection)))
@@ -169,19 +554,134 @@ bool FtpServer::handleFTP()
     _cmdStatus = FTP_CMD_IDLE;
   }
 
+  checkIdleSuspend();
+  sampleMemory();
+  if (_loopBudget > 0)
+  {
+    checkLoopBudget(startMicros);
+  }
+
   return _transferStatus != FTP_TRANSFER_IDLE || _cmdStatus != FTP_CMD_IDLE;
 }
 
 // Private method implementations
 
+void FtpServer::sampleMemory()
+{
+  uint32_t now = millis();
+  uint32_t elapsed = now - _millisLastSample;
+  if (elapsed < FTP_MEMORY_SAMPLE_MS)
+  {
+    return;
+  }
+  _millisLastSample = now;
+
+  _memory.bufferBytes = (_buffer != nullptr ? _bufferSize : 0) + sizeof(_cmdLine) +
+                        (_fsJob != nullptr ? sizeof(FsJob) : 0) +
+                        _compressWriter.memoryUsage() + _compressReader.memoryUsage() + _du.memoryUsage() +
+                        (_tls != nullptr ? sizeof(FtpTlsContext) : 0) + _client.memoryUsage() + _data.memoryUsage() +
+                        _uploadTree.memoryUsage() + _lazyTree.memoryUsage() + _hashReader.memoryUsage();
+  _memory.packIndexBytes = _pack.isActive() ? _pack.memoryUsage() : 0;
+  _memory.traceBytes = _trace.isActive() ? _traceSize : 0;
+  _memory.openHandles = (_file ? 1 : 0) + (_data.connected() ? 1 : 0) + (_hashSource ? 1 : 0);
+  _memory.sessionBytes = sizeof(*this) + _memory.bufferBytes + _memory.packIndexBytes +
+                         _memory.traceBytes + _memory.openHandles * FTP_HANDLE_BYTES;
+  _memory.sessionPeakBytes = max(_memory.sessionPeakBytes, _memory.sessionBytes);
+  _memory.peakBytes = max(_memory.peakBytes, _memory.sessionBytes);
+
+  // High-water mark of the calling task, in bytes of headroom left
+  uint32_t stack = uxTaskGetStackHighWaterMark(NULL) * sizeof(StackType_t);
+  _memory.stackHighWater = min(_memory.stackHighWater, stack);
+
+  if (ESP.getFreeHeap() < FTP_HEAP_LOW_WATER || stack < FTP_STACK_LOW_WATER)
+  {
+    _memory.millisNearLimit += elapsed;
+  }
+}
+
+void FtpServer::checkLoopBudget(uint32_t startMicros)
+{
+  uint32_t duration = micros() - startMicros;
+  if (duration <= _loopBudget)
+  {
+    return;
+  }
+
+  StallRecord &record = _stalls[_stallCount++ % FTP_STALL_LOG_SIZE];
+  record.millis = millis();
+  record.durationUs = duration;
+  record.cmdStatus = _cmdStatus;
+  record.transferStatus = _transferStatus;
+  if (_commandThisLoop)
+  {
+    // _parameters still points into this call's command line
+    strlcpy(record.command, _command, sizeof(record.command));
+    strlcpy(record.path, strcmp(_command, "PASS") == 0 ? "****" : _parameters, sizeof(record.path));
+  }
+  else if (_transferStatus != FTP_TRANSFER_IDLE)
+  {
+    strlcpy(record.command, _transferStatus == FTP_TRANSFER_STOR ? "STOR" : "RETR", sizeof(record.command));
+    strlcpy(record.path, _transferPath, sizeof(record.path));
+  }
+  else
+  {
+    record.command[0] = '\0';
+    record.path[0] = '\0';
+  }
+
+  if (_log == FTPLog::ENABLE)
+    LOG_WARN("handleFTP() took %u us (budget %u us): %s %s", (unsigned)duration, (unsigned)_loopBudget,
+             record.command, record.path);
+  if (_stallCallback)
+  {
+    _stallCallback(record);
+  }
+}
+
+void FtpServer::endSession()
+{
+  _trace.sessionEnd(millis());
+  if (_heapAtSessionStart != 0)
+  {
+    // Positive when the session left less free heap than it found
+    _memory.lastSessionHeapDelta = (int32_t)(_heapAtSessionStart - ESP.getFreeHeap());
+    _heapAtSessionStart = 0;
+  }
+}
+
+void FtpServer::checkIdleSuspend()
+{
+  if (isBusy())
+  {
+    _millisLastActivity = millis();
+    return;
+  }
+
+  if (_idleSuspend == 0 || millis() - _millisLastActivity < _idleSuspend)
+  {
+    return;
+  }
+
+  if (_log == FTPLog::ENABLE)
+  {
+    LOG_INFO("FTP Server idle for %u s, suspending", (unsigned)(_idleSuspend / 1000));
+  }
+  end();
+}
+
 void FtpServer::initVariables()
 {
   _dataPort = _passivePort;
   _dataConnType = FTP_DATA_PASSIVE;
   strlcpy(_cwd, "/", sizeof(_cwd));
+  _transferType = 'A';
   _rnfrCmd = false;
   _transferStatus = FTP_TRANSFER_IDLE;
+  _sendOffset = 0;
+  _sendLength = 0;
+  _restartOffset = 0;
   _currentAttempts = 0;
+  _protPrivate = false;
 }
 
 void FtpServer::clientConnected()
@@ -189,6 +689,11 @@ void FtpServer::clientConnected()
   _client.println("220 Welcome to ESP32-S3 FTP Server");
   _client.println("220 Version " + String(FTP_SERVER_VERSION));
   _cmdBufferIndex = 0;
+  _trace.sessionStart(millis(), (uint32_t)_client.remoteIP());
+  _counters.sessions++;
+  _millisSessionStart = millis();
+  _heapAtSessionStart = ESP.getFreeHeap();
+  _memory.sessionPeakBytes = 0;
 }
 
 void FtpServer::disconnectClient()
@@ -196,6 +701,7 @@ void FtpServer::disconnectClient()
   abortTransfer();
   _client.println("221 Goodbye");
   _client.stop();
+  endSession();
 }
 
 bool FtpServer::authenticateUser()
@@ -219,6 +725,7 @@ bool FtpServer::authenticateUser()
     else
     {
       _client.println("530 User not found");
+      _counters.loginFailures++;
       delayResponse(100);
     }
     return false;
@@ -249,6 +756,7 @@ bool FtpServer::authenticatePassword()
     else
     {
       _client.println("530 Invalid password");
+      _counters.loginFailures++;
       delayResponse(100);
     }
     return false;
@@ -260,104 +768,147 @@ bool FtpServer::authenticatePassword()
   return true;
 }
 
-bool FtpServer::processCommand()
+bool FtpServer::resumeSession()
 {
-  if (_log == FTPLog::ENABLE)
+  FtpSessionTokens::Session session;
+  if (!_tokens.redeem(_username.c_str(), _parameters, millis(), session))
   {
-    LOG_DEBUG("Comando=%s", _command);
+    _client.println("530 Invalid or expired token");
+    _counters.loginFailures++;
+    delayResponse(100);
+    return false;
   }
-  // Access Control Commands
-  if (strcmp(_command, "CDUP") == 0)
+
+  strlcpy(_cwd, session.cwd, sizeof(_cwd));
+  _transferType = session.type;
+  _currentAttempts = 0;
+  _counters.sessionResumes++;
+  _client.println("230 Session resumed, \"" + String(_cwd) + "\" is current directory");
+  return true;
+}
+
+void FtpServer::rekeyTokens()
+{
+  // Tokens from before begin() may name other credentials
+  uint8_t secret[FTP_TOKEN_SECRET_SIZE];
+  for (size_t i = 0; i < sizeof(secret); i += 4)
   {
-    handleCdupCommand();
+    uint32_t word = esp_random();
+    memcpy(secret + i, &word, 4);
   }
-  else if (strcmp(_command, "CWD") == 0)
+  _tokens.rekey(secret);
+}
+
+bool FtpServer::processCommand()
+{
+  if (_log == FTPLog::ENABLE)
   {
-    handleCwdCommand();
+    LOG_DEBUG("Comando=%s", _command);
   }
-  else if (strcmp(_command, "PWD") == 0)
+  _commandCount++;
+
+  FtpVerb verb = FtpProtocol::lookupVerb(_command);
+  _counters.commands[verb]++;
+  switch (verb)
   {
+  // Access Control Commands
+  case FTP_VERB_CDUP:
+    handleCdupCommand();
+    break;
+  case FTP_VERB_CWD:
+    handleCwdCommand();
+    break;
+  case FTP_VERB_PWD:
     _client.println("257 \"" + String(_cwd) + "\" is current directory");
-  }
-  else if (strcmp(_command, "QUIT") == 0)
-  {
+    break;
+  case FTP_VERB_QUIT:
     disconnectClient();
     return false;
-  }
   // Transfer Parameter Commands
-  else if (strcmp(_command, "PASV") == 0)
-  {
+  case FTP_VERB_PASV:
     handlePasvCommand();
-  }
-  else if (strcmp(_command, "PORT") == 0)
-  {
+    break;
+  case FTP_VERB_PORT:
     handlePortCommand();
-  }
-  else if (strcmp(_command, "TYPE") == 0)
-  {
+    break;
+  case FTP_VERB_TYPE:
     handleTypeCommand();
-  }
+    break;
+  case FTP_VERB_PBSZ:
+    handlePbszCommand();
+    break;
+  case FTP_VERB_PROT:
+    handleProtCommand();
+    break;
   // Service Commands
-  else if (strcmp(_command, "LIST") == 0)
-  {
+  case FTP_VERB_LIST:
     handleListCommand();
-  }
-  else if (strcmp(_command, "MLSD") == 0)
-  {
+    break;
+  case FTP_VERB_MLSD:
     handleMlsdCommand();
-  }
-  else if (strcmp(_command, "RETR") == 0)
-  {
+    break;
+  case FTP_VERB_RETR:
     handleRetrCommand();
-  }
-  else if (strcmp(_command, "STOR") == 0)
-  {
+    break;
+  case FTP_VERB_STOR:
     handleStorCommand();
-  }
-  else if (strcmp(_command, "DELE") == 0)
-  {
+    break;
+  case FTP_VERB_DELE:
     handleDeleCommand();
-  }
-  else if (strcmp(_command, "MKD") == 0)
-  {
+    break;
+  case FTP_VERB_MKD:
     handleMkdCommand();
-  }
-  else if (strcmp(_command, "RMD") == 0)
-  {
+    break;
+  case FTP_VERB_RMD:
     handleRmdCommand();
-  }
-  else if (strcmp(_command, "RNFR") == 0)
-  {
+    break;
+  case FTP_VERB_RNFR:
     handleRnfrCommand();
-  }
-  else if (strcmp(_command, "RNTO") == 0)
-  {
+    break;
+  case FTP_VERB_RNTO:
     handleRntoCommand();
-  }
+    break;
   // Extended Commands
-  else if (strcmp(_command, "FEAT") == 0)
-  {
+  case FTP_VERB_SITE:
+    handleSiteCommand();
+    break;
+  case FTP_VERB_FEAT:
     _client.println("211-Extensions supported:");
     _client.println(" MLSD");
     _client.println(" SIZE");
     _client.println(" MDTM");
+    _client.println(" REST STREAM"); // RETR only, STOR after REST gets 554
+    _client.println(" AVBL");
+    if (_tls != nullptr)
+    {
+      _client.println(" AUTH TLS");
+      _client.println(" PBSZ");
+      _client.println(" PROT");
+    }
     _client.println("211 End");
-  }
-  else if (strcmp(_command, "SIZE") == 0)
-  {
+    break;
+  case FTP_VERB_SIZE:
     handleSizeCommand();
-  }
-  else if (strcmp(_command, "SYST") == 0)
-  {
+    break;
+  case FTP_VERB_SYST:
     _client.println("215 UNIX Type: L8");
-  }
-  else
-  {
+    break;
+  case FTP_VERB_REST:
+    handleRestCommand();
+    break;
+  case FTP_VERB_AVBL:
+    handleAvblCommand();
+    break;
+  case FTP_VERB_AUTH:
+    handleAuthCommand();
+    break;
+  default:
     _client.println("500 Unknown command");
     if (_log == FTPLog::ENABLE)
     {
       LOG_WARN("Comando=%s desconhecido", _command);
     }
+    break;
   }
 
   return true;
@@ -406,7 +957,7 @@ void FtpServer::handleCwdCommand()
     return;
   }
 
-  File dir = LittleFS.open(path);
+  File dir = _fs.open(path);
   if (!dir || !dir.isDirectory())
   {
     _client.println("550 Directory not found");
@@ -494,36 +1045,14 @@ void FtpServer::handleListCommand()
     return;
   }
 
-  File dir = LittleFS.open(path);
-  if (!dir || !dir.isDirectory())
+  uint16_t count = 0;
+  if (!listDirectory(path, false, count))
   {
     _client.println("550 Directory not found");
     _data.stop();
-    if (dir)
-      dir.close();
     return;
   }
 
-  uint16_t count = 0;
-  File file = dir.openNextFile();
-  while (file)
-  {
-    String line;
-    if (file.isDirectory())
-    {
-      line = "drwxr-xr-x 1 owner group " + String(file.size()) + " Jan 1 2000 " + String(file.name());
-    }
-    else
-    {
-      line = "-rw-r--r-- 1 owner group " + String(file.size()) + " Jan 1 2000 " + String(file.name());
-    }
-    _data.println(line);
-    count++;
-    file.close();
-    file = dir.openNextFile();
-  }
-  dir.close();
-
   _client.println("226 " + String(count) + " matches total");
   _data.stop();
 }
@@ -554,38 +1083,13 @@ void FtpServer::handleMlsdCommand()
     return;
   }
 
-  File dir = LittleFS.open(path);
-  if (!dir || !dir.isDirectory())
+  uint16_t count = 0;
+  if (!listDirectory(path, true, count))
   {
     _client.println("550 Directory not found");
     _data.stop();
-    if (dir)
-      dir.close();
     return;
   }
-  uint16_t count = 0;
-  File file = dir.openNextFile();
-  while (file)
-  {
-    if (_log == FTPLog::ENABLE)
-    {
-      LOG_DEBUG("File Name = %s", file.name());
-    }
-    String line;
-    if (file.isDirectory())
-    {
-      line = "Type=dir;Size=" + String(file.size()) + ";Modify=20000101000000; " + String(file.name());
-    }
-    else
-    {
-      line = "Type=file;Size=" + String(file.size()) + ";Modify=20000101000000; " + String(file.name());
-    }
-    _data.println(line);
-    count++;
-    file.close();
-    file = dir.openNextFile();
-  }
-  dir.close();
 
   _client.println("226 " + String(count) + " matches total");
   _data.stop();
@@ -593,6 +1097,9 @@ void FtpServer::handleMlsdCommand()
 
 void FtpServer::handleRetrCommand()
 {
+  // A transfer still running is abandoned, an upload without its temp file
+  abortTransfer();
+
   if (strlen(_parameters) == 0)
   {
     _client.println("501 No filename given");
@@ -604,512 +1111,2357 @@ void FtpServer::handleRetrCommand()
   {
     return;
   }
-
-  _file = LittleFS.open(path, "r");
-  if (!_file)
+  if (_trace.isActive() && strcmp(path, FTP_TRACE_PATH) == 0)
   {
-    _client.println("550 File not found");
+    sendTrace();
     return;
   }
-
-  if (!dataConnect())
+  if (_statsEnabled && sendStatsFile(path))
   {
-    _client.println("425 Can't open data connection");
-    _file.close();
     return;
   }
+  strlcpy(_transferPath, path, sizeof(_transferPath));
+  shardPath(path, sizeof(path), false);
 
-  _client.println("150 Opening data connection");
-  _millisBeginTransfer = millis();
-  _bytesTransferred = 0;
-  _transferStatus = FTP_TRANSFER_RETR;
-}
-
-void FtpServer::handleStorCommand()
-{
-  if (strlen(_parameters) == 0)
-  {
-    _client.println("501 No filename given");
-    return;
-  }
+  // REST applies to this transfer only
+  uint64_t restart = _restartOffset;
+  _restartOffset = 0;
 
-  char path[FTP_CWD_SIZE];
-  if (!makePath(path, sizeof(path)))
+  const char *packName = _pack.nameFor(path);
+  uint32_t packSize; // Packed files are small, the pack store keeps 32-bit sizes
+  if (packName != nullptr && _pack.openRead(packName, _file, packSize))
   {
-    return;
+    _bytesRemaining = packSize;
+    if (restart <= _bytesRemaining)
+      _file.seek(_file.position() + restart);
   }
-
-  // Check if file exists and is writable
-  if (LittleFS.exists(path))
+  else
   {
-    File testFile = LittleFS.open(path, "r+");
-    if (!testFile)
+    _file = _fs.open(path, "r");
+    if (!_file)
     {
-      _client.println("550 File exists but can't be opened");
+      _client.println("550 File not found");
       return;
     }
-    testFile.close();
+
+    // Compressed files are recognized by their header, so they still read
+    // back after being renamed out of the compressed directory
+    if (_compressReader.begin(_file))
+    {
+      _bytesRemaining = _compressReader.size();
+      if (restart <= _bytesRemaining)
+        _compressReader.seek(restart);
+    }
+    else
+    {
+      _bytesRemaining = _file.size();
+      if (restart <= _bytesRemaining)
+        _file.seek(restart);
+    }
+  }
+
+  if (restart > _bytesRemaining)
+  {
+    _client.println("554 Restart offset beyond end of file");
+    _compressReader.end();
+    _file.close();
+    return;
   }
+  _bytesRemaining -= restart;
 
-  _file = LittleFS.open(path, "w");
-  if (!_file)
+  // Shared with other readers; an upload of the same file goes elsewhere
+  // until it's complete, so it doesn't block this one
+  if (!FtpLockTable::shared().lockRead(&_fs, path))
   {
-    _client.println("451 Can't create file");
+    _client.println("450 Too many transfers, try again later");
+    _compressReader.end();
+    _file.close();
     return;
   }
+  _lockMode = FTP_LOCK_READ;
 
   if (!dataConnect())
   {
     _client.println("425 Can't open data connection");
+    _compressReader.end();
     _file.close();
-    LittleFS.remove(path);
+    releaseTransferLock();
     return;
   }
 
-  _client.println("150 Ready to receive data");
+  _client.println("150 Opening data connection");
+  _sendOffset = 0;
+  _sendLength = 0;
   _millisBeginTransfer = millis();
+  _millisLastData = _millisBeginTransfer;
   _bytesTransferred = 0;
-  _transferStatus = FTP_TRANSFER_STOR;
+  _transferStatus = FTP_TRANSFER_RETR;
 }
 
-void FtpServer::handleDeleCommand()
+void FtpServer::sendTrace()
 {
-  if (strlen(_parameters) == 0)
-  {
-    _client.println("501 No filename given");
-    return;
-  }
-
-  char path[FTP_CWD_SIZE];
-  if (!makePath(path, sizeof(path)))
+  if (!dataConnect())
   {
+    _client.println("425 Can't open data connection");
     return;
   }
 
-  if (!LittleFS.exists(path))
+  // Snapshot as of now, records arriving meanwhile are not included
+  _client.println("150 Opening data connection for trace");
+  uint32_t now = millis();
+  size_t size = _trace.size();
+  for (size_t offset = 0; offset < size;)
   {
-    _client.println("550 File not found");
-    return;
+    size_t count = _trace.read(offset, (uint8_t *)_buffer, _bufferSize, now);
+    _data.write((uint8_t *)_buffer, count);
+    offset += count;
   }
+  _data.stop();
+  _client.println("226 Transfer complete");
+}
 
-  if (LittleFS.remove(path))
-  {
-    _client.println("250 File deleted");
-  }
+bool FtpServer::sendStatsFile(const char *path)
+{
+  void (FtpServer::*writer)(size_t &) = nullptr;
+  if (strcmp(path, FTP_STATS_DIR "/metrics") == 0)
+    writer = &FtpServer::writeMetrics;
+  else if (strcmp(path, FTP_STATS_DIR "/sessions") == 0)
+    writer = &FtpServer::writeSessions;
+  else if (strcmp(path, FTP_STATS_DIR "/trace.json") == 0)
+    writer = &FtpServer::writeTraceJson;
+  else if (strcmp(path, FTP_STATS_DIR "/stalls") == 0)
+    writer = &FtpServer::writeStalls;
   else
+    return false;
+
+  if (!dataConnect())
   {
-    _client.println("450 Could not delete file");
+    _client.println("425 Can't open data connection");
+    return true;
   }
+
+  // Generated on demand into the transfer buffer, flushed as it fills
+  _client.println("150 Opening data connection for " + String(path));
+  size_t fill = 0;
+  (this->*writer)(fill);
+  _data.write((uint8_t *)_buffer, fill);
+  _data.stop();
+  _client.println("226 Transfer complete");
+  return true;
 }
 
-void FtpServer::handleMkdCommand()
+void FtpServer::statsPrintf(size_t &fill, const char *format, ...)
 {
-  if (strlen(_parameters) == 0)
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(_buffer + fill, _bufferSize - fill, format, args);
+  va_end(args);
+  if (len < 0)
   {
-    _client.println("501 No directory name given");
     return;
   }
 
-  char path[FTP_CWD_SIZE];
-  if (!makePath(path, sizeof(path)))
+  if (fill + len >= _bufferSize)
   {
-    return;
+    // Didn't fit: flush and format again at the start of the buffer
+    _data.write((uint8_t *)_buffer, fill);
+    fill = 0;
+    va_start(args, format);
+    len = vsnprintf(_buffer, _bufferSize, format, args);
+    va_end(args);
+    if (len < 0)
+    {
+      return;
+    }
+    if ((size_t)len >= _bufferSize)
+    {
+      len = _bufferSize - 1; // Longer than the whole buffer, truncated
+    }
   }
+  fill += len;
+}
 
-  if (LittleFS.mkdir(path))
+void FtpServer::writeMetrics(size_t &fill)
+{
+  HeapStats heap = getHeapStats();
+  statsPrintf(fill, "# TYPE ftp_uptime_seconds gauge\nftp_uptime_seconds %u\n", (unsigned)(millis() / 1000));
+  statsPrintf(fill, "# TYPE ftp_sessions_total counter\nftp_sessions_total %u\n", (unsigned)_counters.sessions);
+  statsPrintf(fill, "# TYPE ftp_sessions_active gauge\nftp_sessions_active %u\n", _cmdStatus > FTP_CMD_READY ? 1u : 0u);
+  statsPrintf(fill, "# TYPE ftp_login_failures_total counter\nftp_login_failures_total %u\n", (unsigned)_counters.loginFailures);
+  statsPrintf(fill, "# TYPE ftp_session_resumes_total counter\nftp_session_resumes_total %u\n", (unsigned)_counters.sessionResumes);
+  if (_tokenTtl > 0)
   {
-    _client.println("257 \"" + String(path) + "\" created");
+    statsPrintf(fill, "# TYPE ftp_session_tokens gauge\nftp_session_tokens %u\n", (unsigned)_tokens.count(millis()));
   }
-  else
+
+  statsPrintf(fill, "# TYPE ftp_commands_total counter\n");
+  for (int verb = 0; verb < FTP_VERB_COUNT; verb++)
   {
-    _client.println("550 Can't create directory");
+    if (_counters.commands[verb] > 0)
+    {
+      statsPrintf(fill, "ftp_commands_total{verb=\"%s\"} %u\n", FtpProtocol::verbName((FtpVerb)verb),
+                  (unsigned)_counters.commands[verb]);
+    }
   }
-}
 
-void FtpServer::handleRmdCommand()
-{
-  if (strlen(_parameters) == 0)
+  statsPrintf(fill, "# TYPE ftp_transfers_total counter\nftp_transfers_total %u\n", (unsigned)_counters.transfers);
+  statsPrintf(fill, "# TYPE ftp_transfer_errors_total counter\nftp_transfer_errors_total %u\n", (unsigned)_counters.transferErrors);
+  statsPrintf(fill, "# TYPE ftp_bytes_sent_total counter\nftp_bytes_sent_total %llu\n", (unsigned long long)_counters.bytesSent);
+  statsPrintf(fill, "# TYPE ftp_bytes_received_total counter\nftp_bytes_received_total %llu\n", (unsigned long long)_counters.bytesReceived);
+
+  statsPrintf(fill, "# TYPE ftp_heap_free_bytes gauge\nftp_heap_free_bytes %u\n", (unsigned)heap.freeBytes);
+  statsPrintf(fill, "# TYPE ftp_heap_min_free_bytes gauge\nftp_heap_min_free_bytes %u\n", (unsigned)heap.minFreeBytes);
+  statsPrintf(fill, "# TYPE ftp_heap_largest_block_bytes gauge\nftp_heap_largest_block_bytes %u\n", (unsigned)heap.largestBlock);
+  statsPrintf(fill, "# TYPE ftp_heap_fragmentation_percent gauge\nftp_heap_fragmentation_percent %u\n", (unsigned)heap.fragmentation);
+
+  if (_pack.isActive())
   {
-    _client.println("501 No directory name given");
-    return;
+    statsPrintf(fill, "# TYPE ftp_pack_files gauge\nftp_pack_files %u\n", (unsigned)_pack.count());
+    statsPrintf(fill, "# TYPE ftp_pack_index_bytes gauge\nftp_pack_index_bytes %u\n", (unsigned)_pack.memoryUsage());
   }
-
-  char path[FTP_CWD_SIZE];
-  if (!makePath(path, sizeof(path)))
+  if (_compressDir.length() > 0)
   {
-    return;
+    statsPrintf(fill, "# TYPE ftp_compressed_logical_bytes_total counter\nftp_compressed_logical_bytes_total %llu\n",
+                (unsigned long long)_counters.compressedLogical);
+    statsPrintf(fill, "# TYPE ftp_compressed_stored_bytes_total counter\nftp_compressed_stored_bytes_total %llu\n",
+                (unsigned long long)_counters.compressedStored);
   }
+  MemoryStats memory = getMemoryStats();
+  statsPrintf(fill, "# TYPE ftp_memory_bytes gauge\n");
+  statsPrintf(fill, "ftp_memory_bytes{part=\"buffers\"} %u\n", (unsigned)memory.bufferBytes);
+  statsPrintf(fill, "ftp_memory_bytes{part=\"pack_index\"} %u\n", (unsigned)memory.packIndexBytes);
+  statsPrintf(fill, "ftp_memory_bytes{part=\"trace\"} %u\n", (unsigned)memory.traceBytes);
+  statsPrintf(fill, "ftp_memory_bytes{part=\"session\"} %u\n", (unsigned)memory.sessionBytes);
+  statsPrintf(fill, "# TYPE ftp_memory_peak_bytes gauge\nftp_memory_peak_bytes %u\n", (unsigned)memory.peakBytes);
+  statsPrintf(fill, "# TYPE ftp_open_handles gauge\nftp_open_handles %u\n", (unsigned)memory.openHandles);
+  statsPrintf(fill, "# TYPE ftp_session_heap_delta_bytes gauge\nftp_session_heap_delta_bytes %d\n", (int)memory.lastSessionHeapDelta);
+  statsPrintf(fill, "# TYPE ftp_stack_high_water_bytes gauge\nftp_stack_high_water_bytes %u\n", (unsigned)memory.stackHighWater);
+  statsPrintf(fill, "# TYPE ftp_near_limit_seconds_total counter\nftp_near_limit_seconds_total %.1f\n", memory.millisNearLimit / 1000.0);
 
-  // Check if directory is empty
-  File dir = LittleFS.open(path);
-  if (!dir || !dir.isDirectory())
+  FtpLockTable &locks = FtpLockTable::shared();
+  statsPrintf(fill, "# TYPE ftp_locks_held gauge\nftp_locks_held %u\n", (unsigned)locks.count());
+  statsPrintf(fill, "# TYPE ftp_lock_conflicts_total counter\nftp_lock_conflicts_total %u\n", (unsigned)locks.conflicts());
+
+  if (_loopBudget > 0)
   {
-    _client.println("550 Not a directory or doesn't exist");
-    if (dir)
-      dir.close();
-    return;
+    statsPrintf(fill, "# TYPE ftp_loop_budget_us gauge\nftp_loop_budget_us %u\n", (unsigned)_loopBudget);
+    statsPrintf(fill, "# TYPE ftp_loop_stalls_total counter\nftp_loop_stalls_total %u\n", (unsigned)_stallCount);
   }
 
-  // Check for empty directory
-  File file = dir.openNextFile();
-  if (file)
+  if (_hashTrees)
   {
-    _client.println("550 Directory not empty");
-    file.close();
-    dir.close();
-    return;
+    statsPrintf(fill, "# TYPE ftp_hash_trees_built_total counter\nftp_hash_trees_built_total %u\n", (unsigned)_counters.hashTrees);
+    statsPrintf(fill, "# TYPE ftp_hash_tree_building gauge\nftp_hash_tree_building %u\n", _lazyTree.isActive() ? 1u : 0u);
   }
-  dir.close();
 
-  if (LittleFS.rmdir(path))
+  if (_tls != nullptr)
   {
-    _client.println("250 Directory removed");
+    const FtpTlsContext::Stats &tls = _tls->stats();
+    statsPrintf(fill, "# TYPE ftp_tls_handshakes_total counter\n");
+    statsPrintf(fill, "ftp_tls_handshakes_total{kind=\"full\"} %u\n", (unsigned)tls.fullHandshakes);
+    statsPrintf(fill, "ftp_tls_handshakes_total{kind=\"resumed\"} %u\n", (unsigned)tls.resumedHandshakes);
+    statsPrintf(fill, "# TYPE ftp_tls_handshake_failures_total counter\nftp_tls_handshake_failures_total %u\n",
+                (unsigned)tls.failedHandshakes);
+    statsPrintf(fill, "# TYPE ftp_tls_handshake_microseconds_total counter\n");
+    statsPrintf(fill, "ftp_tls_handshake_microseconds_total{kind=\"full\"} %llu\n", (unsigned long long)tls.fullMicros);
+    statsPrintf(fill, "ftp_tls_handshake_microseconds_total{kind=\"resumed\"} %llu\n", (unsigned long long)tls.resumedMicros);
+    statsPrintf(fill, "# TYPE ftp_tls_last_handshake_microseconds gauge\nftp_tls_last_handshake_microseconds %u\n",
+                (unsigned)tls.lastMicros);
+    statsPrintf(fill, "# TYPE ftp_tls_bulk_bytes_total counter\nftp_tls_bulk_bytes_total %llu\n", (unsigned long long)tls.bulkBytes);
+    statsPrintf(fill, "# TYPE ftp_tls_bulk_microseconds_total counter\nftp_tls_bulk_microseconds_total %llu\n",
+                (unsigned long long)tls.bulkMicros);
+    // Record processing only, socket waits aren't counted
+    statsPrintf(fill, "# TYPE ftp_tls_bulk_bytes_per_second gauge\nftp_tls_bulk_bytes_per_second %.0f\n",
+                tls.bulkMicros > 0 ? tls.bulkBytes * 1e6 / tls.bulkMicros : 0.0);
   }
-  else
+
+  if (_trace.isActive())
   {
-    _client.println("550 Could not remove directory");
+    statsPrintf(fill, "# TYPE ftp_trace_dropped_total counter\nftp_trace_dropped_total %u\n", (unsigned)_trace.dropped());
   }
 }
 
-void FtpServer::handleRnfrCommand()
+void FtpServer::writeSessions(size_t &fill)
 {
-  if (strlen(_parameters) == 0)
+  // One line per active session
+  if (_cmdStatus <= FTP_CMD_READY)
   {
-    _client.println("501 No filename given");
     return;
   }
 
-  if (!makePath(_renameFrom, sizeof(_renameFrom), _parameters))
-  {
-    return;
-  }
+  static const char *const transfers[] = {"none", "RETR", "STOR"};
+  statsPrintf(fill, "remote=%s state=%s tls=%s cwd=%s connected_ms=%u commands=%u transfer=%s bytes=%llu "
+                    "memory=%u peak_memory=%u handles=%u\n",
+              _client.remoteIP().toString().c_str(),
+              _cmdStatus == FTP_CMD_WAIT_COMMAND ? "logged_in" : "login",
+              !_client.isSecure() ? "off" : _protPrivate ? "private" : "control",
+              _cwd, (unsigned)(millis() - _millisSessionStart), (unsigned)_commandCount,
+              transfers[_transferStatus],
+              _transferStatus == FTP_TRANSFER_IDLE ? 0ull : (unsigned long long)_bytesTransferred,
+              (unsigned)_memory.sessionBytes, (unsigned)_memory.sessionPeakBytes, (unsigned)_memory.openHandles);
+}
 
-  if (!LittleFS.exists(_renameFrom))
+void FtpServer::writeStalls(size_t &fill)
+{
+  // One line per recorded overrun, most recent first
+  StallRecord records[FTP_STALL_LOG_SIZE];
+  size_t count = getStalls(records, FTP_STALL_LOG_SIZE);
+  for (size_t i = 0; i < count; i++)
   {
-    _client.println("550 File not found");
-    return;
+    const StallRecord &record = records[i];
+    statsPrintf(fill, "t=%u duration_us=%u state=%u transfer=%u command=%s path=%s\n",
+                (unsigned)record.millis, (unsigned)record.durationUs, record.cmdStatus, record.transferStatus,
+                record.command[0] != '\0' ? record.command : "-", record.path[0] != '\0' ? record.path : "-");
   }
+}
 
-  _rnfrCmd = true;
-  _client.println("350 RNFR accepted - ready for destination");
+void FtpServer::writeTraceJson(size_t &fill)
+{
+  statsPrintf(fill, "{\"enabled\":%s,\"dropped\":%u,\"records\":[",
+              _trace.isActive() ? "true" : "false", (unsigned)_trace.dropped());
+
+  bool first = true;
+  _trace.forEach([&](const FtpTrace::RecordHeader &header, const uint8_t *payload)
+                 {
+                   statsPrintf(fill, "%s\n{\"t\":%u,\"session\":%u,", first ? "" : ",",
+                               (unsigned)header.millis, (unsigned)header.session);
+                   first = false;
+                   switch (header.event)
+                   {
+                   case FTP_TRACE_SESSION_START:
+                     statsPrintf(fill, "\"event\":\"start\",\"remote\":\"%u.%u.%u.%u\"}",
+                                 payload[0], payload[1], payload[2], payload[3]);
+                     break;
+                   case FTP_TRACE_COMMAND:
+                   {
+                     // Escape the command line for JSON
+                     char line[2 * FTP_CMD_SIZE];
+                     size_t out = 0;
+                     for (const uint8_t *p = payload; *p && out + 7 < sizeof(line); p++)
+                     {
+                       if (*p == '"' || *p == '\\')
+                       {
+                         line[out++] = '\\';
+                         line[out++] = *p;
+                       }
+                       else if (*p < 0x20)
+                       {
+                         out += snprintf(line + out, sizeof(line) - out, "\\u%04x", *p);
+                       }
+                       else
+                       {
+                         line[out++] = *p;
+                       }
+                     }
+                     line[out] = '\0';
+                     statsPrintf(fill, "\"event\":\"command\",\"line\":\"%s\"}", line);
+                     break;
+                   }
+                   case FTP_TRACE_TRANSFER:
+                   {
+                     FtpTrace::TransferRecord record;
+                     memcpy(&record, payload, sizeof(record));
+                     statsPrintf(fill, "\"event\":\"transfer\",\"upload\":%s,\"bytes\":%u,\"ms\":%u,\"complete\":%s}",
+                                 record.upload ? "true" : "false", (unsigned)record.bytes,
+                                 (unsigned)record.durationMs, record.complete ? "true" : "false");
+                     break;
+                   }
+                   default:
+                     statsPrintf(fill, "\"event\":\"end\"}");
+                     break;
+                   } });
+  statsPrintf(fill, "\n]}\n");
 }
 
-void FtpServer::handleRntoCommand()
+void FtpServer::handleStorCommand()
 {
-  if (!_rnfrCmd)
-  {
-    _client.println("503 RNFR required first");
-    return;
-  }
+  // A transfer still running is abandoned, an upload without its temp file
+  abortTransfer();
 
   if (strlen(_parameters) == 0)
   {
     _client.println("501 No filename given");
-    _rnfrCmd = false;
     return;
   }
 
-  char path[FTP_CWD_SIZE];
-  if (!makePath(path, sizeof(path)))
+  if (_restartOffset > 0)
   {
-    _rnfrCmd = false;
+    _restartOffset = 0;
+    _client.println("554 REST applies to RETR only, uploads restart from the beginning");
     return;
   }
 
-  if (LittleFS.exists(path))
+  char path[FTP_CWD_SIZE];
+  if (!makeWritablePath(path, sizeof(path)))
   {
-    _client.println("553 Destination already exists");
-    _rnfrCmd = false;
     return;
   }
+  strlcpy(_transferPath, path, sizeof(_transferPath));
+  shardPath(path, sizeof(path), true);
 
-  if (LittleFS.rename(_renameFrom, path))
+  // One writer per path across all sessions, readers don't get in the way
+  if (!FtpLockTable::shared().lockWrite(&_fs, path))
   {
-    _client.println("250 Rename successful");
+    _client.println("450 File busy, try again later");
+    return;
   }
-  else
+  _lockMode = FTP_LOCK_WRITE;
+
+  const char *packName = _pack.nameFor(path);
+  _transferReplaces = _fs.exists(path) || (packName != nullptr && _pack.exists(packName));
+  _transferOldSize = 0;
+  _transferOldStored = 0;
+  if (packName != nullptr)
   {
-    _client.println("553 Rename failed");
-  }
-  _rnfrCmd = false;
-}
+    // Replaced records keep their space until the segment is compacted
+    uint32_t oldSize;
+    if (_transferReplaces && _pack.stat(packName, oldSize))
+      _transferOldSize = oldSize;
 
-void FtpServer::handleSizeCommand()
+    if (!dataConnect())
+    {
+      _client.println("425 Can't open data connection");
+      releaseTransferLock();
+      return;
+    }
+
+    if (!_pack.beginWrite(packName, _file))
+    {
+      _client.println("451 Can't create file");
+      _data.stop();
+      releaseTransferLock();
+      return;
+    }
+
+    _packTransfer = true;
+  }
+  else
+  {
+    // Check if file exists and is writable
+    if (_transferReplaces)
+    {
+      File testFile = _fs.open(path, "r+");
+      if (!testFile)
+      {
+        _client.println("550 File exists but can't be opened");
+        releaseTransferLock();
+        return;
+      }
+      _transferOldStored = testFile.size();
+      _transferOldSize = logicalSize(testFile);
+      testFile.close();
+    }
+
+    // The upload replaces the file only once complete
+    char temp[FTP_CWD_SIZE];
+    _file = uploadPath(path, temp, sizeof(temp)) ? _fs.open(temp, "w") : File();
+    if (!_file)
+    {
+      _client.println("451 Can't create file");
+      releaseTransferLock();
+      return;
+    }
+
+    if (!dataConnect())
+    {
+      _client.println("425 Can't open data connection");
+      _file.close();
+      _fs.remove(temp);
+      releaseTransferLock();
+      return;
+    }
+
+    if (isCompressedPath(_transferPath) && !_compressWriter.begin(_file) && _log == FTPLog::ENABLE)
+    {
+      LOG_WARN("Compression unavailable, storing %s as is", _transferPath);
+    }
+  }
+
+  // The tree of the old content is replaced when the upload completes
+  if (_hashTrees)
+  {
+    if (_lazyTree.isBuilding(_transferPath))
+    {
+      endHashBuild(false);
+    }
+    _uploadTree.begin(_transferPath);
+  }
+
+  _client.println("150 Ready to receive data");
+  _packSpilled = false;
+  _millisBeginTransfer = millis();
+  _millisLastData = _millisBeginTransfer;
+  _bytesTransferred = 0;
+  _transferStatus = FTP_TRANSFER_STOR;
+}
+
+void FtpServer::submitFsJob(uint8_t op)
+{
+  FsJob &job = *_fsJob;
+  job.op = op;
+  job.session = _counters.sessions;
+  if (_fsTask == nullptr)
+  {
+    runFsJob(job);
+    completeFsJob();
+    return;
+  }
+
+  // The reply is sent by pollFsJob() once the I/O task is done
+  _fsPending = true;
+  _fsRequests.push(&job);
+  xTaskNotifyGive(_fsTask);
+}
+
+void FtpServer::pollFsJob()
+{
+  FsJob *job;
+  if (_fsCompletions.pop(job))
+  {
+    _fsPending = false;
+    completeFsJob();
+  }
+}
+
+// Runs on the I/O task when async, touches nothing but the filesystem and job
+void FtpServer::runFsJob(FsJob &job)
+{
+  job.result = FTP_FS_FAILED;
+  switch (job.op)
+  {
+  case FTP_FS_DELE:
+  {
+    // Sizes for SITE DU and AVBL, measured on the way
+    File file = _fs.open(job.path, "r");
+    if (!file)
+    {
+      job.result = FTP_FS_NOT_FOUND;
+      break;
+    }
+    job.stored = file.size();
+    job.size = file.isDirectory() ? 0 : logicalSize(file);
+    file.close();
+    if (_fs.remove(job.path))
+      job.result = FTP_FS_OK;
+    break;
+  }
+
+  case FTP_FS_MKD:
+    if (_fs.mkdir(job.path))
+      job.result = FTP_FS_OK;
+    break;
+
+  case FTP_FS_RMD:
+  {
+    File dir = _fs.open(job.path);
+    if (!dir || !dir.isDirectory())
+    {
+      job.result = FTP_FS_NOT_FOUND;
+      if (dir)
+        dir.close();
+      break;
+    }
+
+    // Check for empty directory, the listing index doesn't count
+    File file = dir.openNextFile();
+    while (file && strcmp(file.name(), FTP_INDEX_NAME) == 0)
+    {
+      file.close();
+      file = dir.openNextFile();
+    }
+    if (file)
+    {
+      job.result = FTP_FS_NOT_EMPTY;
+      file.close();
+      dir.close();
+      break;
+    }
+    dir.close();
+
+    // rmdir() needs the index file gone; the index object stays on the
+    // session task, completeFsJob() updates the parent's index
+    char indexFile[FTP_CWD_SIZE + sizeof(FTP_INDEX_NAME) + 1];
+    snprintf(indexFile, sizeof(indexFile), "%s/" FTP_INDEX_NAME, strcmp(job.path, "/") == 0 ? "" : job.path);
+    if (_fs.exists(indexFile))
+      _fs.remove(indexFile);
+    if (_fs.rmdir(job.path))
+      job.result = FTP_FS_OK;
+    break;
+  }
+
+  case FTP_FS_RNFR:
+    job.result = _fs.exists(job.path) ? FTP_FS_OK : FTP_FS_NOT_FOUND;
+    break;
+
+  case FTP_FS_RNTO:
+    if (_fs.exists(job.target))
+    {
+      job.result = FTP_FS_EXISTS;
+    }
+    else if (_fs.rename(job.path, job.target))
+    {
+      job.result = FTP_FS_OK;
+      job.size = 0;
+      job.isDir = false;
+      File file = _fs.open(job.target, "r");
+      if (file)
+      {
+        job.isDir = file.isDirectory();
+        job.size = job.isDir ? 0 : logicalSize(file);
+        file.close();
+      }
+    }
+    break;
+  }
+}
+
+void FtpServer::completeFsJob()
+{
+  const FsJob &job = *_fsJob;
+
+  // The session that asked may be gone: keep the index right, drop the reply
+  bool reply = job.session == _counters.sessions && _cmdStatus == FTP_CMD_WAIT_COMMAND;
+  const char *message = nullptr;
+  switch (job.op)
+  {
+  case FTP_FS_DELE:
+    if (job.result == FTP_FS_OK)
+    {
+      _index.remove(job.logical);
+      if (_hashTrees)
+        _uploadTree.remove(job.logical);
+      _du.adjust(job.logical, -(int64_t)job.size, -1, 0);
+      adjustFreeSpace(0, job.stored);
+      message = "250 File deleted";
+    }
+    else
+    {
+      message = job.result == FTP_FS_NOT_FOUND ? "550 File not found" : "450 Could not delete file";
+    }
+    break;
+
+  case FTP_FS_MKD:
+    if (job.result == FTP_FS_OK)
+    {
+      _index.add(job.path, 0, true);
+      _du.adjust(job.logical, 0, 0, 1);
+      if (reply)
+        _client.println("257 \"" + String(job.logical) + "\" created");
+    }
+    else
+    {
+      message = "550 Can't create directory";
+    }
+    break;
+
+  case FTP_FS_RMD:
+    if (job.result == FTP_FS_OK)
+    {
+      _index.remove(job.path);
+      _du.remove(job.logical);
+      _du.adjust(job.logical, 0, 0, -1);
+      message = "250 Directory removed";
+    }
+    else if (job.result == FTP_FS_NOT_FOUND)
+      message = "550 Not a directory or doesn't exist";
+    else if (job.result == FTP_FS_NOT_EMPTY)
+      message = "550 Directory not empty";
+    else
+      message = "550 Could not remove directory";
+    break;
+
+  case FTP_FS_RNFR:
+    if (job.result == FTP_FS_OK)
+    {
+      _rnfrCmd = reply;
+      message = "350 RNFR accepted - ready for destination";
+    }
+    else
+    {
+      message = "550 File not found";
+    }
+    break;
+
+  case FTP_FS_RNTO:
+    if (job.result == FTP_FS_OK)
+    {
+      _index.remove(_renameFrom);
+      _index.add(job.logical, job.size, job.isDir);
+      if (job.isDir)
+      {
+        _du.clear(); // Cached totals below it are keyed by the old path
+      }
+      else
+      {
+        _du.adjust(_renameFrom, -(int64_t)job.size, -1, 0);
+        _du.adjust(job.logical, job.size, 1, 0);
+        if (_hashTrees)
+          _uploadTree.rename(_renameFrom, job.logical);
+      }
+      message = "250 Rename successful";
+    }
+    else
+    {
+      message = job.result == FTP_FS_EXISTS ? "553 Destination already exists" : "553 Rename failed";
+    }
+    _rnfrCmd = false;
+    break;
+  }
+
+  if (reply && message != nullptr)
+  {
+    _client.println(message);
+  }
+}
+
+bool FtpServer::startFsTask()
 {
+  TaskHandle_t task = nullptr;
+  if (xTaskCreate(fsTask, "ftpFs", FTP_FS_STACK_SIZE, this, FTP_FS_PRIORITY, &task) != pdPASS)
+  {
+    return false;
+  }
+  _fsTask = task;
+  return true;
+}
+
+void FtpServer::stopFsTask()
+{
+  if (_fsTask == nullptr)
+  {
+    return;
+  }
+
+  // Let a running job finish, then ask the task to exit and wait for it
+  FsJob *job;
+  while (_fsPending)
+  {
+    pollFsJob();
+    vTaskDelay(1);
+  }
+  _fsRequests.push(nullptr);
+  xTaskNotifyGive(_fsTask);
+  while (!_fsCompletions.pop(job))
+  {
+    vTaskDelay(1);
+  }
+  _fsTask = nullptr;
+}
+
+void FtpServer::fsTask(void *arg)
+{
+  FtpServer &server = *(FtpServer *)arg;
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    FsJob *job;
+    while (server._fsRequests.pop(job))
+    {
+      if (job == nullptr)
+      {
+        // Acknowledge and stop touching the server, which may go away now
+        server._fsCompletions.push(nullptr);
+        vTaskDelete(nullptr);
+        return;
+      }
+      server.runFsJob(*job);
+      server._fsCompletions.push(job);
+    }
+  }
+}
+
+void FtpServer::handleDeleCommand()
+{
+  if (strlen(_parameters) == 0)
+  {
+    _client.println("501 No filename given");
+    return;
+  }
+
+  FsJob &job = *_fsJob;
+  if (!makeWritablePath(job.path, sizeof(job.path)))
+  {
+    return;
+  }
+  strlcpy(job.logical, job.path, sizeof(job.logical));
+  shardPath(job.path, sizeof(job.path), false);
+
+  if (FtpLockTable::shared().isWriting(&_fs, job.path))
+  {
+    _client.println("450 File busy, try again later");
+    return;
+  }
+
+  const char *packName = _pack.nameFor(job.path);
+  if (packName != nullptr && _pack.exists(packName))
+  {
+    if (_pack.isWriting())
+    {
+      _client.println("450 File busy, try again later");
+      return;
+    }
+
+    uint32_t size = 0;
+    _pack.stat(packName, size);
+    if (_pack.remove(packName))
+    {
+      _index.remove(job.logical);
+      if (_hashTrees)
+        _uploadTree.remove(job.logical);
+      _du.adjust(job.logical, -(int64_t)size, -1, 0);
+      _client.println("250 File deleted");
+    }
+    else
+    {
+      _client.println("450 Could not delete file");
+    }
+    return;
+  }
+
+  submitFsJob(FTP_FS_DELE);
+}
+
+void FtpServer::handleMkdCommand()
+{
+  if (strlen(_parameters) == 0)
+  {
+    _client.println("501 No directory name given");
+    return;
+  }
+
+  FsJob &job = *_fsJob;
+  if (!makeWritablePath(job.path, sizeof(job.path)))
+  {
+    return;
+  }
+
+  // The sharded directory is flat
+  if (shardPath(job.path, sizeof(job.path), false))
+  {
+    _client.println("550 Can't create directory");
+    return;
+  }
+
+  // The pack directory is flat
+  if (_pack.nameFor(job.path) != nullptr)
+  {
+    _client.println("550 Can't create directory");
+    return;
+  }
+
+  strlcpy(job.logical, job.path, sizeof(job.logical));
+  submitFsJob(FTP_FS_MKD);
+}
+
+void FtpServer::handleRmdCommand()
+{
+  if (strlen(_parameters) == 0)
+  {
+    _client.println("501 No directory name given");
+    return;
+  }
+
+  FsJob &job = *_fsJob;
+  if (!makeWritablePath(job.path, sizeof(job.path)))
+  {
+    return;
+  }
+  strlcpy(job.logical, job.path, sizeof(job.logical));
+  submitFsJob(FTP_FS_RMD);
+}
+
+void FtpServer::handleRnfrCommand()
+{
+  if (strlen(_parameters) == 0)
+  {
+    _client.println("501 No filename given");
+    return;
+  }
+
+  if (!makeWritablePath(_renameFrom, sizeof(_renameFrom)))
+  {
+    return;
+  }
+
+  // _renameFrom keeps the client-visible path, RNTO maps it again
+  FsJob &job = *_fsJob;
+  strlcpy(job.path, _renameFrom, sizeof(job.path));
+  shardPath(job.path, sizeof(job.path), false);
+
+  const char *packName = _pack.nameFor(job.path);
+  if (packName != nullptr && _pack.exists(packName))
+  {
+    _rnfrCmd = true;
+    _client.println("350 RNFR accepted - ready for destination");
+    return;
+  }
+
+  submitFsJob(FTP_FS_RNFR);
+}
+
+void FtpServer::handleRntoCommand()
+{
+  if (!_rnfrCmd)
+  {
+    _client.println("503 RNFR required first");
+    return;
+  }
+
   if (strlen(_parameters) == 0)
   {
     _client.println("501 No filename given");
+    _rnfrCmd = false;
     return;
   }
 
+  FsJob &job = *_fsJob;
+  if (!makeWritablePath(job.target, sizeof(job.target)))
+  {
+    _rnfrCmd = false;
+    return;
+  }
+  strlcpy(job.logical, job.target, sizeof(job.logical));
+  shardPath(job.target, sizeof(job.target), true);
+
+  strlcpy(job.path, _renameFrom, sizeof(job.path));
+  shardPath(job.path, sizeof(job.path), false);
+
+  FtpLockTable &locks = FtpLockTable::shared();
+  if (locks.isWriting(&_fs, job.path) || locks.isWriting(&_fs, job.target))
+  {
+    _client.println("450 File busy, try again later");
+    _rnfrCmd = false;
+    return;
+  }
+
+  const char *packFrom = _pack.nameFor(job.path);
+  const char *packTo = _pack.nameFor(job.target);
+  if (packFrom != nullptr && !_pack.exists(packFrom))
+  {
+    packFrom = nullptr; // Plain file left in the pack directory
+  }
+
+  if (packFrom == nullptr && packTo == nullptr)
+  {
+    submitFsJob(FTP_FS_RNTO);
+    return;
+  }
+
+  // Records can't be moved in or out of the pack by a rename
+  uint32_t size = 0;
+  uint64_t oldSize;
+  uint32_t oldStamp = 0;
+  if (_hashTrees && packFrom != nullptr)
+    hashTreeTarget(job.path, oldSize, oldStamp);
+  if (_fs.exists(job.target) || (packTo != nullptr && _pack.exists(packTo)))
+  {
+    _client.println("553 Destination already exists");
+  }
+  else if (packFrom != nullptr && packTo != nullptr && _pack.isWriting())
+  {
+    _client.println("450 File busy, try again later");
+  }
+  else if (packFrom != nullptr && packTo != nullptr && _pack.rename(packFrom, packTo))
+  {
+    _pack.stat(packTo, size);
+    _index.remove(_renameFrom);
+    _index.add(job.logical, size, false);
+    if (_hashTrees)
+    {
+      // The record was copied, so the tree follows it to the new offset
+      uint64_t treeSize;
+      uint32_t newStamp;
+      _uploadTree.rename(_renameFrom, job.logical);
+      if (hashTreeTarget(job.target, treeSize, newStamp))
+        _uploadTree.restamp(job.logical, oldStamp, newStamp);
+    }
+    _client.println("250 Rename successful");
+  }
+  else
+  {
+    _client.println("553 Rename failed");
+  }
+  _rnfrCmd = false;
+}
+
+void FtpServer::handleSizeCommand()
+{
+  if (strlen(_parameters) == 0)
+  {
+    _client.println("501 No filename given");
+    return;
+  }
+
+  char path[FTP_CWD_SIZE];
+  if (!makePath(path, sizeof(path)))
+  {
+    return;
+  }
+  shardPath(path, sizeof(path), false);
+
+  uint32_t size;
+  const char *packName = _pack.nameFor(path);
+  if (packName != nullptr && _pack.stat(packName, size))
+  {
+    _client.println("213 " + String(size));
+    return;
+  }
+
+  File file = _fs.open(path, "r");
+  if (!file)
+  {
+    _client.println("550 File not found");
+    return;
+  }
+
+  char response[32];
+  snprintf(response, sizeof(response), "213 %llu", (unsigned long long)logicalSize(file));
+  _client.println(response);
+  file.close();
+}
+
+void FtpServer::handleRestCommand()
+{
+  char *end;
+  errno = 0;
+  unsigned long long offset = strtoull(_parameters, &end, 10);
+  if (_parameters[0] < '0' || _parameters[0] > '9' || *end != '\0' || errno == ERANGE)
+  {
+    _client.println("501 Invalid restart offset");
+    return;
+  }
+
+  _restartOffset = offset;
+  char response[64];
+  snprintf(response, sizeof(response), "350 Restarting at %llu, send RETR", offset);
+  _client.println(response);
+}
+
+void FtpServer::handleSiteCommand()
+{
+  // SITE <subcommand> [arguments]
+  char *args = strchr(_parameters, ' ');
+  if (args != nullptr)
+  {
+    *args++ = '\0';
+    while (*args == ' ')
+      args++;
+  }
+  else
+  {
+    args = _parameters + strlen(_parameters);
+  }
+
+  for (char *p = _parameters; *p; p++)
+    *p = toupper(*p);
+
+  if (strcmp(_parameters, "LISTPAGE") == 0)
+  {
+    handleSiteListPage(args);
+  }
+  else if (strcmp(_parameters, "HEAP") == 0)
+  {
+    handleSiteHeap();
+  }
+  else if (strcmp(_parameters, "DU") == 0)
+  {
+    handleSiteDu(args);
+  }
+  else if (strcmp(_parameters, "TOKEN") == 0)
+  {
+    handleSiteToken();
+  }
+  else if (strcmp(_parameters, "HASHTREE") == 0)
+  {
+    handleSiteHashTree(args);
+  }
+  else
+  {
+    _client.println("504 Unknown SITE command");
+  }
+}
+
+void FtpServer::handleSiteListPage(char *args)
+{
+  // Arguments are <path> <cursor> <count>, the path may contain spaces
+  char *countArg = strrchr(args, ' ');
+  char *cursorArg = nullptr;
+  if (countArg != nullptr)
+  {
+    *countArg++ = '\0';
+    cursorArg = strrchr(args, ' ');
+  }
+  if (cursorArg == nullptr)
+  {
+    _client.println("501 Usage: SITE LISTPAGE <path> <cursor> <count>");
+    return;
+  }
+  *cursorArg++ = '\0';
+
+  uint32_t count = strtoul(countArg, nullptr, 10);
+  if (count == 0 || count > FTP_LISTPAGE_MAX)
+  {
+    count = FTP_LISTPAGE_MAX;
+  }
+
+  char path[FTP_CWD_SIZE];
+  if (!makePath(path, sizeof(path), args))
+  {
+    return;
+  }
+
+  // Pages are positions in the index: without one each page would walk the
+  // directory again, and entries created or deleted meanwhile would shift
+  if (!_index.isEnabled())
+  {
+    _client.println("502 SITE LISTPAGE needs the listing index");
+    return;
+  }
+
+  File indexFile;
+  FtpListingIndex::Header header;
+  if (!_index.open(path, indexFile, header))
+  {
+    // Build the index once so every later page is a bounded read
+    bool rebuild = _index.beginRebuild(path, indexFile);
+    bool found = walkDirectory(path, [&](const char *name, uint64_t size, bool isDir)
+                               {
+                                 if (rebuild)
+                                   _index.addLine(indexFile, name, size, isDir);
+                                 return rebuild; });
+    if (rebuild)
+    {
+      if (found)
+        _index.commitRebuild(path, indexFile);
+      else
+        _index.abortRebuild(path, indexFile);
+    }
+    if (!found)
+    {
+      _client.println("550 Directory not found");
+      return;
+    }
+    if (!_index.open(path, indexFile, header))
+    {
+      _client.println("451 Can't index directory");
+      return;
+    }
+  }
+
+  // The cursor is the index epoch and the byte offset of the next line
+  uint32_t sent = 0;
+  char next[20] = "";
+  uint32_t epoch = header.epoch;
+  uint32_t offset = sizeof(header);
+  if (strcmp(cursorArg, "0") != 0 &&
+      (sscanf(cursorArg, "I%8x%8x", &epoch, &offset) != 2 || epoch != header.epoch ||
+       offset < sizeof(header) || offset > header.length || !indexFile.seek(offset, SeekSet)))
+  {
+    _client.println("501 Invalid or expired cursor");
+    indexFile.close();
+    return;
+  }
+
+  _client.println("250-Listing " + String(path));
+  FtpListingIndex::readLines(indexFile, [&](char *line, size_t len, uint32_t lineOffset)
+                             {
+                               if (line[0] == ' ')
+                                 return true; // Removed entry
+                               if (sent == count)
+                               {
+                                 snprintf(next, sizeof(next), "I%08x%08x", (unsigned)epoch, (unsigned)lineOffset);
+                                 return false;
+                               }
+                               _client.print(" ");
+                               _client.write((uint8_t *)line, len);
+                               sent++;
+                               return true; });
+  indexFile.close();
+
+  if (next[0] != '\0')
+  {
+    _client.println("250 NEXT " + String(next));
+  }
+  else
+  {
+    _client.println("250 END");
+  }
+}
+
+void FtpServer::handleSiteHeap()
+{
+  HeapStats stats = getHeapStats();
+  char response[128];
+  snprintf(response, sizeof(response), "200 Free=%u MinFree=%u MaxBlock=%u Frag=%u%% Commands=%u",
+           (unsigned)stats.freeBytes, (unsigned)stats.minFreeBytes, (unsigned)stats.largestBlock,
+           (unsigned)stats.fragmentation, (unsigned)stats.commands);
+  _client.println(response);
+}
+
+void FtpServer::handleSiteDu(char *args)
+{
+  char path[FTP_CWD_SIZE];
+  if (!makePath(path, sizeof(path), args))
+  {
+    return;
+  }
+
+  FtpDiskUsage::Totals totals;
+  if (!sumDirectory(path, totals, 0))
+  {
+    _client.println("550 Directory not found");
+    return;
+  }
+
+  char response[128];
+  snprintf(response, sizeof(response), "200 Bytes=%llu Files=%u Dirs=%u", (unsigned long long)totals.bytes,
+           (unsigned)totals.files, (unsigned)totals.dirs);
+  _client.println(response);
+}
+
+void FtpServer::handleSiteToken()
+{
+  if (_tokenTtl == 0)
+  {
+    _client.println("502 Session tokens disabled");
+    return;
+  }
+
+  FtpSessionTokens::Session session;
+  if (strlcpy(session.cwd, _cwd, sizeof(session.cwd)) >= sizeof(session.cwd))
+  {
+    _client.println("550 Current directory too long for a token");
+    return;
+  }
+  session.type = _transferType;
+
+  char token[FTP_TOKEN_LENGTH + 1];
+  if (!_tokens.issue(_username.c_str(), session, esp_random(), millis(), _tokenTtl, token, sizeof(token)))
+  {
+    _client.println("451 Token not issued");
+    return;
+  }
+
+  // 200 <token> <seconds valid>
+  char response[64];
+  snprintf(response, sizeof(response), "200 %s %u", token, (unsigned)(_tokenTtl / 1000));
+  _client.println(response);
+}
+
+void FtpServer::handleSiteHashTree(char *args)
+{
+  if (!_hashTrees)
+  {
+    _client.println("502 Hash trees disabled");
+    return;
+  }
+
+  // Arguments are <path> <level>[:<first>], the path may contain spaces
+  char *levelArg = strrchr(args, ' ');
+  if (levelArg == nullptr)
+  {
+    _client.println("501 Usage: SITE HASHTREE <path> <level>[:<first>]");
+    return;
+  }
+  *levelArg++ = '\0';
+  char *end;
+  uint32_t level = strtoul(levelArg, &end, 10);
+  uint32_t first = *end == ':' ? strtoul(end + 1, &end, 10) : 0;
+  if (end == levelArg || *end != '\0')
+  {
+    _client.println("501 Usage: SITE HASHTREE <path> <level>[:<first>]");
+    return;
+  }
+
+  char logical[FTP_CWD_SIZE];
+  char path[FTP_CWD_SIZE];
+  if (!makePath(logical, sizeof(logical), args))
+  {
+    return;
+  }
+  strlcpy(path, logical, sizeof(path));
+  shardPath(path, sizeof(path), false);
+
+  uint64_t size;
+  uint32_t stamp;
+  if (!hashTreeTarget(path, size, stamp))
+  {
+    _client.println("550 File not found");
+    return;
+  }
+
+  File tree;
+  FtpHashTree::Header header;
+  if (!_uploadTree.open(logical, size, stamp, tree, header))
+  {
+    // Built a buffer at a time from handleFTP(), the client asks again later
+    char response[80];
+    if (_lazyTree.isBuilding(logical))
+    {
+      snprintf(response, sizeof(response), "450 Building hash tree, %u%% done",
+               size > 0 ? (unsigned)(_lazyTree.size() * 100 / size) : 0u);
+    }
+    else if (_lazyTree.isActive() || _uploadTree.isBuilding(logical))
+    {
+      strlcpy(response, "450 Busy hashing another file, try again later", sizeof(response));
+    }
+    else if (startHashBuild(logical, path, stamp))
+    {
+      strlcpy(response, "450 Building hash tree, try again later", sizeof(response));
+    }
+    else
+    {
+      strlcpy(response, "451 Can't build hash tree", sizeof(response));
+    }
+    _client.println(response);
+    return;
+  }
+
+  uint8_t depth = FtpHashTree::depth(header);
+  uint32_t count = level <= depth ? FtpHashTree::levelCount(header, level) : 0;
+  if (level > depth || first >= count)
+  {
+    char response[64];
+    if (level > depth)
+      snprintf(response, sizeof(response), "501 Level out of range, depth is %u", (unsigned)depth);
+    else
+      snprintf(response, sizeof(response), "501 First node out of range, level has %u", (unsigned)count);
+    _client.println(response);
+    tree.close();
+    return;
+  }
+
+  // 213-<summary>, then one " <index> <offset> <length> <sha256>" line per node
+  char line[160];
+  snprintf(line, sizeof(line), "213-Size=%llu Chunk=%u Depth=%u Level=%u Nodes=%u First=%u",
+           (unsigned long long)size, (unsigned)header.chunkSize, (unsigned)depth, (unsigned)level,
+           (unsigned)count, (unsigned)first);
+  _client.println(line);
+
+  uint64_t span = (uint64_t)header.chunkSize << (depth - level);
+  uint32_t last = min(count, first + FTP_HASH_REPLY_NODES);
+  for (uint32_t index = first; index < last; index++)
+  {
+    uint8_t digest[FTP_HASH_DIGEST_SIZE];
+    if (!FtpHashTree::readNode(tree, header, level, index, digest))
+    {
+      break;
+    }
+    uint64_t offset = index * span;
+    int len = snprintf(line, sizeof(line), " %u %llu %llu ", (unsigned)index, (unsigned long long)offset,
+                       (unsigned long long)min(span, size - offset));
+    for (size_t i = 0; i < sizeof(digest); i++)
+    {
+      len += snprintf(line + len, sizeof(line) - len, "%02x", digest[i]);
+    }
+    _client.println(line);
+  }
+  tree.close();
+  _client.println("213 End");
+}
+
+void FtpServer::handleAvblCommand()
+{
+  uint64_t bytes;
+  if (!getFreeSpace(bytes))
+  {
+    _client.println("550 Free space unknown");
+    return;
+  }
+
+  char response[32];
+  snprintf(response, sizeof(response), "213 %llu", (unsigned long long)bytes);
+  _client.println(response);
+}
+
+void FtpServer::handleTypeCommand()
+{
+  if (strcmp(_parameters, "A") == 0)
+  {
+    _transferType = 'A';
+    _client.println("200 Type set to ASCII");
+  }
+  else if (strcmp(_parameters, "I") == 0)
+  {
+    _transferType = 'I';
+    _client.println("200 Type set to binary");
+  }
+  else
+  {
+    _client.println("504 Unsupported type");
+  }
+}
+
+void FtpServer::handleAuthCommand()
+{
+  if (_tls == nullptr)
+  {
+    _client.println("502 TLS not configured");
+    return;
+  }
+  if (_client.isSecure() || _cmdStatus != FTP_CMD_WAIT_USER)
+  {
+    _client.println("503 AUTH must come first");
+    return;
+  }
+  if (strcasecmp(_parameters, "TLS") != 0 && strcasecmp(_parameters, "TLS-C") != 0 &&
+      strcasecmp(_parameters, "SSL") != 0)
+  {
+    _client.println("504 Unsupported security mechanism");
+    return;
+  }
+
+  // Drop the rest of the line and anything pipelined after it, so nothing
+  // sent in the clear is read as if it came over TLS
+  while (_client.available() > 0)
+  {
+    _client.read();
+  }
+
+  // The reply goes out in the clear, the handshake follows on the next read
+  _client.println("234 AUTH TLS successful");
+  if (!_client.startTls(*_tls))
+  {
+    if (_log == FTPLog::ENABLE)
+      LOG_WARN("Out of memory for a TLS session");
+    _client.stop();
+  }
+}
+
+void FtpServer::handlePbszCommand()
+{
+  // Stream TLS has no protection buffer, RFC 4217 says to answer 0
+  if (!_client.isSecure())
+  {
+    _client.println("503 PBSZ requires AUTH TLS");
+    return;
+  }
+  _client.println("200 PBSZ=0");
+}
+
+void FtpServer::handleProtCommand()
+{
+  if (!_client.isSecure())
+  {
+    _client.println("503 PROT requires AUTH TLS");
+  }
+  else if (strcasecmp(_parameters, "P") == 0)
+  {
+    _protPrivate = true;
+    _client.println("200 Protection level set to Private");
+  }
+  else if (strcasecmp(_parameters, "C") == 0)
+  {
+    if (_tlsRequired)
+    {
+      _client.println("534 Data connections must be protected");
+      return;
+    }
+    _protPrivate = false;
+    _client.println("200 Protection level set to Clear");
+  }
+  else
+  {
+    _client.println("536 Protection level not supported");
+  }
+}
+
+void FtpServer::handleNoopCommand()
+{
+  _client.println("200 NOOP command successful");
+}
+
+void FtpServer::handleAborCommand()
+{
+  abortTransfer();
+  _client.println("226 ABOR command successful");
+}
+
+void FtpServer::handleSystCommand()
+{
+  _client.println("215 UNIX Type: L8");
+}
+
+void FtpServer::handleFeatCommand()
+{
+  _client.println("211-Extensions supported:");
+  _client.println(" MLST");
+  _client.println(" SIZE");
+  _client.println(" MDTM");
+  _client.println(" PASV");
+  _client.println(" EPSV");
+  _client.println("211 END");
+}
+
+bool FtpServer::dataConnect()
+{
+  if (_data.connected())
+  {
+    return true;
+  }
+
+  if (_dataConnType == FTP_DATA_PASSIVE)
+  {
+    unsigned long start = millis();
+    while (!dataServer.hasClient() && (millis() - start < 10000))
+    {
+      delay(10);
+    }
+
+    if (dataServer.hasClient())
+    {
+      _data.stop();
+      _data = dataServer.accept();
+    }
+  }
+  else
+  {
+    // Active mode connection
+    _data.stop();
+    _data.connect(_dataIp, _dataPort);
+  }
+
+  if (!_data.connected())
+  {
+    return false;
+  }
+  if (_tlsRequired && !_protPrivate)
+  {
+    _data.stop(); // Accepted only to take it off the listen queue
+    return false;
+  }
+  // The handshake runs on the first transfer call, after the 150 reply,
+  // which is when clients start it
+  if (_protPrivate && !_data.startTls(*_tls))
+  {
+    _data.stop();
+    return false;
+  }
+  return true;
+}
+
+void FtpServer::handleDataTransfers()
+{
+  if (_transferStatus == FTP_TRANSFER_RETR)
+  {
+    if (!doRetrieve())
+    {
+      _transferStatus = FTP_TRANSFER_IDLE;
+    }
+  }
+  else if (_transferStatus == FTP_TRANSFER_STOR)
+  {
+    if (!doStore())
+    {
+      _transferStatus = FTP_TRANSFER_IDLE;
+    }
+  }
+}
+
+// Data transfers talk to the lwIP socket directly: WiFiClient::read() copies
+// through its own receive buffer and WiFiClient::write() blocks in select()
+// until the whole chunk is queued. Both calls here are non-blocking, so a
+// full or empty socket returns to the loop instead of stalling it. Under
+// PROT P they go through mbedTLS, which also drives the handshake a step at
+// a time.
+
+bool FtpServer::doRetrieve()
+{
+  // Read the next chunk only once the socket took all of the previous one
+  if (_sendOffset == _sendLength)
+  {
+    // Packed files end where their record ends, not at the end of the segment
+    size_t length = (size_t)min((uint64_t)_bufferSize, _bytesRemaining);
+    int bytesRead = _compressReader.isActive() ? _compressReader.read((uint8_t *)_buffer, length)
+                                               : _file.read((uint8_t *)_buffer, length);
+    if (bytesRead < 0)
+    {
+      abortTransfer();
+      return false;
+    }
+    if (bytesRead == 0)
+    {
+      closeTransfer();
+      return false;
+    }
+    _sendOffset = 0;
+    _sendLength = bytesRead;
+    _bytesRemaining -= bytesRead;
+  }
+
+  int sent = _data.sendNonBlocking((const uint8_t *)_buffer + _sendOffset, _sendLength - _sendOffset);
+  if (sent > 0)
+  {
+    _sendOffset += sent;
+    _bytesTransferred += sent;
+    _millisLastData = millis();
+    return true;
+  }
+  if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && millis() - _millisLastData < _activeTimeout)
+  {
+    return true; // Socket full, try again on the next call
+  }
+
+  abortTransfer();
+  return false;
+}
+
+bool FtpServer::doStore()
+{
+  int bytesRead = _data.recvNonBlocking((uint8_t *)_buffer, _bufferSize);
+  if (bytesRead > 0)
+  {
+    if (_packTransfer && _bytesTransferred + bytesRead > FTP_PACK_MAX_FILE_SIZE && !spillPackUpload())
+    {
+      abortTransfer();
+      return false;
+    }
+    // A full disk or short write must never reach the commit in closeTransfer()
+    bool written = _compressWriter.isActive() ? _compressWriter.write((uint8_t *)_buffer, bytesRead)
+                                              : _file.write((uint8_t *)_buffer, bytesRead) == (size_t)bytesRead;
+    if (!written)
+    {
+      abortTransfer();
+      return false;
+    }
+    if (_uploadTree.isActive())
+      _uploadTree.update((uint8_t *)_buffer, bytesRead);
+    _bytesTransferred += bytesRead;
+    _millisLastData = millis();
+    return true;
+  }
+  if (bytesRead == 0)
+  {
+    // The client closes the data connection at the end of the upload
+    closeTransfer();
+    return false;
+  }
+  if ((errno == EAGAIN || errno == EWOULDBLOCK) && millis() - _millisLastData < _activeTimeout)
+  {
+    return true; // Nothing received yet
+  }
+
+  // Reset, timed out or a broken TLS record: the upload may be truncated
+  abortTransfer();
+  return false;
+}
+
+void FtpServer::closeTransfer()
+{
+  bool stored = true;
+  uint64_t storedBytes = _bytesTransferred;
+  uint32_t stamp = 0;
+  if (_packTransfer)
+  {
+    _packTransfer = false;
+    stored = _pack.commitWrite(_file, _bytesTransferred);
+    char path[FTP_CWD_SIZE];
+    uint64_t size;
+    transferFilePath(path, sizeof(path));
+    if (stored && _fs.exists(path))
+    {
+      // A plain file left from before packing would be listed next to the
+      // record; it goes only once the record replacing it is committed
+      _fs.remove(path);
+    }
+    if (stored && !hashTreeTarget(path, size, stamp))
+      _uploadTree.abort();
+  }
+  else if (_transferStatus == FTP_TRANSFER_STOR)
+  {
+    if (_compressWriter.isActive())
+    {
+      stored = _compressWriter.finish();
+      if (stored)
+      {
+        storedBytes = _file.size();
+        _counters.compressedLogical += _bytesTransferred;
+        _counters.compressedStored += storedBytes;
+      }
+    }
+    _file.close();
+
+    // Renaming keeps the upload's last write time, even when deferred
+    char path[FTP_CWD_SIZE];
+    char temp[FTP_CWD_SIZE];
+    transferFilePath(path, sizeof(path));
+    uploadPath(path, temp, sizeof(temp));
+    stamp = fileStamp(temp);
+    if (!stored || !commitUpload())
+    {
+      stored = false;
+      removePartialUpload();
+    }
+    else if (_packSpilled)
+    {
+      // The record this upload replaces would shadow the plain file
+      const char *packName = _pack.nameFor(path);
+      if (packName != nullptr && _pack.exists(packName))
+        _pack.remove(packName);
+    }
+  }
+  _compressReader.end();
+
+  if (!stored)
+  {
+    _uploadTree.abort();
+    _trace.transfer(millis(), true, _bytesTransferred, millis() - _millisBeginTransfer, false);
+    _counters.transferErrors++;
+    _client.println("451 Can't store file");
+    _data.stop();
+    releaseTransferLock();
+    _transferStatus = FTP_TRANSFER_IDLE;
+    return;
+  }
+
+  if (_transferStatus == FTP_TRANSFER_STOR)
+  {
+    if (_uploadTree.isActive())
+    {
+      _counters.hashTrees += _uploadTree.finish(stamp) ? 1 : 0;
+    }
+    else if (_hashTrees && _transferReplaces)
+    {
+      _uploadTree.remove(_transferPath);
+    }
+    if (_transferReplaces)
+    {
+      _index.remove(_transferPath);
+    }
+    _index.add(_transferPath, _bytesTransferred, false);
+    _du.adjust(_transferPath, (int64_t)_bytesTransferred - (int64_t)_transferOldSize, _transferReplaces ? 0 : 1, 0);
+    adjustFreeSpace(storedBytes, _transferOldStored);
+  }
+
+  uint32_t duration = millis() - _millisBeginTransfer;
+  _trace.transfer(millis(), _transferStatus == FTP_TRANSFER_STOR, _bytesTransferred, duration, true);
+  (_transferStatus == FTP_TRANSFER_STOR ? _counters.bytesReceived : _counters.bytesSent) += _bytesTransferred;
+  _counters.transfers++;
+  if (duration > 0 && _bytesTransferred > 0)
+  {
+    double rate = (_bytesTransferred * 1000.0) / (duration * 1024.0);
+    _client.println("226 Transfer complete (" + String(rate, 2) + " kB/s)");
+  }
+  else
+  {
+    _client.println("226 Transfer complete");
+  }
+
+  _file.close();
+  _data.stop();
+  releaseTransferLock();
+  _transferStatus = FTP_TRANSFER_IDLE;
+}
+
+void FtpServer::abortTransfer()
+{
+  if (_transferStatus != FTP_TRANSFER_IDLE)
+  {
+    // Uploads never touch the previous file, so the index and the totals
+    // stay valid: a pack record is only committed on close and other files
+    // are written next to their target. Only an orderly close of the data
+    // connection commits; every other end of a STOR lands here
+    if (_packTransfer)
+    {
+      _packTransfer = false;
+      _pack.abortWrite(_file);
+    }
+    else if (_transferStatus == FTP_TRANSFER_STOR)
+    {
+      _compressWriter.abort();
+      removePartialUpload();
+    }
+    _uploadTree.abort();
+    _compressReader.end();
+    _trace.transfer(millis(), _transferStatus == FTP_TRANSFER_STOR, _bytesTransferred,
+                    millis() - _millisBeginTransfer, false);
+    _counters.transferErrors++;
+    _file.close();
+    _data.stop();
+    releaseTransferLock();
+    _client.println("426 Transfer aborted");
+    _transferStatus = FTP_TRANSFER_IDLE;
+  }
+}
+
+void FtpServer::removePartialUpload()
+{
+  _file.close();
+  char path[FTP_CWD_SIZE];
+  char temp[FTP_CWD_SIZE];
+  transferFilePath(path, sizeof(path));
+  if (uploadPath(path, temp, sizeof(temp)))
+  {
+    _fs.remove(temp);
+  }
+}
+
+bool FtpServer::spillPackUpload()
+{
+  // Too big for the pack: carry on as a plain upload next to the target
+  char path[FTP_CWD_SIZE];
+  char temp[FTP_CWD_SIZE];
+  transferFilePath(path, sizeof(path));
+  File target = uploadPath(path, temp, sizeof(temp)) ? _fs.open(temp, "w") : File();
+  if (!target)
+  {
+    return false;
+  }
+
+  bool ok = _pack.spillWrite(_file, target);
+  _file = target;
+  _packTransfer = false;
+  _packSpilled = true;
+  return ok; // On failure the abort removes the partial upload
+}
+
+void FtpServer::transferFilePath(char *path, size_t size)
+{
+  strlcpy(path, _transferPath, size);
+  shardPath(path, size, false);
+}
+
+bool FtpServer::uploadPath(const char *path, char *temp, size_t size)
+{
+  const char *slash = strrchr(path, '/');
+  int len = snprintf(temp, size, "%.*s" FTP_UPLOAD_PREFIX "%s", (int)(slash - path + 1), path, slash + 1);
+  return len > 0 && (size_t)len < size;
+}
+
+bool FtpServer::commitUpload()
+{
   char path[FTP_CWD_SIZE];
-  if (!makePath(path, sizeof(path)))
+  char temp[FTP_CWD_SIZE];
+  transferFilePath(path, sizeof(path));
+  uploadPath(path, temp, sizeof(temp));
+
+  // LittleFS replaces the target in one step, readers keep the old version
+  if (_fs.rename(temp, path))
   {
-    return;
+    return true;
   }
 
-  File file = LittleFS.open(path, "r");
-  if (!file)
+  // FAT won't rename over a file, and can't remove one that's open: leave
+  // the upload to the last reader of the old version
+  if (FtpLockTable::shared().deferCommit(&_fs, path))
   {
-    _client.println("550 File not found");
-    return;
+    _lockMode = FTP_LOCK_NONE;
+    return true;
   }
-
-  _client.println("213 " + String(file.size()));
-  file.close();
+  _fs.remove(path);
+  return _fs.rename(temp, path);
 }
 
-void FtpServer::handleTypeCommand()
+void FtpServer::releaseTransferLock()
 {
-  if (strcmp(_parameters, "A") == 0)
+  if (_lockMode == FTP_LOCK_NONE)
   {
-    _client.println("200 Type set to ASCII");
+    return;
   }
-  else if (strcmp(_parameters, "I") == 0)
+
+  char path[FTP_CWD_SIZE];
+  transferFilePath(path, sizeof(path));
+  if (_lockMode == FTP_LOCK_WRITE)
   {
-    _client.println("200 Type set to binary");
+    FtpLockTable::shared().unlockWrite(&_fs, path);
   }
   else
   {
-    _client.println("504 Unsupported type");
+    unlockReader(path);
   }
+  _lockMode = FTP_LOCK_NONE;
 }
 
-void FtpServer::handleNoopCommand()
+void FtpServer::unlockReader(const char *path)
 {
-  _client.println("200 NOOP command successful");
+  FtpLockTable &locks = FtpLockTable::shared();
+  if (locks.unlockRead(&_fs, path))
+  {
+    // Last reader of a file whose replacement was waiting for it
+    char temp[FTP_CWD_SIZE];
+    uploadPath(path, temp, sizeof(temp));
+    _fs.remove(path);
+    if (!_fs.rename(temp, path) && _log == FTPLog::ENABLE)
+    {
+      LOG_WARN("Failed to replace %s with its upload", path);
+    }
+    locks.unlockWrite(&_fs, path);
+  }
 }
 
-void FtpServer::handleAborCommand()
+int8_t FtpServer::readCommand()
 {
-  abortTransfer();
-  _client.println("226 ABOR command successful");
+  if (!_client.available())
+  {
+    return -1;
+  }
+
+  char c = _client.read();
+  if (c == '\\')
+    c = '/'; // Normalize path separators
+
+  if (c != '\r' && c != '\n')
+  {
+    if (_cmdBufferIndex < FTP_CMD_SIZE - 1)
+    {
+      _cmdLine[_cmdBufferIndex++] = c;
+    }
+    return -2; // Command too long
+  }
+
+  if (_cmdBufferIndex == 0)
+  {
+    return 0; // Empty line
+  }
+
+  _cmdLine[_cmdBufferIndex] = '\0';
+  _trace.command(millis(), _cmdLine);
+  parseCommandLine();
+  _cmdBufferIndex = 0;
+
+  return 1;
 }
 
-void FtpServer::handleSystCommand()
+void FtpServer::parseCommandLine()
 {
-  _client.println("215 UNIX Type: L8");
+  FtpProtocol::parseCommandLine(_cmdLine, _command, sizeof(_command), _parameters);
 }
 
-void FtpServer::handleFeatCommand()
+bool FtpServer::makePath(char *fullPath, size_t pathSize, const char *param)
 {
-  _client.println("211-Extensions supported:");
-  _client.println(" MLST");
-  _client.println(" SIZE");
-  _client.println(" MDTM");
-  _client.println(" PASV");
-  _client.println(" EPSV");
-  _client.println("211 END");
+  if (!FtpProtocol::makePath(fullPath, pathSize, _cwd, param == nullptr ? _parameters : param))
+  {
+    _client.println("550 Invalid path");
+    return false;
+  }
+  return true;
 }
 
-bool FtpServer::dataConnect()
+bool FtpServer::makeWritablePath(char *fullPath, size_t pathSize, const char *param)
 {
-  if (_data.connected())
+  if (!makePath(fullPath, pathSize, param))
   {
-    return true;
+    return false;
   }
-
-  if (_dataConnType == FTP_DATA_PASSIVE)
+  if (isVirtualPath(fullPath))
   {
-    unsigned long start = millis();
-    while (!dataServer.hasClient() && (millis() - start < 10000))
-    {
-      delay(10);
-    }
+    _client.println("550 Read-only file");
+    return false;
+  }
+  return true;
+}
 
-    if (dataServer.hasClient())
+bool FtpServer::isVirtualPath(const char *path)
+{
+  size_t statsLen = strlen(FTP_STATS_DIR);
+  return strcmp(path, FTP_TRACE_PATH) == 0 ||
+         (strncmp(path, FTP_STATS_DIR, statsLen) == 0 && (path[statsLen] == '\0' || path[statsLen] == '/'));
+}
+
+bool FtpServer::listDirectory(const char *path, bool mlsd, uint16_t &count)
+{
+  if (_statsEnabled && strcmp(path, FTP_STATS_DIR) == 0)
+  {
+    static const char *const files[] = {"metrics", "sessions", "stalls", "trace.json"};
+    for (const char *name : files)
     {
-      _data.stop();
-      _data = dataServer.accept();
-      return _data.connected();
+      sendListLine(name, 0, false, mlsd);
+      count++;
     }
+    return true;
   }
-  else
+
+  File indexFile;
+  FtpListingIndex::Header header;
+  if (_index.open(path, indexFile, header))
   {
-    // Active mode connection
-    _data.stop();
-    if (_data.connect(_dataIp, _dataPort))
-    {
-      return true;
-    }
+    count = sendIndexListing(indexFile, mlsd);
+    indexFile.close();
+    return true;
   }
 
-  return false;
+  // Stale or missing index: rebuild it from this walk
+  bool rebuild = _index.beginRebuild(path, indexFile);
+  bool found = walkDirectory(path, [&](const char *name, uint64_t size, bool isDir)
+                             {
+                               if (mlsd && _log == FTPLog::ENABLE)
+                               {
+                                 LOG_DEBUG("File Name = %s", name);
+                               }
+                               sendListLine(name, size, isDir, mlsd);
+                               if (rebuild)
+                               {
+                                 _index.addLine(indexFile, name, size, isDir);
+                               }
+                               count++;
+                               return true; });
+
+  if (rebuild)
+  {
+    if (found)
+      _index.commitRebuild(path, indexFile);
+    else
+      _index.abortRebuild(path, indexFile);
+  }
+  return found;
 }
 
-void FtpServer::handleDataTransfers()
+bool FtpServer::walkDirectory(const char *path, const std::function<bool(const char *name, uint64_t size, bool isDir)> &visit)
 {
-  if (_transferStatus == FTP_TRANSFER_RETR)
+  File dir = _fs.open(path);
+  if (!dir || !dir.isDirectory())
   {
-    if (!doRetrieve())
+    if (dir)
+      dir.close();
+    return false;
+  }
+
+  // Only files under the compressed directory pay for reading a trailer
+  bool compressed = isCompressedPath(path);
+  bool more = true;
+  File file = dir.openNextFile();
+  while (file && more)
+  {
+    if (strncmp(file.name(), FTP_INTERNAL_PREFIX, strlen(FTP_INTERNAL_PREFIX)) != 0)
     {
-      _transferStatus = FTP_TRANSFER_IDLE;
+      bool isDir = file.isDirectory();
+      more = visit(file.name(), compressed && !isDir ? logicalSize(file) : file.size(), isDir);
     }
+    file.close();
+    file = dir.openNextFile();
   }
-  else if (_transferStatus == FTP_TRANSFER_STOR)
+  if (file)
+    file.close();
+  dir.close();
+
+  if (more && _pack.isActive() && strcmp(path, _pack.dir()) == 0)
   {
-    if (!doStore())
+    _pack.list([&](const char *name, uint32_t size)
+               {
+                 if (more)
+                   more = visit(name, size, false); });
+  }
+
+  if (more && _shardBuckets > 0 && strcmp(path, _shardDir.c_str()) == 0)
+  {
+    // Present the bucket contents as one flat directory
+    char bucket[FTP_CWD_SIZE];
+    for (uint16_t i = 0; i < _shardBuckets && more; i++)
     {
-      _transferStatus = FTP_TRANSFER_IDLE;
+      snprintf(bucket, sizeof(bucket), "%s/" FTP_INTERNAL_PREFIX "%02x", strcmp(path, "/") == 0 ? "" : path, i);
+      dir = _fs.open(bucket);
+      if (!dir || !dir.isDirectory())
+      {
+        if (dir)
+          dir.close();
+        continue;
+      }
+
+      file = dir.openNextFile();
+      while (file && more)
+      {
+        bool isDir = file.isDirectory();
+        if (strncmp(file.name(), FTP_INTERNAL_PREFIX, strlen(FTP_INTERNAL_PREFIX)) != 0)
+        {
+          more = visit(file.name(), compressed && !isDir ? logicalSize(file) : file.size(), isDir);
+        }
+        file.close();
+        file = dir.openNextFile();
+      }
+      if (file)
+        file.close();
+      dir.close();
     }
   }
+  return true;
 }
 
-bool FtpServer::doRetrieve()
+uint16_t FtpServer::sendIndexListing(File &indexFile, bool mlsd)
 {
-  int16_t bytesRead = _file.readBytes(_buffer, FTP_BUF_SIZE);
-  if (bytesRead > 0)
-  {
-    _data.write((uint8_t *)_buffer, bytesRead);
-    _bytesTransferred += bytesRead;
-    return true;
-  }
-  closeTransfer();
-  return false;
+  // MLSD lines are stored ready to send: batch them into the transfer buffer
+  uint16_t count = 0;
+  size_t fill = 0;
+  FtpListingIndex::readLines(indexFile, [&](char *line, size_t len, uint32_t offset)
+                             {
+                               if (line[0] == ' ')
+                               {
+                                 return true; // Removed entry
+                               }
+                               count++;
+
+                               if (!mlsd)
+                               {
+                                 const char *name;
+                                 uint64_t size;
+                                 bool isDir;
+                                 if (FtpListingIndex::parseLine(line, name, size, isDir))
+                                 {
+                                   sendListLine(name, size, isDir, false);
+                                 }
+                                 return true;
+                               }
+
+                               if (fill + len > _bufferSize)
+                               {
+                                 _data.write((uint8_t *)_buffer, fill);
+                                 fill = 0;
+                               }
+                               if (len > _bufferSize)
+                               {
+                                 _data.write((uint8_t *)line, len);
+                               }
+                               else
+                               {
+                                 memcpy(_buffer + fill, line, len);
+                                 fill += len;
+                               }
+                               return true; });
+
+  if (fill > 0)
+  {
+    _data.write((uint8_t *)_buffer, fill);
+  }
+  return count;
 }
 
-bool FtpServer::doStore()
+bool FtpServer::shardPath(char *fullPath, size_t pathSize, bool create)
 {
-  if (!_data.connected())
+  if (_shardBuckets == 0)
   {
-    closeTransfer();
     return false;
   }
 
-  int16_t bytesRead = _data.readBytes((uint8_t *)_buffer, FTP_BUF_SIZE);
-  if (bytesRead > 0)
+  // Only entries directly inside the sharded directory are mapped
+  const char *name = strrchr(fullPath, '/');
+  size_t dirLen = name == fullPath ? 1 : name - fullPath;
+  if (name == nullptr || name[1] == '\0' ||
+      dirLen != _shardDir.length() || strncmp(fullPath, _shardDir.c_str(), dirLen) != 0)
   {
-    _file.write((uint8_t *)_buffer, bytesRead);
-    _bytesTransferred += bytesRead;
-    return true;
+    return false;
   }
+  name++;
 
-  closeTransfer();
-  return false;
-}
-
-void FtpServer::closeTransfer()
-{
-  uint32_t duration = millis() - _millisBeginTransfer;
-  if (duration > 0 && _bytesTransferred > 0)
+  // 32-bit FNV-1a of the name selects the bucket
+  uint32_t hash = 2166136261u;
+  for (const char *p = name; *p; p++)
   {
-    float rate = (_bytesTransferred * 1000.0) / (duration * 1024.0);
-    _client.println("226 Transfer complete (" + String(rate, 2) + " kB/s)");
+    hash = (hash ^ (uint8_t)*p) * 16777619u;
   }
-  else
+
+  char bucket[FTP_CWD_SIZE];
+  snprintf(bucket, sizeof(bucket), "%s/" FTP_INTERNAL_PREFIX "%02x",
+           dirLen == 1 ? "" : _shardDir.c_str(), (unsigned)(hash % _shardBuckets));
+  if (create && !_fs.exists(bucket))
   {
-    _client.println("226 Transfer complete");
+    _fs.mkdir(bucket);
   }
 
-  _file.close();
-  _data.stop();
-  _transferStatus = FTP_TRANSFER_IDLE;
+  char mapped[FTP_CWD_SIZE];
+  if (snprintf(mapped, sizeof(mapped), "%s/%s", bucket, name) >= (int)sizeof(mapped))
+  {
+    return false;
+  }
+  strlcpy(fullPath, mapped, pathSize);
+  return true;
 }
 
-void FtpServer::abortTransfer()
+bool FtpServer::isCompressedPath(const char *path) const
 {
-  if (_transferStatus != FTP_TRANSFER_IDLE)
+  // The directory itself and everything below it
+  size_t len = _compressDir.length();
+  if (len == 0)
   {
-    _file.close();
-    _data.stop();
-    _client.println("426 Transfer aborted");
-    _transferStatus = FTP_TRANSFER_IDLE;
+    return false;
+  }
+  if (len == 1)
+  {
+    return true; // "/"
   }
+  return strncmp(path, _compressDir.c_str(), len) == 0 && (path[len] == '\0' || path[len] == '/');
 }
 
-int8_t FtpServer::readCommand()
+uint64_t FtpServer::logicalSize(File &file)
 {
-  if (!_client.available())
+  uint64_t size;
+  return FtpCompressedReader::readSize(file, size) ? size : file.size();
+}
+
+bool FtpServer::sumDirectory(const char *dir, FtpDiskUsage::Totals &totals, uint8_t depth)
+{
+  if (_du.lookup(dir, totals))
   {
-    return -1;
+    return true;
   }
 
-  char c = _client.read();
-  if (c == '\\')
-    c = '/'; // Normalize path separators
+  // Subdirectories are summed after the walk, so only one directory is open
+  // at a time and the recursion keeps its buffers on the heap
+  totals = {0, 0, 0};
+  std::vector<String> subdirs;
+  if (!walkDirectory(dir, [&](const char *name, uint64_t size, bool isDir)
+                     {
+                       if (isDir)
+                       {
+                         subdirs.push_back(name);
+                       }
+                       else
+                       {
+                         totals.bytes += size;
+                         totals.files++;
+                       }
+                       return true; }))
+  {
+    return false;
+  }
 
-  if (c != '\r' && c != '\n')
+  bool complete = true;
+  for (const String &name : subdirs)
   {
-    if (_cmdBufferIndex < FTP_CMD_SIZE)
+    totals.dirs++;
+    FtpDiskUsage::Totals sub;
+    String child = (strcmp(dir, "/") == 0 ? "/" : String(dir) + "/") + name;
+    if (depth + 1 < FTP_DU_MAX_DEPTH && sumDirectory(child.c_str(), sub, depth + 1))
     {
-      _cmdLine[_cmdBufferIndex++] = c;
+      totals.bytes += sub.bytes;
+      totals.files += sub.files;
+      totals.dirs += sub.dirs;
+    }
+    else
+    {
+      complete = false;
     }
-    return -2; // Command too long
   }
 
-  if (_cmdBufferIndex == 0)
+  // Partial totals are reported but not cached
+  if (complete)
   {
-    return 0; // Empty line
+    _du.store(dir, totals);
   }
+  return true;
+}
 
-  _cmdLine[_cmdBufferIndex] = '\0';
-  parseCommandLine();
-  _cmdBufferIndex = 0;
+void FtpServer::adjustFreeSpace(uint64_t addedBytes, uint64_t removedBytes)
+{
+  // Files take whole blocks; metadata isn't counted until the next resync
+  int64_t added = ((int64_t)addedBytes + FTP_SPACE_BLOCK_SIZE - 1) / FTP_SPACE_BLOCK_SIZE;
+  int64_t removed = ((int64_t)removedBytes + FTP_SPACE_BLOCK_SIZE - 1) / FTP_SPACE_BLOCK_SIZE;
+  _freeBytes += (removed - added) * FTP_SPACE_BLOCK_SIZE;
+}
 
-  return 1;
+void FtpServer::sendListLine(const char *name, uint64_t size, bool isDir, bool mlsd)
+{
+  char line[FTP_INDEX_LINE_SIZE];
+  size_t len = FtpProtocol::formatListLine(line, sizeof(line), name, size, isDir, mlsd);
+  if (len > 0)
+  {
+    _data.write((const uint8_t *)line, len);
+  }
 }
 
-void FtpServer::parseCommandLine()
+bool FtpServer::hashTreeTarget(const char *path, uint64_t &size, uint32_t &stamp)
 {
-  _parameters = "";
+  // A packed file's record moves to a new offset whenever it's rewritten
+  const char *packName = _pack.nameFor(path);
+  uint32_t packSize;
+  File file;
+  if (packName != nullptr && _pack.openRead(packName, file, packSize))
+  {
+    size = packSize;
+    stamp = file.position();
+    file.close();
+    return true;
+  }
 
-  // Find space separating command from parameters
-  char *spacePos = strchr(_cmdLine, ' ');
-  if (spacePos != nullptr)
+  file = _fs.open(path, "r");
+  if (!file || file.isDirectory())
   {
-    *spacePos = '\0'; // Terminate command string
-    _parameters = spacePos + 1;
-    // Skip leading spaces in parameters
-    while (*_parameters == ' ')
-      _parameters++;
+    return false;
   }
+  size = logicalSize(file);
+  stamp = (uint32_t)file.getLastWrite();
+  file.close();
+  return true;
+}
 
-  strlcpy(_command, _cmdLine, sizeof(_command));
-  // Convert command to uppercase
-  for (char *p = _command; *p; p++)
-    *p = toupper(*p);
+uint32_t FtpServer::fileStamp(const char *path)
+{
+  File file = _fs.open(path, "r");
+  return file ? (uint32_t)file.getLastWrite() : 0;
 }
 
-bool FtpServer::makePath(char *fullPath, size_t pathSize, const char *param)
+bool FtpServer::startHashBuild(const char *logical, const char *path, uint32_t stamp)
 {
-  if (param == nullptr)
-    param = _parameters;
+  // Read like a RETR, so an upload of the same file waits for it on FAT
+  const char *packName = _pack.nameFor(path);
+  uint32_t packSize;
+  if (packName != nullptr && _pack.openRead(packName, _hashSource, packSize))
+  {
+    _hashRemaining = packSize;
+  }
+  else
+  {
+    _hashSource = _fs.open(path, "r");
+    if (!_hashSource)
+    {
+      return false;
+    }
+    _hashRemaining = _hashReader.begin(_hashSource) ? _hashReader.size() : _hashSource.size();
+  }
 
-  if (strcmp(param, "/") == 0 || strlen(param) == 0)
+  if (!FtpLockTable::shared().lockRead(&_fs, path))
   {
-    strlcpy(fullPath, "/", pathSize);
-    return true;
+    _hashReader.end();
+    _hashSource.close();
+    return false;
+  }
+  strlcpy(_hashSourcePath, path, sizeof(_hashSourcePath));
+  if (!_lazyTree.begin(logical))
+  {
+    endHashBuild(false);
+    return false;
   }
+  _hashStamp = stamp;
+  return true;
+}
 
-  if (param[0] != '/')
+void FtpServer::stepHashBuild()
+{
+  size_t length = (size_t)min((uint64_t)_bufferSize, _hashRemaining);
+  int bytesRead = 0;
+  if (length > 0)
   {
-    strlcpy(fullPath, _cwd, FTP_CWD_SIZE);
-    if (fullPath[strlen(fullPath) - 1] != '/')
+    bytesRead = _hashReader.isActive() ? _hashReader.read((uint8_t *)_buffer, length)
+                                       : _hashSource.read((uint8_t *)_buffer, length);
+    if (bytesRead <= 0 || !_lazyTree.update((uint8_t *)_buffer, bytesRead))
     {
-      strlcat(fullPath, "/", FTP_CWD_SIZE);
+      endHashBuild(false); // Damaged or shrunk under us
+      return;
     }
-    strlcat(fullPath, param, FTP_CWD_SIZE);
+    _hashRemaining -= bytesRead;
   }
-  else
+  if (_hashRemaining == 0)
   {
-    strlcpy(fullPath, param, FTP_CWD_SIZE);
+    endHashBuild(true);
   }
+}
 
-  // Remove trailing slash if not root
-  size_t len = strlen(fullPath);
-  if (len > 1 && fullPath[len - 1] == '/')
+void FtpServer::endHashBuild(bool complete)
+{
+  if (!_lazyTree.isActive())
   {
-    fullPath[len - 1] = '\0';
+    return;
   }
 
-  // Security check - prevent directory traversal
-  if (strstr(fullPath, "../") != nullptr)
+  if (complete && _lazyTree.finish(_hashStamp))
   {
-    _client.println("550 Invalid path");
-    return false;
+    _counters.hashTrees++;
   }
-
-  return true;
+  else
+  {
+    _lazyTree.abort();
+  }
+  _hashReader.end();
+  _hashSource.close();
+  unlockReader(_hashSourcePath);
 }
 
 void FtpServer::delayResponse(uint32_t ms)
@@ -1119,10 +3471,34 @@ void FtpServer::delayResponse(uint32_t ms)
 
 void FtpServer::processCurrentState()
 {
+  FtpVerb verb;
   switch (_cmdStatus)
   {
   case FTP_CMD_WAIT_USER:
-    if (authenticateUser())
+    verb = FtpProtocol::lookupVerb(_command);
+    if (verb == FTP_VERB_AUTH || verb == FTP_VERB_PBSZ || verb == FTP_VERB_PROT)
+    {
+      processCommand(); // Security setup comes before USER
+    }
+    else if (_tlsRequired && !_client.isSecure())
+    {
+      _client.println("530 TLS required, use AUTH TLS");
+      delayResponse(100);
+    }
+    else if (_tokenTtl > 0 && strcmp(_command, "USER") == 0 && _parameters[0] == FTP_TOKEN_PREFIX)
+    {
+      // A SITE TOKEN token logs in without PASS
+      if (resumeSession())
+      {
+        _cmdStatus = FTP_CMD_WAIT_COMMAND;
+        _millisEndConnection = millis() + _activeTimeout;
+      }
+      else
+      {
+        _cmdStatus = FTP_CMD_IDLE;
+      }
+    }
+    else if (authenticateUser())
     {
       _cmdStatus = FTP_CMD_WAIT_PASS;
     }
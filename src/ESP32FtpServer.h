@@ -10,6 +10,17 @@
 #ifndef FTP_SERVERESP_H
 #define FTP_SERVERESP_H
 
+#include "FtpCompression.h"
+#include "FtpDiskUsage.h"
+#include "FtpHashTree.h"
+#include "FtpListingIndex.h"
+#include "FtpLockTable.h"
+#include "FtpPackStore.h"
+#include "FtpProtocol.h"
+#include "FtpSessionTokens.h"
+#include "FtpSpscQueue.h"
+#include "FtpTls.h"
+#include "FtpTrace.h"
 #include <FS.h>
 #include <LittleFS.h>
 #include <LogLibrary.h>
@@ -25,6 +36,19 @@
 #define FTP_CWD_SIZE 512
 #define FTP_FIL_SIZE 128
 #define FTP_BUF_SIZE 512
+#define FTP_BUF_MAX (1024 * 1024) // Largest setBufferSize(), e.g. in PSRAM
+#define FTP_LISTPAGE_MAX 500 // Entries per SITE LISTPAGE reply
+#define FTP_STATS_DIR "/.stats"
+#define FTP_MEMORY_SAMPLE_MS 100   // Stack and heap sampling period
+#define FTP_HEAP_LOW_WATER 16384   // Free heap below this counts as near the limit
+#define FTP_STACK_LOW_WATER 1024   // Stack headroom below this counts as near the limit
+#define FTP_HANDLE_BYTES 512       // Heap estimated per open file or data socket
+#define FTP_STALL_LOG_SIZE 8       // Loop budget overruns kept for getStalls()
+#define FTP_STALL_PATH_SIZE 64
+#define FTP_FS_STACK_SIZE 4096     // I/O task for setAsyncFilesystem()
+#define FTP_FS_PRIORITY 1
+#define FTP_SPACE_BLOCK_SIZE 4096   // Allocation unit assumed for AVBL bookkeeping
+#define FTP_SPACE_RESYNC_MS 60000   // AVBL asks the filesystem again after this long
 
 // FTP Server States
 enum
@@ -37,6 +61,34 @@ enum
   FTP_CMD_WAIT_COMMAND
 };
 
+// Filesystem metadata operations
+enum
+{
+  FTP_FS_DELE = 0,
+  FTP_FS_MKD,
+  FTP_FS_RMD,
+  FTP_FS_RNFR,
+  FTP_FS_RNTO
+};
+
+// Filesystem operation results
+enum
+{
+  FTP_FS_OK = 0,
+  FTP_FS_FAILED,
+  FTP_FS_NOT_FOUND,
+  FTP_FS_NOT_EMPTY,
+  FTP_FS_EXISTS
+};
+
+// File lock held by the transfer in progress
+enum
+{
+  FTP_LOCK_NONE = 0,
+  FTP_LOCK_READ,
+  FTP_LOCK_WRITE
+};
+
 // Data Connection Types
 enum
 {
@@ -61,32 +113,107 @@ public:
     ENABLE
   };
 
-  FtpServer();
+  struct HeapStats
+  {
+    uint32_t freeBytes;
+    uint32_t minFreeBytes;  // Low-water mark since boot
+    uint32_t largestBlock;  // Biggest single allocation that can succeed
+    uint8_t fragmentation;  // Percent of free heap not in the largest block
+    uint32_t commands;      // Commands processed by this server
+  };
+
+  struct MemoryStats
+  {
+    uint32_t bufferBytes;     // Transfer, command and compression buffers, SITE DU cache, TLS
+    uint32_t packIndexBytes;  // Pack store index held in RAM
+    uint32_t traceBytes;      // Trace ring
+    uint8_t openHandles;      // Files and data sockets open for the session
+    uint32_t sessionBytes;    // Everything above plus the server object itself
+    uint32_t sessionPeakBytes; // Highest sessionBytes in the current session
+    uint32_t peakBytes;       // Highest sessionBytes since begin()
+    int32_t lastSessionHeapDelta; // Free heap lost over the last finished session
+    uint32_t stackHighWater;  // Least stack headroom seen in the task calling handleFTP()
+    uint32_t millisNearLimit; // Time spent under FTP_HEAP_LOW_WATER or FTP_STACK_LOW_WATER
+  };
+
+  struct StallRecord
+  {
+    uint32_t millis;                // When the overrunning handleFTP() call returned
+    uint32_t durationUs;
+    uint8_t cmdStatus;              // FTP_CMD_* at the end of the call
+    uint8_t transferStatus;         // FTP_TRANSFER_* at the end of the call
+    char command[FTP_COMMAND_SIZE]; // Command processed in the call, or the transfer running
+    char path[FTP_STALL_PATH_SIZE]; // Its argument or the transfer path, truncated
+  };
+  typedef std::function<void(const StallRecord &record)> StallCallback;
+  typedef std::function<bool(uint64_t &totalBytes, uint64_t &usedBytes)> SpaceCallback;
+
+  FtpServer(uint16_t ctrlPort = FTP_CTRL_PORT,
+            uint16_t passivePort = FTP_DATA_PORT_PASV,
+            fs::FS &fs = LittleFS);
+  ~FtpServer();
 
   // Server management
   void begin(const String &username, const String &password);
   void begin(const String &username, const String &password, FTPLog log);
   bool handleFTP();
+  size_t end();    // Stops the server and returns the heap bytes released
+  bool resume();   // Restarts after end() or an idle suspend
+  bool isRunning() const { return _started; }
+  bool isBusy() const { return _cmdStatus > FTP_CMD_READY || _transferStatus != FTP_TRANSFER_IDLE; }
+  size_t getReclaimedBytes() const { return _reclaimedBytes; }
+  HeapStats getHeapStats() const;
+  MemoryStats getMemoryStats() const;
+  uint32_t getStallCount() const { return _stallCount; }
+  size_t getStalls(StallRecord *records, size_t max) const; // Most recent first
+  bool getDiskUsage(const char *dir, FtpDiskUsage::Totals &totals); // Walks dir when it isn't cached
+  bool getFreeSpace(uint64_t &bytes);
 
   // Configuration
   void setActiveTimeout(uint32_t timeout);
   void setPassivePort(uint16_t port);
+  void setBufferSize(size_t size); // Applied on the next begin()/resume()
   void setMaxLoginAttempts(uint8_t attempts);
+  void setIdleSuspend(uint32_t seconds); // 0 disables auto-suspend
+  void setPackDirectory(const char *dir); // Packs files stored in dir into segments
+  void setShardedDirectory(const char *dir, uint8_t buckets = 16); // Spreads dir over hidden buckets
+  void setCompressedDirectory(const char *dir); // Compresses files stored under dir, "" disables
+  void setListingIndex(bool enable);           // Keeps a .ftpindex listing file per directory
+  void invalidateListingIndex(const char *dir); // Call after changing dir outside the server
+  void setTraceBuffer(size_t bytes);            // Records recent sessions as FTP_TRACE_PATH, 0 disables
+  void setStats(bool enable);                   // Serves read-only metrics under FTP_STATS_DIR
+  void setAsyncFilesystem(bool enable); // DELE/MKD/RMD/RNFR/RNTO on an I/O task, applied on the next begin()/resume()
+  void setLoopBudget(uint32_t micros, StallCallback callback = nullptr); // Records slower handleFTP() calls, 0 disables
+  void setSpaceCallback(SpaceCallback callback); // Capacity for AVBL when the filesystem isn't LittleFS
+  void setSessionTokens(uint32_t seconds = FTP_TOKEN_TTL_S); // SITE TOKEN lifetime, 0 disables
+  void setTls(const char *certPem, const char *keyPem, bool required = false); // AUTH TLS, applied on the next begin()/resume()
+  void setHashTrees(bool enable); // SITE HASHTREE, trees built on STOR and on demand
 
 private:
   // Server state
-  static WiFiServer ftpServer;
-  static WiFiServer dataServer;
+  WiFiServer ftpServer;
+  WiFiServer dataServer;
+  uint16_t _ctrlPort;
+  fs::FS &_fs;
 
   // Clients
-  WiFiClient _client;
-  WiFiClient _data;
+  FtpTlsClient _client;
+  FtpTlsClient _data;
 
   // Authentication
   String _username;
   String _password;
   uint8_t _maxAttempts;
   uint8_t _currentAttempts;
+  FtpSessionTokens _tokens;
+  uint32_t _tokenTtl; // Milliseconds, 0 when SITE TOKEN is disabled
+
+  // FTPS
+  const char *_tlsCert; // PEM, owned by the caller
+  const char *_tlsKey;
+  bool _tlsRequired;    // Refuse logins and data connections in the clear
+  FtpTlsContext *_tls;  // Allocated by begin() when a certificate is set
+  bool _protPrivate;    // PROT P: data connections use TLS
 
   // Connection parameters
   IPAddress _dataIp;
@@ -98,32 +225,155 @@ private:
   // File transfer
   File _file;
   uint8_t _transferStatus;
-  uint32_t _bytesTransferred;
+  uint64_t _bytesTransferred;
+  uint64_t _bytesRemaining; // Left to send by doRetrieve()
   uint32_t _millisBeginTransfer;
+  uint32_t _millisLastData;
+  size_t _sendOffset; // Part of _buffer already sent by doRetrieve()
+  size_t _sendLength;
+  bool _packTransfer;
+  bool _packSpilled;               // Packed STOR moved out to a plain upload
+  bool _transferReplaces;          // STOR overwrites an existing file
+  uint64_t _restartOffset;         // Set by REST for the next RETR
+  uint64_t _transferOldSize;       // Logical and stored size of the file STOR replaces
+  uint64_t _transferOldStored;
+  uint8_t _lockMode;               // FTP_LOCK_* on the transfer's file in FtpLockTable::shared()
+  char _transferPath[FTP_CWD_SIZE]; // Client-visible path of the transfer in progress
+
+  // Small-file pack store
+  FtpPackStore _pack;
+  String _packDir;
+
+  // Files compressed at rest
+  String _compressDir;
+  FtpCompressedWriter _compressWriter;
+  FtpCompressedReader _compressReader;
+
+  // Directory totals for SITE DU, free space for AVBL
+  FtpDiskUsage _du;
+  SpaceCallback _spaceCallback;
+  int64_t _freeBytes; // Adjusted by writes between filesystem queries
+  bool _spaceValid;
+  uint32_t _millisSpaceSync;
+
+  // Flat directory spread over hashed buckets
+  String _shardDir;
+  uint8_t _shardBuckets;
+
+  // Persistent listing index
+  FtpListingIndex _index;
+
+  // Merkle trees for SITE HASHTREE: one built along each upload, one built
+  // on demand from handleFTP() while no transfer runs
+  bool _hashTrees;
+  FtpHashTree _uploadTree;
+  FtpHashTree _lazyTree;
+  File _hashSource;
+  FtpCompressedReader _hashReader;
+  uint64_t _hashRemaining;
+  uint32_t _hashStamp;
+  char _hashSourcePath[FTP_CWD_SIZE]; // Filesystem path, read-locked while hashed
+
+  // Control channel trace
+  FtpTrace _trace;
+  size_t _traceSize;
+
+  // Counters served under FTP_STATS_DIR
+  struct Counters
+  {
+    uint32_t sessions;
+    uint32_t loginFailures;
+    uint32_t sessionResumes; // Logins with a SITE TOKEN token
+    uint32_t commands[FTP_VERB_COUNT];
+    uint32_t transfers;
+    uint32_t transferErrors;
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    uint64_t compressedLogical; // Uploads to the compressed directory, before and after
+    uint64_t compressedStored;
+    uint32_t hashTrees; // Built by uploads and on demand
+  };
+  Counters _counters;
+  bool _statsEnabled;
+  uint32_t _millisSessionStart;
+
+  // Memory accounting, sampled every FTP_MEMORY_SAMPLE_MS
+  MemoryStats _memory;
+  uint32_t _heapAtSessionStart;
+  uint32_t _millisLastSample;
+
+  // Loop budget watchdog
+  uint32_t _loopBudget; // Microseconds
+  StallCallback _stallCallback;
+  StallRecord _stalls[FTP_STALL_LOG_SIZE];
+  uint32_t _stallCount;
+  bool _commandThisLoop;
+
+  // Filesystem metadata jobs, one at a time since commands are sequential
+  struct FsJob
+  {
+    uint8_t op;       // FTP_FS_*
+    uint8_t result;   // FTP_FS_OK, ...
+    bool isDir;
+    uint64_t size;    // Logical size of the file deleted or renamed
+    uint64_t stored;  // Bytes it took on the filesystem
+    uint32_t session; // Replies for sessions that are gone are dropped
+    char path[FTP_CWD_SIZE];    // Filesystem path
+    char target[FTP_CWD_SIZE];  // Filesystem path of the RNTO destination
+    char logical[FTP_CWD_SIZE]; // Client-visible path
+  };
+  bool _asyncFs;
+  FsJob *_fsJob; // Allocated by begin(), released by end()
+  TaskHandle_t _fsTask;
+  bool _fsPending; // Commands wait until the I/O task replies
+  FtpSpscQueue<FsJob *, 2> _fsRequests;
+  FtpSpscQueue<FsJob *, 2> _fsCompletions;
 
   // Command processing
-  char _command[6]; // FTP commands are 4 chars max
+  char _command[FTP_COMMAND_SIZE];
   char *_parameters;
   char _cwd[FTP_CWD_SIZE];
+  char _transferType; // 'A' or 'I', from TYPE
   char _renameFrom[FTP_CWD_SIZE];
   bool _rnfrCmd;
+  uint32_t _commandCount;
   bool _started;
   FTPLog _log;
 
+  // Idle suspend
+  uint32_t _idleSuspend;
+  uint32_t _millisLastActivity;
+  size_t _reclaimedBytes;
+
   // Buffers and timing
   char _cmdLine[FTP_CMD_SIZE];
-  char _buffer[FTP_BUF_SIZE];
+  char *_buffer; // Allocated by begin(), released by end()
+  size_t _bufferSize;
   uint16_t _cmdBufferIndex;
   uint8_t _cmdStatus;
   uint32_t _millisDelay;
   uint32_t _millisEndConnection;
 
   // Private methods
+  bool startServer();
+  void checkIdleSuspend();
+  void sampleMemory();
+  void endSession();
+  void checkLoopBudget(uint32_t startMicros);
+  void submitFsJob(uint8_t op);
+  void pollFsJob();
+  void runFsJob(FsJob &job);
+  void completeFsJob();
+  bool startFsTask();
+  void stopFsTask();
+  static void fsTask(void *arg);
   void initVariables();
   void clientConnected();
   void disconnectClient();
   bool authenticateUser();
   bool authenticatePassword();
+  bool resumeSession();
+  void rekeyTokens();
   bool processCommand();
   bool dataConnect();
   void handleDataTransfers();
@@ -131,9 +381,30 @@ private:
   bool doStore();
   void closeTransfer();
   void abortTransfer();
+  void removePartialUpload();
+  bool spillPackUpload();
+  void transferFilePath(char *path, size_t size);
+  bool uploadPath(const char *path, char *temp, size_t size);
+  bool commitUpload();
+  void releaseTransferLock();
+  void unlockReader(const char *path);
   int8_t readCommand();
   void parseCommandLine();
   bool makePath(char *fullPath, size_t pathSize, const char *param = nullptr);
+  bool listDirectory(const char *path, bool mlsd, uint16_t &count);
+  bool walkDirectory(const char *path, const std::function<bool(const char *name, uint64_t size, bool isDir)> &visit);
+  uint16_t sendIndexListing(File &indexFile, bool mlsd);
+  bool shardPath(char *fullPath, size_t pathSize, bool create);
+  bool isCompressedPath(const char *path) const;
+  uint64_t logicalSize(File &file);
+  bool sumDirectory(const char *dir, FtpDiskUsage::Totals &totals, uint8_t depth);
+  void adjustFreeSpace(uint64_t addedBytes, uint64_t removedBytes);
+  void sendListLine(const char *name, uint64_t size, bool isDir, bool mlsd);
+  bool hashTreeTarget(const char *path, uint64_t &size, uint32_t &stamp);
+  uint32_t fileStamp(const char *path);
+  bool startHashBuild(const char *logical, const char *path, uint32_t stamp);
+  void stepHashBuild();
+  void endHashBuild(bool complete);
   void delayResponse(uint32_t ms);
   void processCurrentState();
 
@@ -152,7 +423,27 @@ private:
   void handleRnfrCommand();
   void handleRntoCommand();
   void handleSizeCommand();
+  void handleRestCommand();
   void handleTypeCommand();
+  void handleAuthCommand();
+  void handlePbszCommand();
+  void handleProtCommand();
+  void handleSiteCommand();
+  void handleSiteListPage(char *args);
+  void handleSiteHeap();
+  void handleSiteDu(char *args);
+  void handleSiteToken();
+  void handleSiteHashTree(char *args);
+  void handleAvblCommand();
+  void sendTrace();
+  bool isVirtualPath(const char *path);
+  bool makeWritablePath(char *fullPath, size_t pathSize, const char *param = nullptr);
+  bool sendStatsFile(const char *path);
+  void statsPrintf(size_t &fill, const char *format, ...);
+  void writeMetrics(size_t &fill);
+  void writeSessions(size_t &fill);
+  void writeStalls(size_t &fill);
+  void writeTraceJson(size_t &fill);
   void handleNoopCommand();
   void handleAborCommand();
   void handleSystCommand();
@@ -0,0 +1,368 @@
+/*
+ * At-rest file compression for the ESP32-S3 FTP Server
+ *
+ * The writer keeps one block of input, the compressor output and the hash
+ * table; the reader one decoded and one stored block. Both only allocate
+ * while a transfer is running.
+ */
+
+#include "FtpCompression.h"
+
+// Writer
+
+FtpCompressedWriter::FtpCompressedWriter() : _file(nullptr),
+                                             _block(nullptr),
+                                             _packed(nullptr),
+                                             _table(nullptr),
+                                             _blockSize(0),
+                                             _fill(0),
+                                             _position(0),
+                                             _size(0),
+                                             _failed(false)
+{
+}
+
+FtpCompressedWriter::~FtpCompressedWriter()
+{
+  release();
+}
+
+bool FtpCompressedWriter::begin(File &file, uint32_t blockSize)
+{
+  release();
+  if (blockSize == 0 || blockSize > FTP_LZ_MAX_BLOCK)
+  {
+    return false;
+  }
+
+  _block = (uint8_t *)malloc(blockSize);
+  _packed = (uint8_t *)malloc(blockSize);
+  _table = (uint16_t *)malloc(FTP_LZ_HASH_SIZE * sizeof(uint16_t));
+  if (_block == nullptr || _packed == nullptr || _table == nullptr)
+  {
+    release();
+    return false;
+  }
+
+  FtpCompressedReader::Header header = {FTP_COMPRESS_MAGIC, FTP_COMPRESS_VERSION,
+                                        sizeof(FtpCompressedReader::Header), blockSize};
+  if (file.write((const uint8_t *)&header, sizeof(header)) != sizeof(header))
+  {
+    release();
+    return false;
+  }
+
+  _file = &file;
+  _blockSize = blockSize;
+  _fill = 0;
+  _position = sizeof(header);
+  _size = 0;
+  _failed = false;
+  return true;
+}
+
+bool FtpCompressedWriter::write(const uint8_t *data, size_t length)
+{
+  if (_file == nullptr || _failed)
+  {
+    return false;
+  }
+
+  while (length > 0)
+  {
+    // Whole blocks are compressed straight from the caller's buffer
+    if (_fill == 0 && length >= _blockSize)
+    {
+      if (!writeBlock(data, _blockSize))
+        return false;
+      data += _blockSize;
+      length -= _blockSize;
+      continue;
+    }
+
+    uint32_t chunk = min((size_t)(_blockSize - _fill), length);
+    memcpy(_block + _fill, data, chunk);
+    _fill += chunk;
+    data += chunk;
+    length -= chunk;
+    if (_fill == _blockSize)
+    {
+      _fill = 0;
+      if (!writeBlock(_block, _blockSize))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool FtpCompressedWriter::finish()
+{
+  if (_file == nullptr)
+  {
+    return false;
+  }
+
+  bool ok = !_failed && (_fill == 0 || writeBlock(_block, _fill));
+  if (ok)
+  {
+    FtpCompressedReader::Trailer trailer = {_size, _position, (uint32_t)_offsets.size(), 0, FTP_COMPRESS_MAGIC};
+    size_t indexBytes = _offsets.size() * sizeof(uint32_t);
+    ok = _file->write((const uint8_t *)_offsets.data(), indexBytes) == indexBytes &&
+         _file->write((const uint8_t *)&trailer, sizeof(trailer)) == sizeof(trailer);
+  }
+  release();
+  return ok;
+}
+
+void FtpCompressedWriter::abort()
+{
+  release();
+}
+
+size_t FtpCompressedWriter::memoryUsage() const
+{
+  if (_file == nullptr)
+  {
+    return 0;
+  }
+  return 2 * _blockSize + FTP_LZ_HASH_SIZE * sizeof(uint16_t) + _offsets.capacity() * sizeof(uint32_t);
+}
+
+bool FtpCompressedWriter::writeBlock(const uint8_t *data, uint32_t length)
+{
+  // Stored raw unless compression saves at least one byte
+  size_t packed = FtpLz::compress(data, length, _packed, length - 1, _table);
+  uint32_t word = packed > 0 ? packed : (length | FTP_COMPRESS_RAW);
+  const uint8_t *payload = packed > 0 ? _packed : data;
+  uint32_t stored = packed > 0 ? packed : length;
+
+  if (_file->write((const uint8_t *)&word, sizeof(word)) != sizeof(word) ||
+      _file->write(payload, stored) != stored)
+  {
+    _failed = true;
+    return false;
+  }
+
+  _offsets.push_back(_position);
+  _position += sizeof(word) + stored;
+  _size += length;
+  return true;
+}
+
+void FtpCompressedWriter::release()
+{
+  free(_block);
+  free(_packed);
+  free(_table);
+  _block = nullptr;
+  _packed = nullptr;
+  _table = nullptr;
+  _file = nullptr;
+  std::vector<uint32_t>().swap(_offsets);
+}
+
+// Reader
+
+FtpCompressedReader::FtpCompressedReader() : _file(nullptr),
+                                             _block(nullptr),
+                                             _packed(nullptr),
+                                             _blockSize(0),
+                                             _blockCount(0),
+                                             _indexOffset(0),
+                                             _size(0),
+                                             _position(0),
+                                             _cachedBlock(UINT32_MAX),
+                                             _nextBlock(0),
+                                             _nextOffset(0)
+{
+}
+
+FtpCompressedReader::~FtpCompressedReader()
+{
+  end();
+}
+
+bool FtpCompressedReader::begin(File &file)
+{
+  end();
+
+  Header header;
+  Trailer trailer;
+  if (!readLayout(file, header, trailer))
+  {
+    file.seek(0);
+    return false;
+  }
+
+  _block = (uint8_t *)malloc(header.blockSize);
+  _packed = (uint8_t *)malloc(header.blockSize);
+  if (_block == nullptr || _packed == nullptr)
+  {
+    end();
+    file.seek(0);
+    return false;
+  }
+
+  _file = &file;
+  _blockSize = header.blockSize;
+  _blockCount = trailer.blockCount;
+  _indexOffset = trailer.indexOffset;
+  _size = trailer.size;
+  _position = 0;
+  _cachedBlock = UINT32_MAX;
+  _nextBlock = 0;
+  _nextOffset = header.headerSize;
+  file.seek(_nextOffset);
+  return true;
+}
+
+int FtpCompressedReader::read(uint8_t *buffer, size_t length)
+{
+  if (_file == nullptr)
+  {
+    return -1;
+  }
+
+  size_t done = 0;
+  while (done < length && _position < _size)
+  {
+    uint32_t index = _position / _blockSize;
+    uint32_t within = _position % _blockSize;
+    uint32_t blockLength = index + 1 < _blockCount ? _blockSize : (uint32_t)(_size - (uint64_t)index * _blockSize);
+    uint32_t chunk = min((size_t)(blockLength - within), length - done);
+
+    if (index != _cachedBlock && within == 0 && chunk == blockLength)
+    {
+      // Whole block wanted: decode straight into the caller's buffer
+      if (!loadBlock(index, buffer + done, blockLength))
+        return -1;
+    }
+    else
+    {
+      if (index != _cachedBlock)
+      {
+        _cachedBlock = UINT32_MAX;
+        if (!loadBlock(index, _block, blockLength))
+          return -1;
+        _cachedBlock = index;
+      }
+      memcpy(buffer + done, _block + within, chunk);
+    }
+    done += chunk;
+    _position += chunk;
+  }
+  return done;
+}
+
+bool FtpCompressedReader::seek(uint64_t position)
+{
+  if (_file == nullptr || position > _size)
+  {
+    return false;
+  }
+  _position = position;
+  return true;
+}
+
+void FtpCompressedReader::end()
+{
+  free(_block);
+  free(_packed);
+  _block = nullptr;
+  _packed = nullptr;
+  _file = nullptr;
+}
+
+size_t FtpCompressedReader::memoryUsage() const
+{
+  return _file != nullptr ? 2 * _blockSize : 0;
+}
+
+bool FtpCompressedReader::readSize(File &file, uint64_t &size)
+{
+  Header header;
+  Trailer trailer;
+  if (!readLayout(file, header, trailer))
+  {
+    return false;
+  }
+  size = trailer.size;
+  return true;
+}
+
+// Private method implementations
+
+bool FtpCompressedReader::readLayout(File &file, Header &header, Trailer &trailer)
+{
+  size_t fileSize = file.size();
+  if (fileSize < sizeof(Header) + sizeof(Trailer))
+  {
+    return false;
+  }
+
+  if (!file.seek(0) || file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+      header.magic != FTP_COMPRESS_MAGIC || header.version != FTP_COMPRESS_VERSION ||
+      header.headerSize < sizeof(Header) || header.blockSize == 0 || header.blockSize > FTP_LZ_MAX_BLOCK)
+  {
+    return false;
+  }
+
+  // An upload cut short has no trailer
+  if (!file.seek(fileSize - sizeof(Trailer)) ||
+      file.read((uint8_t *)&trailer, sizeof(trailer)) != sizeof(trailer) || trailer.magic != FTP_COMPRESS_MAGIC)
+  {
+    return false;
+  }
+
+  uint64_t blocks = (trailer.size + header.blockSize - 1) / header.blockSize;
+  return trailer.blockCount == blocks && trailer.indexOffset >= header.headerSize &&
+         (uint64_t)trailer.indexOffset + blocks * sizeof(uint32_t) + sizeof(Trailer) == fileSize;
+}
+
+bool FtpCompressedReader::loadBlock(uint32_t index, uint8_t *dest, uint32_t length)
+{
+  // Sequential reads find the next block where the last one ended, jumps
+  // look it up in the index
+  uint32_t offset = _nextOffset;
+  if (index != _nextBlock)
+  {
+    if (!_file->seek(_indexOffset + index * sizeof(uint32_t)) ||
+        _file->read((uint8_t *)&offset, sizeof(offset)) != sizeof(offset))
+    {
+      return false;
+    }
+  }
+  if (index != _nextBlock || _file->position() != offset)
+  {
+    if (offset >= _indexOffset || !_file->seek(offset))
+    {
+      return false;
+    }
+  }
+
+  uint32_t word;
+  if (_file->read((uint8_t *)&word, sizeof(word)) != sizeof(word))
+  {
+    return false;
+  }
+  uint32_t stored = word & ~FTP_COMPRESS_RAW;
+  if ((word & FTP_COMPRESS_RAW) ? stored != length : stored >= length)
+  {
+    return false;
+  }
+
+  if (word & FTP_COMPRESS_RAW)
+  {
+    if (_file->read(dest, stored) != stored)
+      return false;
+  }
+  else if (_file->read(_packed, stored) != stored ||
+           FtpLz::decompress(_packed, stored, dest, length) != length)
+  {
+    return false;
+  }
+
+  _nextBlock = index + 1;
+  _nextOffset = offset + sizeof(word) + stored;
+  return true;
+}
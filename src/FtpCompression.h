@@ -0,0 +1,118 @@
+/*******************************************************************************
+ **                                                                            **
+ **                   AT-REST FILE COMPRESSION FOR FTP SERVER                  **
+ **                                                                            **
+ *******************************************************************************/
+
+// Files stored in a compressed directory are cut into fixed-size blocks that
+// are compressed one by one with FtpLz. Clients never see the format: STOR
+// goes through FtpCompressedWriter, RETR through FtpCompressedReader, and
+// listings report the logical size kept in the trailer.
+//
+// File layout (little endian): a Header, the blocks, an index with the file
+// offset of every block, then a Trailer. Each block starts with a 32-bit word
+// holding its stored length, with FTP_COMPRESS_RAW set when the block didn't
+// shrink and is kept as is. Every block but the last holds blockSize bytes,
+// so a logical offset maps to its block without decoding anything before it:
+// REST costs one index read.
+
+#ifndef FTP_COMPRESSION_H
+#define FTP_COMPRESSION_H
+
+#include "FtpLz.h"
+#include <FS.h>
+#include <vector>
+
+#define FTP_COMPRESS_MAGIC 0x315A5446 // "FTZ1"
+#define FTP_COMPRESS_VERSION 1
+#define FTP_COMPRESS_BLOCK_SIZE 4096 // Logical bytes per block, at most FTP_LZ_MAX_BLOCK
+#define FTP_COMPRESS_RAW 0x80000000
+
+class FtpCompressedWriter
+{
+public:
+  FtpCompressedWriter();
+  ~FtpCompressedWriter();
+
+  bool begin(File &file, uint32_t blockSize = FTP_COMPRESS_BLOCK_SIZE); // file opened for writing, empty
+  bool write(const uint8_t *data, size_t length);
+  bool finish(); // Writes the last block, the index and the trailer
+  void abort();  // Releases the buffers, the file is left incomplete
+  bool isActive() const { return _file != nullptr; }
+
+  uint64_t size() const { return _size; }            // Logical bytes written so far
+  uint32_t storedBytes() const { return _position; } // File bytes written so far
+  size_t memoryUsage() const;
+
+private:
+  File *_file;
+  uint8_t *_block;  // Logical data waiting for a full block
+  uint8_t *_packed; // Compressor output
+  uint16_t *_table; // Compressor hash table
+  uint32_t _blockSize;
+  uint32_t _fill;
+  uint32_t _position;
+  uint64_t _size;
+  bool _failed;
+  std::vector<uint32_t> _offsets;
+
+  bool writeBlock(const uint8_t *data, uint32_t length);
+  void release();
+};
+
+class FtpCompressedReader
+{
+public:
+  FtpCompressedReader();
+  ~FtpCompressedReader();
+
+  // False, with nothing allocated, when file isn't in the compressed format
+  bool begin(File &file);
+  int read(uint8_t *buffer, size_t length); // -1 on a damaged block
+  bool seek(uint64_t position);
+  void end();
+  bool isActive() const { return _file != nullptr; }
+
+  uint64_t size() const { return _size; }
+  size_t memoryUsage() const;
+
+  // Logical size for listings, without allocating
+  static bool readSize(File &file, uint64_t &size);
+
+private:
+  struct Header
+  {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t blockSize;
+  };
+
+  struct Trailer
+  {
+    uint64_t size;
+    uint32_t indexOffset;
+    uint32_t blockCount;
+    uint32_t reserved;
+    uint32_t magic;
+  };
+
+  File *_file;
+  uint8_t *_block;  // Decoded block for reads that don't cover a whole block
+  uint8_t *_packed; // Stored block before decoding
+  uint32_t _blockSize;
+  uint32_t _blockCount;
+  uint32_t _indexOffset;
+  uint64_t _size;
+  uint64_t _position;
+  uint32_t _cachedBlock; // Block held in _block, UINT32_MAX for none
+  uint32_t _nextBlock;   // Block starting at the file's current position
+  uint32_t _nextOffset;
+
+  static bool readLayout(File &file, Header &header, Trailer &trailer);
+  bool loadBlock(uint32_t index, uint8_t *dest, uint32_t length);
+
+  friend class FtpCompressedWriter;
+};
+
+#endif // FTP_COMPRESSION_H
@@ -0,0 +1,148 @@
+/*
+ * Directory size accounting for the ESP32-S3 FTP Server
+ *
+ * Paths are absolute and normalized by FtpProtocol::makePath(): "/" or
+ * "/a/b" with no trailing slash. FNV-1a runs left to right, so the hash of
+ * every ancestor falls out of a single pass over the path.
+ */
+
+#include "FtpDiskUsage.h"
+#include <string.h>
+
+#define FTP_DU_FNV_OFFSET 0xcbf29ce484222325ULL
+#define FTP_DU_FNV_PRIME 0x100000001b3ULL
+
+FtpDiskUsage::FtpDiskUsage() : _useClock(0)
+{
+}
+
+bool FtpDiskUsage::lookup(const char *dir, Totals &totals)
+{
+  int index = findEntry(hashPath(dir, strlen(dir)));
+  if (index < 0)
+  {
+    return false;
+  }
+  _entries[index].lastUse = ++_useClock;
+  totals = _entries[index].totals;
+  return true;
+}
+
+void FtpDiskUsage::store(const char *dir, const Totals &totals)
+{
+  uint64_t hash = hashPath(dir, strlen(dir));
+  int index = findEntry(hash);
+  if (index < 0)
+  {
+    if (_entries.size() < FTP_DU_MAX_DIRS)
+    {
+      _entries.push_back(Entry());
+      index = _entries.size() - 1;
+    }
+    else
+    {
+      index = 0;
+      for (size_t i = 1; i < _entries.size(); i++)
+      {
+        if (_entries[i].lastUse < _entries[index].lastUse)
+          index = i;
+      }
+    }
+  }
+
+  Entry &entry = _entries[index];
+  entry.hash = hash;
+  entry.lastUse = ++_useClock;
+  entry.totals = totals;
+}
+
+void FtpDiskUsage::adjust(const char *path, int64_t bytes, int32_t files, int32_t dirs)
+{
+  forEachAncestor(path, [&](Entry &entry)
+                  {
+                    entry.totals.bytes += bytes;
+                    entry.totals.files += files;
+                    entry.totals.dirs += dirs; });
+}
+
+void FtpDiskUsage::invalidate(const char *path)
+{
+  forEachAncestor(path, [&](Entry &entry)
+                  { entry.hash = 0; });
+  remove(path); // In case path is a directory
+}
+
+void FtpDiskUsage::remove(const char *dir)
+{
+  uint64_t hash = hashPath(dir, strlen(dir));
+  for (size_t i = 0; i < _entries.size();)
+  {
+    if (_entries[i].hash == hash || _entries[i].hash == 0)
+    {
+      _entries[i] = _entries.back();
+      _entries.pop_back();
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+void FtpDiskUsage::clear()
+{
+  std::vector<Entry>().swap(_entries);
+}
+
+// Private method implementations
+
+uint64_t FtpDiskUsage::hashPath(const char *path, size_t len)
+{
+  uint64_t hash = FTP_DU_FNV_OFFSET;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (uint8_t)path[i];
+    hash *= FTP_DU_FNV_PRIME;
+  }
+  return hash;
+}
+
+int FtpDiskUsage::findEntry(uint64_t hash)
+{
+  for (size_t i = 0; i < _entries.size(); i++)
+  {
+    if (_entries[i].hash == hash)
+      return i;
+  }
+  return -1;
+}
+
+template <typename F>
+void FtpDiskUsage::forEachAncestor(const char *path, F &&apply)
+{
+  if (_entries.empty() || path[0] != '/' || path[1] == '\0')
+  {
+    return;
+  }
+
+  // The running hash at each '/' is the hash of the directory before it,
+  // and after the leading '/' it's the hash of "/"
+  uint64_t hash = FTP_DU_FNV_OFFSET;
+  for (size_t i = 0; path[i] != '\0'; i++)
+  {
+    if (path[i] == '/' && i > 0)
+    {
+      int index = findEntry(hash);
+      if (index >= 0)
+        apply(_entries[index]);
+    }
+    hash ^= (uint8_t)path[i];
+    hash *= FTP_DU_FNV_PRIME;
+    if (i == 0)
+    {
+      int index = findEntry(hash);
+      if (index >= 0)
+        apply(_entries[index]);
+    }
+  }
+}
@@ -0,0 +1,68 @@
+/*******************************************************************************
+ **                                                                            **
+ **                  DIRECTORY SIZE ACCOUNTING FOR FTP SERVER                  **
+ **                                                                            **
+ *******************************************************************************/
+
+// Caches recursive byte, file and directory totals for the directories
+// SITE DU was asked about, and everything walked to answer it. The server's
+// own writes keep them exact: a STOR, DELE, MKD, RMD or RNTO adjusts every
+// cached ancestor of the changed path in one pass over the path, so repeated
+// queries cost a lookup instead of a recursive walk. A change whose size
+// isn't known drops the cached ancestors; they're walked again on demand.
+// Paths are kept as 64-bit hashes, the least recently used entry goes when
+// the cache is full.
+
+#ifndef FTP_DISKUSAGE_H
+#define FTP_DISKUSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define FTP_DU_MAX_DIRS 32  // Cached directories
+#define FTP_DU_MAX_DEPTH 16 // Deeper subdirectories aren't counted
+
+class FtpDiskUsage
+{
+public:
+  struct Totals
+  {
+    uint64_t bytes;
+    uint32_t files;
+    uint32_t dirs; // Subdirectories, at any depth
+  };
+
+  FtpDiskUsage();
+
+  bool lookup(const char *dir, Totals &totals);
+  void store(const char *dir, const Totals &totals);
+
+  // Something at path was added or removed: adjusts its cached ancestors
+  void adjust(const char *path, int64_t bytes, int32_t files, int32_t dirs);
+  // Something at path changed by an unknown amount
+  void invalidate(const char *path);
+  void remove(const char *dir); // Drops dir's own entry, e.g. after RMD
+  void clear();
+
+  size_t count() const { return _entries.size(); }
+  size_t memoryUsage() const { return _entries.capacity() * sizeof(Entry); }
+
+private:
+  struct Entry
+  {
+    uint64_t hash;
+    uint32_t lastUse;
+    Totals totals;
+  };
+
+  std::vector<Entry> _entries;
+  uint32_t _useClock;
+
+  static uint64_t hashPath(const char *path, size_t len);
+  int findEntry(uint64_t hash);
+  template <typename F>
+  void forEachAncestor(const char *path, F &&apply);
+};
+
+#endif // FTP_DISKUSAGE_H
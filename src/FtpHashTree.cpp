@@ -0,0 +1,352 @@
+/*
+ * Merkle hash trees of files for the ESP32-S3 FTP Server
+ *
+ * File layout: a Header, then the levels from the leaves up to the root,
+ * FTP_HASH_DIGEST_SIZE bytes per node. Leaves are written as the content
+ * arrives and the upper levels are computed from them by finish(), reading
+ * the tree back a batch at a time; the header gets its magic last, so an
+ * interrupted build is never taken for a tree.
+ */
+
+#include "FtpHashTree.h"
+#include "FtpLockTable.h"
+
+#define FTP_HASH_MAGIC 0x31544846 // "FHT1"
+#define FTP_HASH_BATCH 16         // Nodes read per step while building upper levels
+#define FTP_HASH_STATE_BYTES 112  // SHA-256 state mbedtls_md_setup() allocates
+
+static const uint8_t LEAF_PREFIX = 0x00;
+static const uint8_t NODE_PREFIX = 0x01;
+
+FtpHashTree::FtpHashTree(fs::FS &fs) : _fs(fs),
+                                       _fill(0),
+                                       _leafOpen(false),
+                                       _building(false),
+                                       _key(0)
+{
+  memset(&_header, 0, sizeof(_header));
+  _treePath[0] = '\0';
+  mbedtls_md_init(&_md);
+}
+
+FtpHashTree::~FtpHashTree()
+{
+  abort();
+}
+
+bool FtpHashTree::begin(const char *path)
+{
+  abort();
+
+  _key = keyFor(path);
+  treePath(_treePath, sizeof(_treePath), _key);
+  if (!FtpLockTable::shared().lockWrite(&_fs, _treePath))
+  {
+    return false; // Another instance is building it
+  }
+
+  if (!_fs.exists(FTP_HASH_DIR))
+  {
+    _fs.mkdir(FTP_HASH_DIR);
+  }
+  char temp[FTP_HASH_PATH_SIZE];
+  treePath(temp, sizeof(temp), _key, ".tmp");
+  _file = _fs.open(temp, "w+");
+
+  _header.magic = 0; // Set by finish()
+  _header.chunkSize = FTP_HASH_CHUNK_SIZE;
+  _header.size = 0;
+  _header.stamp = 0;
+  _header.leaves = 0;
+  _fill = 0;
+  _leafOpen = false;
+  _building = true;
+
+  if (!_file || _file.write((const uint8_t *)&_header, sizeof(_header)) != sizeof(_header) ||
+      mbedtls_md_setup(&_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) != 0)
+  {
+    abort();
+    return false;
+  }
+  return true;
+}
+
+bool FtpHashTree::update(const uint8_t *data, size_t length)
+{
+  if (!_building)
+  {
+    return false;
+  }
+
+  while (length > 0)
+  {
+    if (!_leafOpen)
+    {
+      mbedtls_md_starts(&_md);
+      mbedtls_md_update(&_md, &LEAF_PREFIX, 1);
+      _leafOpen = true;
+    }
+    size_t take = min(length, (size_t)(_header.chunkSize - _fill));
+    mbedtls_md_update(&_md, data, take);
+    _fill += take;
+    _header.size += take;
+    data += take;
+    length -= take;
+    if (_fill == _header.chunkSize && !finishLeaf())
+    {
+      abort();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FtpHashTree::finish(uint32_t stamp)
+{
+  if (!_building)
+  {
+    return false;
+  }
+
+  // An empty file still gets its one (empty) leaf
+  if (!_leafOpen && _header.leaves == 0)
+  {
+    mbedtls_md_starts(&_md);
+    mbedtls_md_update(&_md, &LEAF_PREFIX, 1);
+    _leafOpen = true;
+  }
+  if ((_leafOpen && !finishLeaf()) || !writeUpperLevels())
+  {
+    abort();
+    return false;
+  }
+
+  _header.magic = FTP_HASH_MAGIC;
+  _header.stamp = stamp;
+  bool ok = _file.seek(0, SeekSet) && _file.write((const uint8_t *)&_header, sizeof(_header)) == sizeof(_header);
+  _file.close();
+
+  char temp[FTP_HASH_PATH_SIZE];
+  treePath(temp, sizeof(temp), _key, ".tmp");
+  if (_fs.exists(_treePath))
+  {
+    _fs.remove(_treePath);
+  }
+  if (!ok || !_fs.rename(temp, _treePath))
+  {
+    _fs.remove(temp);
+    ok = false;
+  }
+  release();
+  return ok;
+}
+
+void FtpHashTree::abort()
+{
+  if (!_building)
+  {
+    return;
+  }
+
+  char temp[FTP_HASH_PATH_SIZE];
+  treePath(temp, sizeof(temp), _key, ".tmp");
+  _file.close();
+  _fs.remove(temp);
+  release();
+}
+
+bool FtpHashTree::open(const char *path, uint64_t size, uint32_t stamp, File &file, Header &header)
+{
+  char tree[FTP_HASH_PATH_SIZE];
+  treePath(tree, sizeof(tree), keyFor(path));
+  if (!_fs.exists(tree))
+  {
+    return false;
+  }
+  file = _fs.open(tree, "r");
+  if (!file)
+  {
+    return false;
+  }
+
+  // A tree for an older version of the file, or one left half written
+  if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) || header.magic != FTP_HASH_MAGIC ||
+      header.chunkSize == 0 || header.size != size || header.stamp != stamp ||
+      header.leaves != max((uint64_t)1, (size + header.chunkSize - 1) / header.chunkSize) ||
+      file.size() != levelOffset(header, 0) + FTP_HASH_DIGEST_SIZE)
+  {
+    file.close();
+    return false;
+  }
+  return true;
+}
+
+bool FtpHashTree::readNode(File &file, const Header &header, uint8_t level, uint32_t index, uint8_t *digest)
+{
+  return level <= depth(header) && index < levelCount(header, level) &&
+         file.seek(levelOffset(header, level) + index * FTP_HASH_DIGEST_SIZE, SeekSet) &&
+         file.read(digest, FTP_HASH_DIGEST_SIZE) == FTP_HASH_DIGEST_SIZE;
+}
+
+uint8_t FtpHashTree::depth(const Header &header)
+{
+  uint8_t levels = 0;
+  while (((uint64_t)1 << levels) < header.leaves)
+  {
+    levels++;
+  }
+  return levels;
+}
+
+uint32_t FtpHashTree::levelCount(const Header &header, uint8_t level)
+{
+  uint8_t shift = depth(header) - level;
+  return (uint32_t)(((uint64_t)header.leaves + ((uint64_t)1 << shift) - 1) >> shift);
+}
+
+void FtpHashTree::remove(const char *path)
+{
+  char tree[FTP_HASH_PATH_SIZE];
+  treePath(tree, sizeof(tree), keyFor(path));
+  if (_fs.exists(tree))
+  {
+    _fs.remove(tree);
+  }
+}
+
+void FtpHashTree::rename(const char *from, const char *to)
+{
+  // Renaming keeps the content and its last write time, so the tree stays valid
+  char source[FTP_HASH_PATH_SIZE];
+  char target[FTP_HASH_PATH_SIZE];
+  treePath(source, sizeof(source), keyFor(from));
+  treePath(target, sizeof(target), keyFor(to));
+  if (_fs.exists(target))
+  {
+    _fs.remove(target);
+  }
+  if (_fs.exists(source))
+  {
+    _fs.rename(source, target);
+  }
+}
+
+bool FtpHashTree::restamp(const char *path, uint32_t from, uint32_t to)
+{
+  char tree[FTP_HASH_PATH_SIZE];
+  treePath(tree, sizeof(tree), keyFor(path));
+  File file = _fs.exists(tree) ? _fs.open(tree, "r+") : File();
+  if (!file)
+  {
+    return false;
+  }
+
+  Header header;
+  bool ok = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+            header.magic == FTP_HASH_MAGIC && header.stamp == from;
+  if (ok)
+  {
+    header.stamp = to;
+    ok = file.seek(0, SeekSet) && file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+  }
+  file.close();
+  return ok;
+}
+
+size_t FtpHashTree::memoryUsage() const
+{
+  return _building ? FTP_HASH_STATE_BYTES : 0;
+}
+
+// Private method implementations
+
+uint64_t FtpHashTree::keyFor(const char *path)
+{
+  // 64-bit FNV-1a of the client-visible path
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char *p = path; *p; p++)
+  {
+    hash ^= (uint8_t)*p;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void FtpHashTree::treePath(char *out, size_t size, uint64_t key, const char *suffix)
+{
+  snprintf(out, size, FTP_HASH_DIR "/%08x%08x%s", (unsigned)(key >> 32), (unsigned)key, suffix);
+}
+
+uint32_t FtpHashTree::levelOffset(const Header &header, uint8_t level)
+{
+  uint32_t offset = sizeof(Header);
+  for (uint8_t below = depth(header); below > level; below--)
+  {
+    offset += levelCount(header, below) * FTP_HASH_DIGEST_SIZE;
+  }
+  return offset;
+}
+
+bool FtpHashTree::finishLeaf()
+{
+  uint8_t digest[FTP_HASH_DIGEST_SIZE];
+  mbedtls_md_finish(&_md, digest);
+  _leafOpen = false;
+  _fill = 0;
+  _header.leaves++;
+  return _file.write(digest, sizeof(digest)) == sizeof(digest);
+}
+
+bool FtpHashTree::writeUpperLevels()
+{
+  // Each level is appended right after the one below, which it's read from
+  uint8_t batch[FTP_HASH_BATCH * FTP_HASH_DIGEST_SIZE];
+  for (uint8_t level = depth(_header); level > 0; level--)
+  {
+    uint32_t count = levelCount(_header, level);
+    uint32_t source = levelOffset(_header, level);
+    uint32_t target = levelOffset(_header, level - 1);
+    for (uint32_t first = 0; first < count; first += FTP_HASH_BATCH)
+    {
+      uint32_t nodes = min((uint32_t)FTP_HASH_BATCH, count - first);
+      size_t bytes = nodes * FTP_HASH_DIGEST_SIZE;
+      if (!_file.seek(source + first * FTP_HASH_DIGEST_SIZE, SeekSet) || _file.read(batch, bytes) != bytes)
+      {
+        return false;
+      }
+
+      // Parents overwrite the batch in place; an unpaired node moves up as is
+      uint32_t parents = 0;
+      for (uint32_t i = 0; i < nodes; i += 2, parents++)
+      {
+        uint8_t *left = batch + i * FTP_HASH_DIGEST_SIZE;
+        uint8_t *parent = batch + parents * FTP_HASH_DIGEST_SIZE;
+        if (i + 1 == nodes)
+        {
+          memmove(parent, left, FTP_HASH_DIGEST_SIZE);
+          continue;
+        }
+        mbedtls_md_starts(&_md);
+        mbedtls_md_update(&_md, &NODE_PREFIX, 1);
+        mbedtls_md_update(&_md, left, 2 * FTP_HASH_DIGEST_SIZE);
+        mbedtls_md_finish(&_md, parent);
+      }
+
+      bytes = parents * FTP_HASH_DIGEST_SIZE;
+      if (!_file.seek(target + first / 2 * FTP_HASH_DIGEST_SIZE, SeekSet) || _file.write(batch, bytes) != bytes)
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void FtpHashTree::release()
+{
+  FtpLockTable::shared().unlockWrite(&_fs, _treePath);
+  mbedtls_md_free(&_md);
+  mbedtls_md_init(&_md);
+  _building = false;
+  _leafOpen = false;
+}
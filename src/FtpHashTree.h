@@ -0,0 +1,91 @@
+/*******************************************************************************
+ **                                                                            **
+ **                  MERKLE HASH TREES OF FILES FOR FTP SERVER                 **
+ **                                                                            **
+ *******************************************************************************/
+
+// A file's content is cut into FTP_HASH_CHUNK_SIZE chunks. Each chunk's
+// SHA-256 (over 0x00 and the chunk) is a leaf, each parent is the SHA-256 of
+// 0x01 and its two children, and the last node of a level, when it has no
+// pair, moves up unchanged. Level 0 is the root, level depth() the leaves,
+// so node i of level L covers chunks i << (depth - L) onwards: a client
+// holding part of a file compares the root, descends into the nodes that
+// differ and fetches again only the chunks below them, with REST.
+//
+// Trees are cached in FTP_HASH_DIR, one file per path named after a hash of
+// the client-visible path, stamped with the file's logical size and last
+// write time so a tree outliving its file isn't served. STOR builds the tree
+// of the upload as it arrives; other files get theirs built by feeding the
+// content to a builder. Building takes the tree path's write lock in
+// FtpLockTable, so two instances never build the same tree at once.
+
+#ifndef FTP_HASHTREE_H
+#define FTP_HASHTREE_H
+
+#include <FS.h>
+#include <mbedtls/md.h>
+
+#define FTP_HASH_DIR "/.ftphash"
+#define FTP_HASH_CHUNK_SIZE 65536  // File bytes per leaf
+#define FTP_HASH_DIGEST_SIZE 32    // SHA-256
+#define FTP_HASH_REPLY_NODES 32    // Nodes per SITE HASHTREE reply
+#define FTP_HASH_PATH_SIZE 40      // FTP_HASH_DIR, '/', 16 hex digits and ".tmp"
+
+class FtpHashTree
+{
+public:
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t chunkSize;
+    uint64_t size;   // Logical file size
+    uint32_t stamp;  // Last write time of the file, 0 when it isn't tracked
+    uint32_t leaves; // At least 1, an empty file has one empty chunk
+  };
+
+  explicit FtpHashTree(fs::FS &fs);
+  ~FtpHashTree();
+
+  // Building: begin(), the file's logical content in order through update(),
+  // then finish() to write the upper levels and replace the cached tree
+  bool begin(const char *path);
+  bool update(const uint8_t *data, size_t length);
+  bool finish(uint32_t stamp); // Last write time of the file hashed
+  void abort();
+  bool isActive() const { return _building; }
+  bool isBuilding(const char *path) const { return _building && keyFor(path) == _key; }
+  uint64_t size() const { return _header.size; } // Bytes hashed so far
+
+  // Opens the tree of path if it matches the file's size and stamp
+  bool open(const char *path, uint64_t size, uint32_t stamp, File &file, Header &header);
+  static bool readNode(File &file, const Header &header, uint8_t level, uint32_t index, uint8_t *digest);
+  static uint8_t depth(const Header &header);
+  static uint32_t levelCount(const Header &header, uint8_t level);
+
+  // Keep the cache in step with DELE and RNTO
+  void remove(const char *path);
+  void rename(const char *from, const char *to);
+  bool restamp(const char *path, uint32_t from, uint32_t to); // Same content, moved (packed files)
+
+  size_t memoryUsage() const;
+
+private:
+  fs::FS &_fs;
+  File _file;
+  mbedtls_md_context_t _md;
+  Header _header;
+  uint32_t _fill; // Bytes hashed into the open leaf
+  bool _leafOpen;
+  bool _building;
+  uint64_t _key;
+  char _treePath[FTP_HASH_PATH_SIZE];
+
+  static uint64_t keyFor(const char *path);
+  static void treePath(char *out, size_t size, uint64_t key, const char *suffix = "");
+  static uint32_t levelOffset(const Header &header, uint8_t level);
+  bool finishLeaf();
+  bool writeUpperLevels();
+  void release();
+};
+
+#endif // FTP_HASHTREE_H
@@ -0,0 +1,327 @@
+/*
+ * Persistent directory listing index for the ESP32-S3 FTP Server
+ *
+ * File layout: a Header followed by one MLSD line per entry. Removed entries
+ * keep their bytes but start with a space, so removal is a one-byte write.
+ * Once blanked lines outnumber live ones the index is dropped and rebuilt by
+ * the next listing.
+ */
+
+#include "FtpListingIndex.h"
+#include "FtpProtocol.h"
+
+#define FTP_INDEX_MAGIC 0x32444946 // "FID2"
+#define FTP_INDEX_TMP_NAME FTP_INDEX_NAME ".tmp"
+
+FtpListingIndex::FtpListingIndex(fs::FS &fs) : _fs(fs),
+                                               _enabled(false)
+{
+  memset(&_rebuild, 0, sizeof(_rebuild));
+}
+
+bool FtpListingIndex::open(const char *dir, File &file, Header &header)
+{
+  if (!_enabled)
+  {
+    return false;
+  }
+
+  char path[FTP_INDEX_PATH_SIZE];
+  indexPath(path, sizeof(path), dir);
+  file = _fs.open(path, "r");
+  if (!file)
+  {
+    return false;
+  }
+
+  if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+      header.magic != FTP_INDEX_MAGIC || header.length != file.size() ||
+      header.dead > header.live)
+  {
+    file.close();
+    return false;
+  }
+  return true;
+}
+
+bool FtpListingIndex::beginRebuild(const char *dir, File &file)
+{
+  if (!_enabled)
+  {
+    return false;
+  }
+
+  // Carry the epoch forward so stale cursors never match the new index
+  char path[FTP_INDEX_PATH_SIZE];
+  Header old;
+  indexPath(path, sizeof(path), dir);
+  file = _fs.open(path, "r");
+  bool hasOld = file && file.read((uint8_t *)&old, sizeof(old)) == sizeof(old) && old.magic == FTP_INDEX_MAGIC;
+  if (file)
+    file.close();
+
+  _rebuild.magic = FTP_INDEX_MAGIC;
+  _rebuild.epoch = hasOld ? old.epoch + 1 : millis();
+  _rebuild.length = sizeof(Header);
+  _rebuild.live = 0;
+  _rebuild.dead = 0;
+
+  indexPath(path, sizeof(path), dir, FTP_INDEX_TMP_NAME);
+  file = _fs.open(path, "w");
+  if (!file)
+  {
+    return false;
+  }
+  if (file.write((const uint8_t *)&_rebuild, sizeof(_rebuild)) != sizeof(_rebuild))
+  {
+    file.close();
+    _fs.remove(path);
+    return false;
+  }
+  return true;
+}
+
+void FtpListingIndex::addLine(File &file, const char *name, uint64_t size, bool isDir)
+{
+  char line[FTP_INDEX_LINE_SIZE];
+  size_t len = formatLine(line, sizeof(line), name, size, isDir);
+  if (len > 0 && file.write((const uint8_t *)line, len) == len)
+  {
+    _rebuild.length += len;
+    _rebuild.live++;
+  }
+}
+
+void FtpListingIndex::commitRebuild(const char *dir, File &file)
+{
+  char tmpPath[FTP_INDEX_PATH_SIZE];
+  char path[FTP_INDEX_PATH_SIZE];
+  indexPath(tmpPath, sizeof(tmpPath), dir, FTP_INDEX_TMP_NAME);
+  indexPath(path, sizeof(path), dir);
+
+  bool ok = file.seek(0, SeekSet) &&
+            file.write((const uint8_t *)&_rebuild, sizeof(_rebuild)) == sizeof(_rebuild);
+  file.close();
+
+  _fs.remove(path);
+  if (!ok || !_fs.rename(tmpPath, path))
+  {
+    _fs.remove(tmpPath);
+  }
+}
+
+void FtpListingIndex::abortRebuild(const char *dir, File &file)
+{
+  char path[FTP_INDEX_PATH_SIZE];
+  indexPath(path, sizeof(path), dir, FTP_INDEX_TMP_NAME);
+  file.close();
+  _fs.remove(path);
+}
+
+void FtpListingIndex::add(const char *path, uint64_t size, bool isDir)
+{
+  char dir[FTP_INDEX_PATH_SIZE];
+  const char *name = splitPath(path, dir, sizeof(dir));
+  File file;
+  Header header;
+  if (name == nullptr || !openForUpdate(dir, file, header))
+  {
+    return;
+  }
+
+  char line[FTP_INDEX_LINE_SIZE];
+  size_t len = formatLine(line, sizeof(line), name, size, isDir);
+  if (len == 0 || !file.seek(header.length, SeekSet) ||
+      file.write((const uint8_t *)line, len) != len)
+  {
+    // Leave the length mismatched so the next listing rebuilds
+    file.close();
+    return;
+  }
+
+  header.length += len;
+  header.live++;
+  writeHeader(file, header);
+}
+
+void FtpListingIndex::remove(const char *path)
+{
+  char dir[FTP_INDEX_PATH_SIZE];
+  const char *name = splitPath(path, dir, sizeof(dir));
+  File file;
+  Header header;
+  if (name == nullptr || !openForUpdate(dir, file, header))
+  {
+    return;
+  }
+
+  int32_t found = -1;
+  readLines(file, [&](char *line, size_t len, uint32_t offset)
+            {
+              const char *lineName;
+              uint64_t size;
+              bool isDir;
+              if (parseLine(line, lineName, size, isDir) && strcmp(lineName, name) == 0)
+              {
+                found = offset;
+                return false;
+              }
+              return true; });
+
+  if (found < 0 || !file.seek(found, SeekSet) || file.write((const uint8_t *)" ", 1) != 1)
+  {
+    file.close();
+    return;
+  }
+
+  header.live--;
+  header.dead++;
+  if (header.dead > header.live)
+  {
+    // Mostly blank lines: cheaper to rebuild on the next listing
+    file.close();
+    invalidate(dir);
+    return;
+  }
+  writeHeader(file, header);
+}
+
+void FtpListingIndex::invalidate(const char *dir)
+{
+  char path[FTP_INDEX_PATH_SIZE];
+  indexPath(path, sizeof(path), dir);
+  if (_fs.exists(path))
+  {
+    _fs.remove(path);
+  }
+}
+
+void FtpListingIndex::readLines(File &file, const std::function<bool(char *line, size_t len, uint32_t offset)> &callback)
+{
+  char buffer[FTP_INDEX_LINE_SIZE * 2];
+  size_t fill = 0;
+  uint32_t offset = file.position();
+
+  while (true)
+  {
+    size_t got = file.read((uint8_t *)buffer + fill, sizeof(buffer) - fill);
+    fill += got;
+
+    size_t start = 0;
+    char *newline;
+    while ((newline = (char *)memchr(buffer + start, '\n', fill - start)) != nullptr)
+    {
+      size_t len = newline - (buffer + start) + 1;
+      if (!callback(buffer + start, len, offset))
+      {
+        return;
+      }
+      offset += len;
+      start += len;
+    }
+
+    memmove(buffer, buffer + start, fill - start);
+    fill -= start;
+    if (got == 0)
+    {
+      return;
+    }
+    if (fill == sizeof(buffer))
+    {
+      // No line is this long in a valid index, skip the garbage
+      offset += fill;
+      fill = 0;
+    }
+  }
+}
+
+size_t FtpListingIndex::formatLine(char *line, size_t lineSize, const char *name, uint64_t size, bool isDir)
+{
+  return FtpProtocol::formatListLine(line, lineSize, name, size, isDir, true);
+}
+
+bool FtpListingIndex::parseLine(char *line, const char *&name, uint64_t &size, bool &isDir)
+{
+  if (line[0] == ' ')
+  {
+    return false; // Removed entry
+  }
+
+  char *sizeField = strstr(line, ";Size=");
+  char *nameField = strstr(line, "; ");
+  char *end = strchr(line, '\r');
+  if (sizeField == nullptr || nameField == nullptr || end == nullptr)
+  {
+    return false;
+  }
+
+  *end = '\0';
+  isDir = strncmp(line, "Type=dir;", 9) == 0;
+  size = strtoull(sizeField + 6, nullptr, 10);
+  name = nameField + 2;
+  return true;
+}
+
+// Private method implementations
+
+void FtpListingIndex::indexPath(char *path, size_t size, const char *dir, const char *file)
+{
+  snprintf(path, size, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, file);
+}
+
+const char *FtpListingIndex::splitPath(const char *path, char *dir, size_t size)
+{
+  const char *slash = strrchr(path, '/');
+  if (slash == nullptr || slash[1] == '\0')
+  {
+    return nullptr;
+  }
+
+  size_t dirLen = slash == path ? 1 : slash - path;
+  if (dirLen >= size)
+  {
+    return nullptr;
+  }
+  memcpy(dir, path, dirLen);
+  dir[dirLen] = '\0';
+  return slash + 1;
+}
+
+bool FtpListingIndex::openForUpdate(const char *dir, File &file, Header &header)
+{
+  if (!_enabled)
+  {
+    return false;
+  }
+
+  char path[FTP_INDEX_PATH_SIZE];
+  indexPath(path, sizeof(path), dir);
+  if (!_fs.exists(path))
+  {
+    return false;
+  }
+
+  file = _fs.open(path, "r+");
+  if (!file)
+  {
+    return false;
+  }
+
+  if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+      header.magic != FTP_INDEX_MAGIC || header.length != file.size())
+  {
+    file.close();
+    _fs.remove(path);
+    return false;
+  }
+  return true;
+}
+
+void FtpListingIndex::writeHeader(File &file, Header &header)
+{
+  if (file.seek(0, SeekSet))
+  {
+    file.write((const uint8_t *)&header, sizeof(header));
+  }
+  file.close();
+}
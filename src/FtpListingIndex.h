@@ -0,0 +1,75 @@
+/*******************************************************************************
+ **                                                                            **
+ **                 PERSISTENT DIRECTORY LISTING INDEX FOR FTP SERVER          **
+ **                                                                            **
+ *******************************************************************************/
+
+// Each indexed directory keeps a ".ftpindex" file holding its listing as
+// ready-to-send MLSD lines. The server appends a line when it creates an
+// entry and blanks the line out (first byte set to ' ') when it removes one,
+// so LIST/MLSD read one file instead of walking the directory. The header
+// carries the expected file length: an index whose length doesn't match was
+// interrupted mid-update and is rebuilt from the directory on the next
+// listing. Changes made outside the server don't touch the index, so the
+// application drops it with invalidate() instead. Line offsets only move
+// when the index is rebuilt, which starts a new epoch, so (epoch, offset) is a
+// stable position for paginated listings.
+
+#ifndef FTP_LISTINGINDEX_H
+#define FTP_LISTINGINDEX_H
+
+#include <FS.h>
+#include <functional>
+
+#define FTP_INDEX_NAME ".ftpindex"
+#define FTP_INDEX_LINE_SIZE 192
+#define FTP_INDEX_PATH_SIZE 528
+
+class FtpListingIndex
+{
+public:
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t epoch;  // Changes on every rebuild
+    uint32_t length; // Expected file size, header included
+    uint32_t live;
+    uint32_t dead;
+  };
+
+  explicit FtpListingIndex(fs::FS &fs);
+
+  void setEnabled(bool enable) { _enabled = enable; }
+  bool isEnabled() const { return _enabled; }
+
+  // Opens a valid index positioned on its first line
+  bool open(const char *dir, File &file, Header &header);
+
+  // Rebuild: lines are written to a temporary file that replaces the index
+  bool beginRebuild(const char *dir, File &file);
+  void addLine(File &file, const char *name, uint64_t size, bool isDir);
+  void commitRebuild(const char *dir, File &file);
+  void abortRebuild(const char *dir, File &file);
+
+  // Incremental updates, ignored for directories without an index
+  void add(const char *path, uint64_t size, bool isDir);
+  void remove(const char *path);
+  void invalidate(const char *dir);
+
+  // Calls callback for each line (CRLF included) until it returns false
+  static void readLines(File &file, const std::function<bool(char *line, size_t len, uint32_t offset)> &callback);
+  static size_t formatLine(char *line, size_t lineSize, const char *name, uint64_t size, bool isDir);
+  static bool parseLine(char *line, const char *&name, uint64_t &size, bool &isDir);
+
+private:
+  fs::FS &_fs;
+  bool _enabled;
+  Header _rebuild;
+
+  static void indexPath(char *path, size_t size, const char *dir, const char *file = FTP_INDEX_NAME);
+  static const char *splitPath(const char *path, char *dir, size_t size);
+  bool openForUpdate(const char *dir, File &file, Header &header);
+  void writeHeader(File &file, Header &header);
+};
+
+#endif // FTP_LISTINGINDEX_H
@@ -0,0 +1,153 @@
+/*
+ * Shared file lock table for the ESP32-S3 FTP Server
+ *
+ * One mutex guards the whole table: every operation is a scan of
+ * FTP_LOCK_MAX_PATHS slots, far shorter than any filesystem call around it.
+ */
+
+#include "FtpLockTable.h"
+#include <string.h>
+
+FtpLockTable &FtpLockTable::shared()
+{
+  static FtpLockTable table;
+  return table;
+}
+
+FtpLockTable::FtpLockTable() : _conflicts(0)
+{
+  memset(_slots, 0, sizeof(_slots));
+}
+
+bool FtpLockTable::lockRead(const void *volume, const char *path)
+{
+  std::lock_guard<std::mutex> guard(_mutex);
+  Slot *slot = find(keyFor(volume, path), true);
+  if (slot == nullptr)
+  {
+    _conflicts++;
+    return false;
+  }
+  slot->readers++;
+  return true;
+}
+
+bool FtpLockTable::unlockRead(const void *volume, const char *path)
+{
+  std::lock_guard<std::mutex> guard(_mutex);
+  Slot *slot = find(keyFor(volume, path), false);
+  if (slot == nullptr || slot->readers == 0)
+  {
+    return false;
+  }
+
+  slot->readers--;
+  if (slot->readers == 0 && slot->commitPending)
+  {
+    slot->commitPending = false; // The caller commits and unlocks the writer
+    return true;
+  }
+  release(*slot);
+  return false;
+}
+
+bool FtpLockTable::lockWrite(const void *volume, const char *path)
+{
+  std::lock_guard<std::mutex> guard(_mutex);
+  Slot *slot = find(keyFor(volume, path), true);
+  if (slot == nullptr || slot->writer)
+  {
+    _conflicts++;
+    return false;
+  }
+  slot->writer = true;
+  return true;
+}
+
+bool FtpLockTable::isWriting(const void *volume, const char *path)
+{
+  std::lock_guard<std::mutex> guard(_mutex);
+  Slot *slot = find(keyFor(volume, path), false);
+  return slot != nullptr && slot->writer;
+}
+
+bool FtpLockTable::deferCommit(const void *volume, const char *path)
+{
+  std::lock_guard<std::mutex> guard(_mutex);
+  Slot *slot = find(keyFor(volume, path), false);
+  if (slot == nullptr || slot->readers == 0)
+  {
+    return false;
+  }
+  slot->commitPending = true;
+  return true;
+}
+
+void FtpLockTable::unlockWrite(const void *volume, const char *path)
+{
+  std::lock_guard<std::mutex> guard(_mutex);
+  Slot *slot = find(keyFor(volume, path), false);
+  if (slot != nullptr)
+  {
+    slot->writer = false;
+    slot->commitPending = false;
+    release(*slot);
+  }
+}
+
+size_t FtpLockTable::count()
+{
+  std::lock_guard<std::mutex> guard(_mutex);
+  size_t used = 0;
+  for (const Slot &slot : _slots)
+  {
+    used += slot.key != 0 ? 1 : 0;
+  }
+  return used;
+}
+
+// Private method implementations
+
+uint64_t FtpLockTable::keyFor(const void *volume, const char *path)
+{
+  // 64-bit FNV-1a over the volume address and the path
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uintptr_t id = (uintptr_t)volume;
+  for (size_t i = 0; i < sizeof(id); i++)
+  {
+    hash ^= (uint8_t)(id >> (8 * i));
+    hash *= 0x100000001b3ULL;
+  }
+  for (const char *p = path; *p; p++)
+  {
+    hash ^= (uint8_t)*p;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash != 0 ? hash : 1;
+}
+
+FtpLockTable::Slot *FtpLockTable::find(uint64_t key, bool create)
+{
+  Slot *free = nullptr;
+  for (Slot &slot : _slots)
+  {
+    if (slot.key == key)
+      return &slot;
+    if (slot.key == 0 && free == nullptr)
+      free = &slot;
+  }
+  if (!create || free == nullptr)
+  {
+    return nullptr;
+  }
+  free->key = key;
+  return free;
+}
+
+void FtpLockTable::release(Slot &slot)
+{
+  if (slot.readers == 0 && !slot.writer)
+  {
+    slot.key = 0;
+  }
+}
@@ -0,0 +1,65 @@
+/*******************************************************************************
+ **                                                                            **
+ **                     SHARED FILE LOCK TABLE FOR FTP SERVER                  **
+ **                                                                            **
+ *******************************************************************************/
+
+// Path-keyed reader/writer locks shared by every FtpServer instance, so
+// sessions served by different instances (or different pool workers) see
+// each other's transfers. Any number of RETRs can read a path, one STOR can
+// write it. Uploads go to a hidden temporary file that replaces the target
+// when complete, so readers never wait for a writer: they keep streaming the
+// version they opened. Where the filesystem can't replace a file that's
+// still open, the replacement is deferred to the last reader's unlock.
+// A conflicting writer is refused at once, nothing here blocks.
+
+#ifndef FTP_LOCKTABLE_H
+#define FTP_LOCKTABLE_H
+
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FTP_LOCK_MAX_PATHS 32        // Paths locked at the same time, across all instances
+#define FTP_UPLOAD_PREFIX ".ftpup."  // Temporary upload next to its target
+
+class FtpLockTable
+{
+public:
+  static FtpLockTable &shared();
+
+  // volume tells filesystems apart, paths are as passed to the filesystem
+  bool lockRead(const void *volume, const char *path);
+  // True when the caller was the last reader of a path whose upload waits
+  // to replace it: the caller replaces it, then calls unlockWrite()
+  bool unlockRead(const void *volume, const char *path);
+
+  bool lockWrite(const void *volume, const char *path); // False if another writer holds it
+  bool isWriting(const void *volume, const char *path);
+  // Keeps the write lock for the last reader if the path is being read
+  bool deferCommit(const void *volume, const char *path);
+  void unlockWrite(const void *volume, const char *path);
+
+  uint32_t conflicts() const { return _conflicts; }
+  size_t count();
+
+private:
+  struct Slot
+  {
+    uint64_t key; // 0 for a free slot
+    uint16_t readers;
+    bool writer;
+    bool commitPending;
+  };
+
+  std::mutex _mutex;
+  Slot _slots[FTP_LOCK_MAX_PATHS];
+  uint32_t _conflicts;
+
+  FtpLockTable();
+  static uint64_t keyFor(const void *volume, const char *path);
+  Slot *find(uint64_t key, bool create);
+  static void release(Slot &slot);
+};
+
+#endif // FTP_LOCKTABLE_H
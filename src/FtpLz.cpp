@@ -0,0 +1,189 @@
+/*
+ * LZ block codec for the ESP32-S3 FTP Server
+ *
+ * Follows the LZ4 block rules so the decoder stays simple: the last 5 bytes
+ * are always literals and no match starts in the last 12.
+ */
+
+#include "FtpLz.h"
+#include <string.h>
+
+#define FTP_LZ_MIN_MATCH 4
+#define FTP_LZ_LAST_LITERALS 5
+#define FTP_LZ_MATCH_LIMIT 12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint32_t hash32(uint32_t sequence)
+{
+  return (sequence * 2654435761U) >> (32 - FTP_LZ_HASH_BITS);
+}
+
+// Writes the 255-run extension of a length that overflowed its nibble
+static inline bool writeLength(uint8_t *&op, const uint8_t *end, size_t length)
+{
+  while (length >= 255)
+  {
+    if (op >= end)
+      return false;
+    *op++ = 255;
+    length -= 255;
+  }
+  if (op >= end)
+    return false;
+  *op++ = (uint8_t)length;
+  return true;
+}
+
+static bool writeSequence(uint8_t *&op, const uint8_t *end, const uint8_t *literals, size_t literalCount,
+                          uint16_t offset, size_t matchLength)
+{
+  if (op >= end)
+    return false;
+  uint8_t *token = op++;
+  *token = (uint8_t)((literalCount >= 15 ? 15 : literalCount) << 4);
+  if (literalCount >= 15 && !writeLength(op, end, literalCount - 15))
+    return false;
+
+  if ((size_t)(end - op) < literalCount)
+    return false;
+  memcpy(op, literals, literalCount);
+  op += literalCount;
+
+  if (matchLength == 0)
+    return true; // Last sequence: literals only
+
+  if (end - op < 2)
+    return false;
+  *op++ = (uint8_t)offset;
+  *op++ = (uint8_t)(offset >> 8);
+
+  matchLength -= FTP_LZ_MIN_MATCH;
+  *token |= (uint8_t)(matchLength >= 15 ? 15 : matchLength);
+  return matchLength < 15 || writeLength(op, end, matchLength - 15);
+}
+
+size_t FtpLz::compress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize, uint16_t *table)
+{
+  if (srcSize > FTP_LZ_MAX_BLOCK)
+  {
+    return 0;
+  }
+
+  uint8_t *op = dst;
+  const uint8_t *end = dst + dstSize;
+  size_t anchor = 0;
+
+  if (srcSize > FTP_LZ_MATCH_LIMIT)
+  {
+    // Positions are stored plus one, zero marks an empty slot
+    memset(table, 0, FTP_LZ_HASH_SIZE * sizeof(uint16_t));
+    size_t limit = srcSize - FTP_LZ_MATCH_LIMIT;
+    size_t matchEnd = srcSize - FTP_LZ_LAST_LITERALS;
+    size_t ip = 0;
+    while (ip < limit)
+    {
+      uint32_t sequence = read32(src + ip);
+      uint32_t h = hash32(sequence);
+      size_t candidate = table[h];
+      table[h] = (uint16_t)(ip + 1);
+      if (candidate == 0 || read32(src + candidate - 1) != sequence)
+      {
+        ip++;
+        continue;
+      }
+
+      size_t ref = candidate - 1;
+      size_t length = FTP_LZ_MIN_MATCH;
+      while (ip + length < matchEnd && src[ref + length] == src[ip + length])
+        length++;
+
+      if (!writeSequence(op, end, src + anchor, ip - anchor, (uint16_t)(ip - ref), length))
+        return 0;
+      ip += length;
+      anchor = ip;
+    }
+  }
+
+  if (!writeSequence(op, end, src + anchor, srcSize - anchor, 0, 0))
+  {
+    return 0;
+  }
+  return op - dst;
+}
+
+size_t FtpLz::decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize)
+{
+  const uint8_t *ip = src;
+  const uint8_t *inEnd = src + srcSize;
+  uint8_t *op = dst;
+  uint8_t *outEnd = dst + dstSize;
+
+  while (ip < inEnd)
+  {
+    uint8_t token = *ip++;
+
+    size_t literalCount = token >> 4;
+    if (literalCount == 15)
+    {
+      uint8_t extra;
+      do
+      {
+        if (ip >= inEnd)
+          return 0;
+        extra = *ip++;
+        literalCount += extra;
+      } while (extra == 255);
+    }
+    if ((size_t)(inEnd - ip) < literalCount || (size_t)(outEnd - op) < literalCount)
+      return 0;
+    memcpy(op, ip, literalCount);
+    ip += literalCount;
+    op += literalCount;
+
+    if (ip == inEnd)
+      break; // Last sequence
+
+    if (inEnd - ip < 2)
+      return 0;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst))
+      return 0;
+
+    size_t matchLength = token & 15;
+    if (matchLength == 15)
+    {
+      uint8_t extra;
+      do
+      {
+        if (ip >= inEnd)
+          return 0;
+        extra = *ip++;
+        matchLength += extra;
+      } while (extra == 255);
+    }
+    matchLength += FTP_LZ_MIN_MATCH;
+    if ((size_t)(outEnd - op) < matchLength)
+      return 0;
+
+    // Overlapping copies repeat the pattern, so those go byte by byte
+    const uint8_t *match = op - offset;
+    if (offset >= matchLength)
+    {
+      memcpy(op, match, matchLength);
+    }
+    else
+    {
+      for (size_t i = 0; i < matchLength; i++)
+        op[i] = match[i];
+    }
+    op += matchLength;
+  }
+  return op - dst;
+}
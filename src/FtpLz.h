@@ -0,0 +1,37 @@
+/*******************************************************************************
+ **                                                                            **
+ **                       LZ BLOCK CODEC FOR FTP SERVER                        **
+ **                                                                            **
+ *******************************************************************************/
+
+// Small LZ77 block codec in the LZ4 block layout: sequences of a token (4 bit
+// literal count, 4 bit match length), literals, a 16-bit match offset and
+// extra length bytes. Greedy single-probe matching keeps compression cheap
+// enough for upload speed; decoding is a copy loop with bounds checks, safe
+// on corrupted input. Nothing is allocated: the caller owns the hash table.
+// No Arduino dependencies, so the host tools can include this header.
+
+#ifndef FTP_LZ_H
+#define FTP_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FTP_LZ_HASH_BITS 11
+#define FTP_LZ_HASH_SIZE (1 << FTP_LZ_HASH_BITS) // Entries in the caller's table
+#define FTP_LZ_MAX_BLOCK 65535                  // Offsets and the table are 16-bit
+
+// Worst case output for incompressible input
+#define FTP_LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+class FtpLz
+{
+public:
+  // Returns the compressed size, or 0 when the output doesn't fit dstSize
+  static size_t compress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize, uint16_t *table);
+
+  // Returns the decompressed size, or 0 on malformed input or overflow
+  static size_t decompress(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t dstSize);
+};
+
+#endif // FTP_LZ_H
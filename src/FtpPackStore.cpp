@@ -0,0 +1,653 @@
+/*
+ * Small-file pack store for the ESP32-S3 FTP Server
+ *
+ * Segment layout: a sequence of records, each one a RecordHeader followed by
+ * the file name and the file data. Later records supersede earlier ones with
+ * the same name, tombstones delete them. A record whose size is still
+ * FTP_PACK_PENDING was interrupted by a reset; the segment is sealed there.
+ */
+
+#include "FtpPackStore.h"
+
+#define FTP_PACK_MAGIC 0x314B5046 // "FPK1"
+#define FTP_PACK_PENDING 0xFFFFFFFF
+#define FTP_PACK_FLAG_TOMBSTONE 0x01
+#define FTP_PACK_FLAG_DEAD 0x02
+
+FtpPackStore::FtpPackStore(fs::FS &fs) : _fs(fs),
+                                         _writeSegment(0),
+                                         _writeOffset(0),
+                                         _writeHash(0),
+                                         _writeNameLen(0),
+                                         _writing(false)
+{
+  _dir[0] = '\0';
+}
+
+bool FtpPackStore::begin(const char *dir)
+{
+  end();
+
+  File root = _fs.open(dir);
+  if (!root || !root.isDirectory())
+  {
+    if (root)
+      root.close();
+    if (!_fs.mkdir(dir))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    // Collect segment ids, they are scanned oldest first
+    const size_t prefixLen = strlen(FTP_PACK_SEGMENT_PREFIX);
+    File file = root.openNextFile();
+    while (file)
+    {
+      const char *name = file.name();
+      if (strncmp(name, FTP_PACK_SEGMENT_PREFIX, prefixLen) == 0)
+      {
+        Segment segment = {(uint16_t)atoi(name + prefixLen), false, 0, 0};
+        auto it = _segments.begin();
+        while (it != _segments.end() && it->id < segment.id)
+          it++;
+        _segments.insert(it, segment);
+      }
+      file.close();
+      file = root.openNextFile();
+    }
+    root.close();
+  }
+
+  strlcpy(_dir, dir, sizeof(_dir));
+  size_t len = strlen(_dir);
+  if (len > 1 && _dir[len - 1] == '/')
+  {
+    _dir[len - 1] = '\0';
+  }
+
+  for (Segment &segment : _segments)
+  {
+    scanSegment(segment);
+  }
+  return true;
+}
+
+void FtpPackStore::end()
+{
+  _dir[0] = '\0';
+  std::vector<Entry>().swap(_entries);
+  std::vector<Segment>().swap(_segments);
+}
+
+const char *FtpPackStore::nameFor(const char *path) const
+{
+  if (!isActive())
+  {
+    return nullptr;
+  }
+
+  size_t len = strlen(_dir);
+  if (strncmp(path, _dir, len) != 0)
+  {
+    return nullptr;
+  }
+
+  const char *name = path + len;
+  if (len > 1)
+  {
+    if (*name != '/')
+      return nullptr;
+    name++;
+  }
+  else if (*(name - 1) != '/')
+  {
+    return nullptr;
+  }
+
+  if (*name == '\0' || strchr(name, '/') != nullptr || strlen(name) >= FTP_PACK_NAME_SIZE)
+  {
+    return nullptr;
+  }
+  return name;
+}
+
+bool FtpPackStore::exists(const char *name)
+{
+  return findEntry(name) >= 0;
+}
+
+bool FtpPackStore::stat(const char *name, uint32_t &size)
+{
+  int index = findEntry(name);
+  if (index < 0)
+  {
+    return false;
+  }
+  size = _entries[index].size;
+  return true;
+}
+
+bool FtpPackStore::openRead(const char *name, File &file, uint32_t &size)
+{
+  int index = findEntry(name, &file);
+  if (index < 0)
+  {
+    return false;
+  }
+
+  const Entry &entry = _entries[index];
+  if (!file.seek(entry.offset + sizeof(RecordHeader) + entry.nameLen, SeekSet))
+  {
+    file.close();
+    return false;
+  }
+  size = entry.size;
+  return true;
+}
+
+bool FtpPackStore::beginWrite(const char *name, File &file)
+{
+  size_t nameLen = strlen(name);
+  // The size isn't known yet, room is kept for the largest record allowed
+  if (nameLen == 0 || nameLen >= FTP_PACK_NAME_SIZE || !openAppend(file, nameLen, FTP_PACK_MAX_FILE_SIZE))
+  {
+    return false;
+  }
+
+  RecordHeader header = {FTP_PACK_MAGIC, FTP_PACK_PENDING, (uint8_t)nameLen, 0, 0};
+  _writeOffset = file.position();
+  _writeSegment = _segments.back().id;
+  _writeHash = hashName(name, nameLen);
+  _writeNameLen = nameLen;
+  _writing = true;
+
+  if (file.write((const uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+      file.write((const uint8_t *)name, nameLen) != nameLen)
+  {
+    abortWrite(file);
+    return false;
+  }
+  return true;
+}
+
+bool FtpPackStore::commitWrite(File &file, uint32_t expected)
+{
+  uint32_t dataStart = _writeOffset + sizeof(RecordHeader) + _writeNameLen;
+  uint32_t size = file.position() - dataStart;
+  if (size != expected)
+  {
+    // A short write would replace the previous version with a truncated one
+    abortWrite(file);
+    return false;
+  }
+  _writing = false;
+
+  bool ok = file.seek(_writeOffset + offsetof(RecordHeader, size), SeekSet) &&
+            file.write((const uint8_t *)&size, sizeof(size)) == sizeof(size);
+  file.close();
+
+  Segment *segment = findSegment(_writeSegment);
+  if (segment == nullptr)
+  {
+    return false;
+  }
+  segment->size = dataStart + size;
+
+  if (!ok)
+  {
+    // The header could not be completed, nothing after it is trustworthy
+    segment->sealed = true;
+    segment->dead += segment->size - _writeOffset;
+    return false;
+  }
+
+  for (size_t i = 0; i < _entries.size(); i++)
+  {
+    if (_entries[i].hash == _writeHash)
+    {
+      markDead(i);
+      break;
+    }
+  }
+
+  Entry entry = {_writeHash, _writeOffset, size, _writeSegment, _writeNameLen};
+  _entries.push_back(entry);
+  return true;
+}
+
+void FtpPackStore::abortWrite(File &file)
+{
+  _writing = false;
+  uint32_t size = file.position();
+  uint32_t dataStart = _writeOffset + sizeof(RecordHeader) + _writeNameLen;
+  RecordHeader header = {FTP_PACK_MAGIC,
+                         size > dataStart ? size - dataStart : 0,
+                         _writeNameLen, FTP_PACK_FLAG_DEAD, 0};
+
+  bool ok = size >= dataStart &&
+            file.seek(_writeOffset, SeekSet) &&
+            file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+  file.close();
+
+  Segment *segment = findSegment(_writeSegment);
+  if (segment != nullptr)
+  {
+    segment->size = size;
+    segment->dead += size - _writeOffset;
+    segment->sealed |= !ok;
+  }
+}
+
+bool FtpPackStore::spillWrite(File &file, File &target)
+{
+  uint32_t end = file.position();
+  uint32_t dataStart = _writeOffset + sizeof(RecordHeader) + _writeNameLen;
+  bool ok = end >= dataStart && file.seek(dataStart, SeekSet);
+
+  uint8_t chunk[256];
+  uint32_t remaining = ok ? end - dataStart : 0;
+  while (ok && remaining > 0)
+  {
+    size_t want = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+    ok = file.read(chunk, want) == want && target.write(chunk, want) == want;
+    remaining -= want;
+  }
+
+  // abortWrite() takes the end of the record from the position
+  ok = file.seek(end, SeekSet) && ok;
+  abortWrite(file);
+  return ok;
+}
+
+bool FtpPackStore::remove(const char *name)
+{
+  // The open record's segment size is only settled by commitWrite()
+  int index = _writing ? -1 : findEntry(name);
+  if (index < 0)
+  {
+    return false;
+  }
+
+  uint32_t offset;
+  if (!appendRecord(name, FTP_PACK_FLAG_TOMBSTONE, nullptr, 0, &offset))
+  {
+    return false;
+  }
+
+  // The tombstone itself only matters until its segment is compacted
+  _segments.back().dead += sizeof(RecordHeader) + strlen(name);
+  markDead(index);
+  return true;
+}
+
+bool FtpPackStore::rename(const char *from, const char *to)
+{
+  File source;
+  uint32_t size;
+  size_t toLen = strlen(to);
+  if (_writing || toLen == 0 || toLen >= FTP_PACK_NAME_SIZE || !openRead(from, source, size))
+  {
+    return false;
+  }
+
+  uint32_t offset;
+  bool ok = appendRecord(to, 0, &source, size, &offset);
+  source.close();
+  if (!ok)
+  {
+    return false;
+  }
+
+  Entry entry = {hashName(to, toLen), offset, size, _segments.back().id, (uint8_t)toLen};
+  _entries.push_back(entry);
+  if (!remove(from))
+  {
+    // Keep the rename all or nothing: tombstone the copy
+    remove(to);
+    return false;
+  }
+  return true;
+}
+
+void FtpPackStore::list(const std::function<void(const char *name, uint32_t size)> &callback)
+{
+  // Entries are kept in on-disk order, so each segment is read front to back
+  File segmentFile;
+  int32_t openSegment = -1;
+  char name[FTP_PACK_NAME_SIZE];
+
+  for (const Entry &entry : _entries)
+  {
+    if (entry.segment != openSegment)
+    {
+      char path[FTP_PACK_NAME_SIZE + 16];
+      segmentPath(path, sizeof(path), entry.segment);
+      if (segmentFile)
+        segmentFile.close();
+      segmentFile = _fs.open(path, "r");
+      openSegment = entry.segment;
+    }
+
+    if (!segmentFile ||
+        !segmentFile.seek(entry.offset + sizeof(RecordHeader), SeekSet) ||
+        segmentFile.read((uint8_t *)name, entry.nameLen) != entry.nameLen)
+    {
+      continue;
+    }
+    name[entry.nameLen] = '\0';
+    callback(name, entry.size);
+  }
+
+  if (segmentFile)
+    segmentFile.close();
+}
+
+void FtpPackStore::maintain()
+{
+  if (_writing || _segments.size() < 2)
+  {
+    return;
+  }
+
+  // Only the oldest segment may be compacted: tombstones in it can only
+  // refer to records in the same segment, so dropping them is safe
+  Segment &oldest = _segments.front();
+  uint32_t totalSize = 0;
+  uint32_t totalDead = 0;
+  for (const Segment &segment : _segments)
+  {
+    totalSize += segment.size;
+    totalDead += segment.dead;
+  }
+
+  // Compacting a mostly dead oldest segment reclaims space directly. When
+  // the dead space sits in newer segments instead, the oldest one is rotated
+  // forward even if it's all live. Tombstones tie compaction to the oldest
+  // segment, so those copies are the price of reaching the dead space
+  bool oldestDead = oldest.dead * 2 >= oldest.size;
+  if (!oldestDead && totalDead * 2 < totalSize)
+  {
+    return;
+  }
+
+  // Move one live record per call to keep each handleFTP() short: records
+  // are capped at FTP_PACK_MAX_FILE_SIZE
+  for (size_t i = 0; i < _entries.size(); i++)
+  {
+    if (_entries[i].segment != oldest.id)
+    {
+      continue;
+    }
+
+    char name[FTP_PACK_NAME_SIZE];
+    File source;
+    Entry entry = _entries[i];
+    char path[FTP_PACK_NAME_SIZE + 16];
+    segmentPath(path, sizeof(path), entry.segment);
+    source = _fs.open(path, "r");
+    if (!source ||
+        !source.seek(entry.offset + sizeof(RecordHeader), SeekSet) ||
+        source.read((uint8_t *)name, entry.nameLen) != entry.nameLen)
+    {
+      if (source)
+        source.close();
+      return;
+    }
+    name[entry.nameLen] = '\0';
+
+    uint32_t offset;
+    bool ok = appendRecord(name, 0, &source, entry.size, &offset);
+    source.close();
+    if (!ok)
+    {
+      return;
+    }
+
+    // Keep _entries in on-disk order: the copy now lives at the end
+    _entries.erase(_entries.begin() + i);
+    entry.segment = _segments.back().id;
+    entry.offset = offset;
+    _entries.push_back(entry);
+    return;
+  }
+
+  char path[FTP_PACK_NAME_SIZE + 16];
+  segmentPath(path, sizeof(path), oldest.id);
+  if (_fs.remove(path))
+  {
+    _segments.erase(_segments.begin());
+  }
+}
+
+size_t FtpPackStore::memoryUsage() const
+{
+  return _entries.capacity() * sizeof(Entry) + _segments.capacity() * sizeof(Segment);
+}
+
+// Private method implementations
+
+uint64_t FtpPackStore::hashName(const char *name, size_t len)
+{
+  // 64-bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (uint8_t)name[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void FtpPackStore::segmentPath(char *path, size_t size, uint16_t id) const
+{
+  snprintf(path, size, "%s/" FTP_PACK_SEGMENT_PREFIX "%u", strcmp(_dir, "/") == 0 ? "" : _dir, id);
+}
+
+bool FtpPackStore::scanSegment(Segment &segment)
+{
+  char path[FTP_PACK_NAME_SIZE + 16];
+  segmentPath(path, sizeof(path), segment.id);
+  File file = _fs.open(path, "r");
+  if (!file)
+  {
+    segment.sealed = true;
+    return false;
+  }
+
+  uint32_t fileSize = file.size();
+  uint32_t offset = 0;
+  char name[FTP_PACK_NAME_SIZE];
+  RecordHeader header;
+
+  while (offset + sizeof(header) <= fileSize)
+  {
+    if (!file.seek(offset, SeekSet) ||
+        file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+        header.magic != FTP_PACK_MAGIC || header.size == FTP_PACK_PENDING ||
+        header.nameLen >= FTP_PACK_NAME_SIZE ||
+        file.read((uint8_t *)name, header.nameLen) != header.nameLen)
+    {
+      segment.sealed = true;
+      break;
+    }
+
+    uint32_t recordSize = sizeof(header) + header.nameLen + header.size;
+    if (offset + recordSize > fileSize)
+    {
+      segment.sealed = true;
+      break;
+    }
+
+    if (header.flags & FTP_PACK_FLAG_DEAD)
+    {
+      segment.dead += recordSize;
+    }
+    else
+    {
+      uint64_t hash = hashName(name, header.nameLen);
+      for (size_t i = 0; i < _entries.size(); i++)
+      {
+        if (_entries[i].hash == hash)
+        {
+          markDead(i);
+          break;
+        }
+      }
+
+      if (header.flags & FTP_PACK_FLAG_TOMBSTONE)
+      {
+        segment.dead += recordSize;
+      }
+      else
+      {
+        Entry entry = {hash, offset, header.size, segment.id, header.nameLen};
+        _entries.push_back(entry);
+      }
+    }
+    offset += recordSize;
+  }
+
+  segment.size = fileSize;
+  if (offset < fileSize)
+  {
+    segment.dead += fileSize - offset;
+  }
+  file.close();
+  return !segment.sealed;
+}
+
+int FtpPackStore::findEntry(const char *name, File *segmentFile)
+{
+  size_t nameLen = strlen(name);
+  uint64_t hash = hashName(name, nameLen);
+
+  for (size_t i = 0; i < _entries.size(); i++)
+  {
+    const Entry &entry = _entries[i];
+    if (entry.hash != hash || entry.nameLen != nameLen)
+    {
+      continue;
+    }
+
+    if (segmentFile == nullptr)
+    {
+      return i;
+    }
+
+    // Callers that read the record anyway also confirm the stored name
+    char path[FTP_PACK_NAME_SIZE + 16];
+    char stored[FTP_PACK_NAME_SIZE];
+    segmentPath(path, sizeof(path), entry.segment);
+    *segmentFile = _fs.open(path, "r");
+    if (*segmentFile &&
+        segmentFile->seek(entry.offset + sizeof(RecordHeader), SeekSet) &&
+        segmentFile->read((uint8_t *)stored, nameLen) == nameLen &&
+        memcmp(stored, name, nameLen) == 0)
+    {
+      return i;
+    }
+    if (*segmentFile)
+      segmentFile->close();
+  }
+  return -1;
+}
+
+FtpPackStore::Segment *FtpPackStore::findSegment(uint16_t id)
+{
+  for (Segment &segment : _segments)
+  {
+    if (segment.id == id)
+    {
+      return &segment;
+    }
+  }
+  return nullptr;
+}
+
+bool FtpPackStore::openAppend(File &file, uint8_t nameLen, uint32_t dataSize)
+{
+  char path[FTP_PACK_NAME_SIZE + 16];
+  uint32_t recordSize = sizeof(RecordHeader) + nameLen + dataSize;
+
+  if (!_segments.empty() && !_segments.back().sealed &&
+      _segments.back().size + recordSize <= FTP_PACK_SEGMENT_SIZE)
+  {
+    segmentPath(path, sizeof(path), _segments.back().id);
+    file = _fs.open(path, "r+");
+    if (file && file.seek(_segments.back().size, SeekSet))
+    {
+      return true;
+    }
+    if (file)
+      file.close();
+    _segments.back().sealed = true;
+  }
+
+  Segment segment = {(uint16_t)(_segments.empty() ? 0 : _segments.back().id + 1), false, 0, 0};
+  segmentPath(path, sizeof(path), segment.id);
+  file = _fs.open(path, "w");
+  if (!file)
+  {
+    return false;
+  }
+  _segments.push_back(segment);
+  return true;
+}
+
+bool FtpPackStore::appendRecord(const char *name, uint8_t flags, File *source, uint32_t sourceSize, uint32_t *offset)
+{
+  size_t nameLen = strlen(name);
+  File file;
+  if (!openAppend(file, nameLen, sourceSize))
+  {
+    return false;
+  }
+
+  Segment &segment = _segments.back();
+  RecordHeader header = {FTP_PACK_MAGIC, sourceSize, (uint8_t)nameLen, flags, 0};
+  *offset = segment.size;
+
+  bool ok = file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+            file.write((const uint8_t *)name, nameLen) == nameLen;
+
+  uint8_t chunk[256];
+  uint32_t remaining = sourceSize;
+  while (ok && remaining > 0)
+  {
+    size_t want = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+    size_t got = source->read(chunk, want);
+    ok = got == want && file.write(chunk, got) == got;
+    remaining -= got;
+  }
+
+  uint32_t written = file.position() - *offset;
+  if (!ok)
+  {
+    // Mark the partial record dead so a rescan skips it
+    header.size = written >= sizeof(header) + nameLen ? written - sizeof(header) - nameLen : 0;
+    header.flags = FTP_PACK_FLAG_DEAD;
+    if (written < sizeof(header) + nameLen ||
+        !file.seek(*offset, SeekSet) ||
+        file.write((const uint8_t *)&header, sizeof(header)) != sizeof(header))
+    {
+      segment.sealed = true;
+    }
+    segment.dead += written;
+  }
+  segment.size += written;
+  file.close();
+  return ok;
+}
+
+void FtpPackStore::markDead(size_t index)
+{
+  const Entry &entry = _entries[index];
+  Segment *segment = findSegment(entry.segment);
+  if (segment != nullptr)
+  {
+    segment->dead += sizeof(RecordHeader) + entry.nameLen + entry.size;
+  }
+  _entries.erase(_entries.begin() + index);
+}
@@ -0,0 +1,115 @@
+/*******************************************************************************
+ **                                                                            **
+ **                     SMALL-FILE PACK STORE FOR FTP SERVER                   **
+ **                                                                            **
+ *******************************************************************************/
+
+// Files stored in the pack directory are appended as records to a few large
+// segment files (".ftppack.<n>") instead of getting their own filesystem
+// entry. An in-RAM index maps each name to its record, so LIST/RETR of many
+// small files turns into sequential reads of the segments. Superseded and
+// deleted records are reclaimed by compacting the oldest segment. Records
+// hold at most FTP_PACK_MAX_FILE_SIZE bytes, so copying one stays short.
+
+#ifndef FTP_PACKSTORE_H
+#define FTP_PACKSTORE_H
+
+#include "FtpProtocol.h"
+#include <FS.h>
+#include <functional>
+#include <vector>
+
+#define FTP_PACK_SEGMENT_PREFIX ".ftppack."
+#define FTP_PACK_SEGMENT_SIZE (64 * 1024)
+#define FTP_PACK_NAME_SIZE 128
+#define FTP_PACK_MAX_FILE_SIZE (16 * 1024) // Larger uploads move out to a plain file
+
+class FtpPackStore
+{
+public:
+  explicit FtpPackStore(fs::FS &fs);
+
+  bool begin(const char *dir); // Loads the index by scanning the segments
+  void end();                  // Drops the index
+  bool isActive() const { return _dir[0] != '\0'; }
+  const char *dir() const { return _dir; }
+
+  // Returns the file name if path lives directly inside the pack directory
+  const char *nameFor(const char *path) const;
+
+  bool exists(const char *name);
+  bool stat(const char *name, uint32_t &size);
+  bool openRead(const char *name, File &file, uint32_t &size);
+
+  bool beginWrite(const char *name, File &file);
+  bool commitWrite(File &file, uint32_t expected); // Fails unless expected bytes were written
+  void abortWrite(File &file);
+  bool isWriting() const { return _writing; }
+
+  // Copies the open record's data to target and drops the record, for an
+  // upload that outgrew FTP_PACK_MAX_FILE_SIZE
+  bool spillWrite(File &file, File &target);
+
+  // Both append to the last segment, so they fail while a record is open
+  bool remove(const char *name);
+  bool rename(const char *from, const char *to);
+  void list(const std::function<void(const char *name, uint32_t size)> &callback);
+
+  // Compacts one record of the oldest segment when half of it, or half of
+  // the whole store, is dead; in the second case an all-live oldest segment
+  // is rotated to the end so the dead space behind it can be reached
+  void maintain();
+
+  size_t count() const { return _entries.size(); }
+  size_t memoryUsage() const;
+
+private:
+  struct Entry
+  {
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t size;
+    uint16_t segment;
+    uint8_t nameLen;
+  };
+
+  struct Segment
+  {
+    uint16_t id;
+    bool sealed; // Interrupted write found at the tail, no more appends
+    uint32_t size;
+    uint32_t dead;
+  };
+
+  struct RecordHeader
+  {
+    uint32_t magic;
+    uint32_t size;
+    uint8_t nameLen;
+    uint8_t flags;
+    uint16_t reserved;
+  };
+
+  fs::FS &_fs;
+  char _dir[FTP_PACK_NAME_SIZE];
+  std::vector<Entry> _entries;
+  std::vector<Segment> _segments;
+
+  // Record being written by beginWrite()
+  uint16_t _writeSegment;
+  uint32_t _writeOffset;
+  uint64_t _writeHash;
+  uint8_t _writeNameLen;
+  bool _writing;
+
+  static uint64_t hashName(const char *name, size_t len);
+  void segmentPath(char *path, size_t size, uint16_t id) const;
+  bool scanSegment(Segment &segment);
+  int findEntry(const char *name, File *segmentFile = nullptr);
+  Segment *findSegment(uint16_t id);
+  bool openAppend(File &file, uint8_t nameLen, uint32_t dataSize);
+  bool appendRecord(const char *name, uint8_t flags, File *source, uint32_t sourceSize, uint32_t *offset);
+  void markDead(size_t index);
+};
+
+#endif // FTP_PACKSTORE_H
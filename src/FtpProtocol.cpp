@@ -0,0 +1,184 @@
+/*
+ * Protocol helpers for the ESP32-S3 FTP Server
+ *
+ * Plain C library only, see FtpProtocol.h.
+ */
+
+#include "FtpProtocol.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+// Packs up to four uppercase letters into a switchable key
+#define FTP_VERB_KEY(a, b, c, d) \
+  ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+
+void FtpProtocol::parseCommandLine(char *line, char *command, size_t commandSize, char *&parameters)
+{
+  // Find space separating command from parameters
+  char *spacePos = strchr(line, ' ');
+  if (spacePos != nullptr)
+  {
+    *spacePos = '\0'; // Terminate command string
+    parameters = spacePos + 1;
+    // Skip leading spaces in parameters
+    while (*parameters == ' ')
+      parameters++;
+  }
+  else
+  {
+    parameters = line + strlen(line);
+  }
+
+  size_t i = 0;
+  for (; line[i] != '\0' && i + 1 < commandSize; i++)
+    command[i] = toupper((unsigned char)line[i]);
+  command[i] = '\0';
+}
+
+FtpVerb FtpProtocol::lookupVerb(const char *command)
+{
+  uint32_t key = 0;
+  for (size_t i = 0; i < 4; i++)
+  {
+    key <<= 8;
+    if (command[0] != '\0')
+      key |= (uint8_t)*command++;
+  }
+  if (*command != '\0')
+  {
+    return FTP_VERB_UNKNOWN;
+  }
+
+  switch (key)
+  {
+  case FTP_VERB_KEY('U', 'S', 'E', 'R'):
+    return FTP_VERB_USER;
+  case FTP_VERB_KEY('P', 'A', 'S', 'S'):
+    return FTP_VERB_PASS;
+  case FTP_VERB_KEY('C', 'D', 'U', 'P'):
+    return FTP_VERB_CDUP;
+  case FTP_VERB_KEY('C', 'W', 'D', 0):
+    return FTP_VERB_CWD;
+  case FTP_VERB_KEY('P', 'W', 'D', 0):
+    return FTP_VERB_PWD;
+  case FTP_VERB_KEY('Q', 'U', 'I', 'T'):
+    return FTP_VERB_QUIT;
+  case FTP_VERB_KEY('P', 'A', 'S', 'V'):
+    return FTP_VERB_PASV;
+  case FTP_VERB_KEY('P', 'O', 'R', 'T'):
+    return FTP_VERB_PORT;
+  case FTP_VERB_KEY('T', 'Y', 'P', 'E'):
+    return FTP_VERB_TYPE;
+  case FTP_VERB_KEY('L', 'I', 'S', 'T'):
+    return FTP_VERB_LIST;
+  case FTP_VERB_KEY('M', 'L', 'S', 'D'):
+    return FTP_VERB_MLSD;
+  case FTP_VERB_KEY('R', 'E', 'T', 'R'):
+    return FTP_VERB_RETR;
+  case FTP_VERB_KEY('S', 'T', 'O', 'R'):
+    return FTP_VERB_STOR;
+  case FTP_VERB_KEY('D', 'E', 'L', 'E'):
+    return FTP_VERB_DELE;
+  case FTP_VERB_KEY('M', 'K', 'D', 0):
+    return FTP_VERB_MKD;
+  case FTP_VERB_KEY('R', 'M', 'D', 0):
+    return FTP_VERB_RMD;
+  case FTP_VERB_KEY('R', 'N', 'F', 'R'):
+    return FTP_VERB_RNFR;
+  case FTP_VERB_KEY('R', 'N', 'T', 'O'):
+    return FTP_VERB_RNTO;
+  case FTP_VERB_KEY('S', 'I', 'T', 'E'):
+    return FTP_VERB_SITE;
+  case FTP_VERB_KEY('F', 'E', 'A', 'T'):
+    return FTP_VERB_FEAT;
+  case FTP_VERB_KEY('S', 'I', 'Z', 'E'):
+    return FTP_VERB_SIZE;
+  case FTP_VERB_KEY('S', 'Y', 'S', 'T'):
+    return FTP_VERB_SYST;
+  case FTP_VERB_KEY('R', 'E', 'S', 'T'):
+    return FTP_VERB_REST;
+  case FTP_VERB_KEY('A', 'V', 'B', 'L'):
+    return FTP_VERB_AVBL;
+  case FTP_VERB_KEY('A', 'U', 'T', 'H'):
+    return FTP_VERB_AUTH;
+  case FTP_VERB_KEY('P', 'B', 'S', 'Z'):
+    return FTP_VERB_PBSZ;
+  case FTP_VERB_KEY('P', 'R', 'O', 'T'):
+    return FTP_VERB_PROT;
+  default:
+    return FTP_VERB_UNKNOWN;
+  }
+}
+
+const char *FtpProtocol::verbName(FtpVerb verb)
+{
+  static const char *const names[FTP_VERB_COUNT] = {
+      "UNKNOWN", "USER", "PASS", "CDUP", "CWD", "PWD", "QUIT", "PASV", "PORT", "TYPE", "LIST", "MLSD",
+      "RETR", "STOR", "DELE", "MKD", "RMD", "RNFR", "RNTO", "SITE", "FEAT", "SIZE", "SYST", "REST", "AVBL",
+      "AUTH", "PBSZ", "PROT"};
+  return verb < FTP_VERB_COUNT ? names[verb] : names[FTP_VERB_UNKNOWN];
+}
+
+bool FtpProtocol::makePath(char *fullPath, size_t pathSize, const char *cwd, const char *param)
+{
+  if (pathSize < 2)
+  {
+    return false;
+  }
+
+  if (param[0] == '\0' || strcmp(param, "/") == 0)
+  {
+    strcpy(fullPath, "/");
+    return true;
+  }
+
+  int len;
+  if (param[0] != '/')
+  {
+    size_t cwdLen = strlen(cwd);
+    bool slash = cwdLen > 0 && cwd[cwdLen - 1] == '/';
+    len = snprintf(fullPath, pathSize, slash ? "%s%s" : "%s/%s", cwd, param);
+  }
+  else
+  {
+    len = snprintf(fullPath, pathSize, "%s", param);
+  }
+  if (len < 0 || (size_t)len >= pathSize)
+  {
+    return false;
+  }
+
+  // Remove trailing slash or "/." if not root
+  if (len >= 2 && strcmp(fullPath + len - 2, "/.") == 0)
+  {
+    fullPath[len -= 2] = '\0';
+  }
+  if (len > 1 && fullPath[len - 1] == '/')
+  {
+    fullPath[len - 1] = '\0';
+  }
+  else if (len == 0)
+  {
+    strcpy(fullPath, "/");
+  }
+
+  // Security check - prevent directory traversal and access to server files
+  return strstr(fullPath, "../") == nullptr && strstr(fullPath, "/" FTP_INTERNAL_PREFIX) == nullptr;
+}
+
+size_t FtpProtocol::formatListLine(char *line, size_t lineSize, const char *name, uint64_t size, bool isDir, bool mlsd)
+{
+  int len;
+  if (mlsd)
+  {
+    len = snprintf(line, lineSize, "Type=%s;Size=%llu;Modify=20000101000000; %s\r\n",
+                   isDir ? "dir" : "file", (unsigned long long)size, name);
+  }
+  else
+  {
+    len = snprintf(line, lineSize, "%s 1 owner group %llu Jan 1 2000 %s\r\n",
+                   isDir ? "drwxr-xr-x" : "-rw-r--r--", (unsigned long long)size, name);
+  }
+  return len > 0 && (size_t)len < lineSize ? len : 0;
+}
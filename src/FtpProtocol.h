@@ -0,0 +1,73 @@
+/*******************************************************************************
+ **                                                                            **
+ **                   PROTOCOL HELPERS FOR FTP SERVER                          **
+ **                                                                            **
+ *******************************************************************************/
+
+// Command line parsing, verb lookup, path resolution and listing line
+// formatting. These run on every command or listed entry, so they work on
+// caller-provided buffers, never allocate and don't depend on the Arduino
+// core: the same code builds on the host for benchmarks (extras/tools).
+
+#ifndef FTP_PROTOCOL_H
+#define FTP_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FTP_INTERNAL_PREFIX ".ftp" // Server files, hidden and unreachable
+#define FTP_COMMAND_SIZE 6         // FTP commands are 4 chars max
+
+enum FtpVerb
+{
+  FTP_VERB_UNKNOWN = 0,
+  FTP_VERB_USER,
+  FTP_VERB_PASS,
+  FTP_VERB_CDUP,
+  FTP_VERB_CWD,
+  FTP_VERB_PWD,
+  FTP_VERB_QUIT,
+  FTP_VERB_PASV,
+  FTP_VERB_PORT,
+  FTP_VERB_TYPE,
+  FTP_VERB_LIST,
+  FTP_VERB_MLSD,
+  FTP_VERB_RETR,
+  FTP_VERB_STOR,
+  FTP_VERB_DELE,
+  FTP_VERB_MKD,
+  FTP_VERB_RMD,
+  FTP_VERB_RNFR,
+  FTP_VERB_RNTO,
+  FTP_VERB_SITE,
+  FTP_VERB_FEAT,
+  FTP_VERB_SIZE,
+  FTP_VERB_SYST,
+  FTP_VERB_REST,
+  FTP_VERB_AVBL,
+  FTP_VERB_AUTH,
+  FTP_VERB_PBSZ,
+  FTP_VERB_PROT,
+  FTP_VERB_COUNT
+};
+
+class FtpProtocol
+{
+public:
+  // Splits line in place: command gets the uppercased verb, parameters points
+  // into line past the separating spaces (empty string when there are none)
+  static void parseCommandLine(char *line, char *command, size_t commandSize, char *&parameters);
+
+  static FtpVerb lookupVerb(const char *command);
+  static const char *verbName(FtpVerb verb); // "UNKNOWN" for FTP_VERB_UNKNOWN
+
+  // Resolves param against cwd into an absolute path without trailing "/" or
+  // "/.". Returns false for paths that escape with "../", name server files
+  // or don't fit in fullPath.
+  static bool makePath(char *fullPath, size_t pathSize, const char *cwd, const char *param);
+
+  // One LIST or MLSD line, CRLF included. Returns its length, 0 if it doesn't fit.
+  static size_t formatListLine(char *line, size_t lineSize, const char *name, uint64_t size, bool isDir, bool mlsd);
+};
+
+#endif // FTP_PROTOCOL_H
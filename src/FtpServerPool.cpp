@@ -0,0 +1,317 @@
+/*
+ * Session worker pool for the ESP32-S3 FTP Server
+ *
+ * The deque follows Chase and Lev with the C11 orderings from Le et al.,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models". It never
+ * grows: the pool owns at most FTP_POOL_MAX_SERVERS servers, so every deque
+ * can hold all of them.
+ */
+
+#include "FtpServerPool.h"
+
+FtpServerPool::Deque::Deque() : _top(0),
+                                _bottom(0)
+{
+  for (auto &slot : _slots)
+    slot.store(nullptr, std::memory_order_relaxed);
+}
+
+bool FtpServerPool::Deque::push(FtpServer *server)
+{
+  int32_t bottom = _bottom.load(std::memory_order_relaxed);
+  int32_t top = _top.load(std::memory_order_acquire);
+  if (bottom - top >= FTP_POOL_MAX_SERVERS)
+  {
+    return false;
+  }
+  _slots[bottom & (FTP_POOL_MAX_SERVERS - 1)].store(server, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  _bottom.store(bottom + 1, std::memory_order_relaxed);
+  return true;
+}
+
+FtpServer *FtpServerPool::Deque::pop()
+{
+  int32_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+  _bottom.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int32_t top = _top.load(std::memory_order_relaxed);
+
+  if (top > bottom)
+  {
+    _bottom.store(bottom + 1, std::memory_order_relaxed); // Empty
+    return nullptr;
+  }
+
+  FtpServer *server = _slots[bottom & (FTP_POOL_MAX_SERVERS - 1)].load(std::memory_order_relaxed);
+  if (top == bottom)
+  {
+    // Last one: race thieves for it
+    if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+    {
+      server = nullptr;
+    }
+    _bottom.store(bottom + 1, std::memory_order_relaxed);
+  }
+  return server;
+}
+
+FtpServer *FtpServerPool::Deque::steal()
+{
+  int32_t top = _top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int32_t bottom = _bottom.load(std::memory_order_acquire);
+  if (top >= bottom)
+  {
+    return nullptr;
+  }
+
+  FtpServer *server = _slots[top & (FTP_POOL_MAX_SERVERS - 1)].load(std::memory_order_relaxed);
+  if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+  {
+    return nullptr; // Lost to the owner or another thief
+  }
+  return server;
+}
+
+int32_t FtpServerPool::Deque::size() const
+{
+  int32_t size = _bottom.load(std::memory_order_relaxed) - _top.load(std::memory_order_relaxed);
+  return size > 0 ? size : 0;
+}
+
+FtpServerPool::FtpServerPool() : _workerCount(0),
+                                 _parkedCount(0),
+                                 _servers(0),
+                                 _nextWorker(0),
+                                 _running(0),
+                                 _stop(false)
+{
+  for (uint8_t i = 0; i < FTP_POOL_MAX_WORKERS; i++)
+  {
+    _workers[i].pool = this;
+    _workers[i].index = i;
+    _workers[i].steps.store(0);
+    _workers[i].steals.store(0);
+    _workers[i].sleeps.store(0);
+    _workers[i].busy.store(0);
+  }
+}
+
+FtpServerPool::~FtpServerPool()
+{
+  end();
+}
+
+bool FtpServerPool::add(FtpServer &server)
+{
+  if (_servers >= FTP_POOL_MAX_SERVERS)
+  {
+    return false;
+  }
+  _servers++;
+
+  if (!isRunning())
+  {
+    _parked[_parkedCount++] = &server;
+    return true;
+  }
+
+  // Every inbox can hold all servers, so the push can't fail
+  Worker &worker = _workers[_nextWorker++ % _workerCount];
+  return worker.inbox.push(&server);
+}
+
+bool FtpServerPool::begin(uint8_t workers)
+{
+  if (isRunning())
+  {
+    return false;
+  }
+
+  uint8_t cores = portNUM_PROCESSORS;
+  if (workers == 0)
+  {
+    workers = cores;
+  }
+  _workerCount = min(workers, (uint8_t)FTP_POOL_MAX_WORKERS);
+
+  // Spread the parked servers before the workers start
+  for (uint8_t i = 0; i < _parkedCount; i++)
+  {
+    _workers[_nextWorker++ % _workerCount].inbox.push(_parked[i]);
+  }
+  _parkedCount = 0;
+
+  _stop.store(false);
+  _running.store(_workerCount);
+  for (uint8_t i = 0; i < _workerCount; i++)
+  {
+    char name[16];
+    snprintf(name, sizeof(name), "ftpWorker%u", i);
+    if (xTaskCreatePinnedToCore(workerTask, name, FTP_POOL_STACK_SIZE, &_workers[i], FTP_POOL_PRIORITY,
+                                nullptr, i % cores) != pdPASS)
+    {
+      // Never started: collect what was posted to it as if it had stopped
+      for (uint8_t j = i; j < _workerCount; j++)
+      {
+        handBack(_workers[j]);
+      }
+      _running.fetch_sub(_workerCount - i);
+      end();
+      return false;
+    }
+  }
+  return true;
+}
+
+void FtpServerPool::end()
+{
+  _stop.store(true, std::memory_order_release);
+  while (_running.load(std::memory_order_acquire) > 0)
+  {
+    vTaskDelay(1);
+  }
+
+  // Collect the servers the workers handed back, for the next begin()
+  for (uint8_t i = 0; i < _workerCount; i++)
+  {
+    FtpServer *server;
+    while (_workers[i].outbox.pop(server))
+    {
+      _parked[_parkedCount++] = server;
+    }
+  }
+  _stop.store(false);
+}
+
+FtpServerPool::WorkerStats FtpServerPool::getWorkerStats(uint8_t worker) const
+{
+  WorkerStats stats = {0, 0, 0};
+  if (worker < FTP_POOL_MAX_WORKERS)
+  {
+    stats.steps = _workers[worker].steps.load(std::memory_order_relaxed);
+    stats.steals = _workers[worker].steals.load(std::memory_order_relaxed);
+    stats.sleeps = _workers[worker].sleeps.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+// Private method implementations
+
+void FtpServerPool::workerTask(void *arg)
+{
+  Worker &worker = *(Worker *)arg;
+  worker.pool->run(worker);
+  worker.pool->handBack(worker);
+  worker.pool->_running.fetch_sub(1, std::memory_order_release);
+  vTaskDelete(nullptr);
+}
+
+void FtpServerPool::run(Worker &worker)
+{
+  uint32_t millisLastSleep = millis();
+  uint8_t passSteps = 0;
+  uint8_t passBusy = 0;
+
+  while (!_stop.load(std::memory_order_acquire))
+  {
+    claimInbox(worker);
+
+    // The owner takes from the top as well, so its servers run round robin
+    FtpServer *server = worker.deque.steal();
+    if (server == nullptr)
+    {
+      server = stealFor(worker, false);
+    }
+    if (server == nullptr)
+    {
+      worker.busy.store(0, std::memory_order_relaxed);
+      sleep(worker);
+      millisLastSleep = millis();
+      continue;
+    }
+
+    server->handleFTP();
+    worker.steps.fetch_add(1, std::memory_order_relaxed);
+    passSteps++;
+    passBusy += server->isBusy() ? 1 : 0;
+    worker.deque.push(server);
+
+    bool idlePass = false;
+    if (passSteps >= worker.deque.size())
+    {
+      worker.busy.store(passBusy, std::memory_order_relaxed);
+      idlePass = passBusy == 0;
+      passSteps = 0;
+      passBusy = 0;
+    }
+
+    // No sessions here: take a server from a worker running several or wait
+    // a tick for connections. Busy workers still sleep now and then so the
+    // idle task can feed the watchdog.
+    if (idlePass)
+    {
+      FtpServer *stolen = stealFor(worker, true);
+      if (stolen != nullptr)
+      {
+        worker.deque.push(stolen);
+        continue;
+      }
+    }
+    if (idlePass || millis() - millisLastSleep >= FTP_POOL_YIELD_MS)
+    {
+      sleep(worker);
+      millisLastSleep = millis();
+    }
+  }
+}
+
+void FtpServerPool::claimInbox(Worker &worker)
+{
+  FtpServer *server;
+  while (worker.inbox.pop(server))
+  {
+    worker.deque.push(server);
+  }
+}
+
+void FtpServerPool::handBack(Worker &worker)
+{
+  // Other workers may still be stealing while this one stops; whatever they
+  // take they hand back themselves
+  claimInbox(worker);
+  FtpServer *server;
+  while ((server = worker.deque.pop()) != nullptr)
+  {
+    worker.outbox.push(server);
+  }
+}
+
+FtpServer *FtpServerPool::stealFor(Worker &worker, bool balance)
+{
+  // An empty worker takes any queued server. An idle one only goes after
+  // workers with two or more sessions, so single sessions aren't traded back
+  // and forth; it may pick up idle servers on the way to a busy one.
+  for (uint8_t i = 1; i < _workerCount; i++)
+  {
+    Worker &victim = _workers[(worker.index + i) % _workerCount];
+    if (balance && victim.busy.load(std::memory_order_relaxed) < 2)
+    {
+      continue;
+    }
+    FtpServer *server = victim.deque.steal();
+    if (server != nullptr)
+    {
+      worker.steals.fetch_add(1, std::memory_order_relaxed);
+      return server;
+    }
+  }
+  return nullptr;
+}
+
+void FtpServerPool::sleep(Worker &worker)
+{
+  worker.sleeps.fetch_add(1, std::memory_order_relaxed);
+  vTaskDelay(1);
+}
@@ -0,0 +1,102 @@
+/*******************************************************************************
+ **                                                                            **
+ **                     SESSION WORKER POOL FOR FTP SERVER                     **
+ **                                                                            **
+ *******************************************************************************/
+
+// Runs the handleFTP() loop of several FtpServer instances on one FreeRTOS
+// task per core instead of the application's loop(). Each worker owns a
+// deque of servers: it takes one from the top, runs a handleFTP() step and
+// pushes it back at the bottom; a worker with no servers, or with only idle
+// ones while another runs several sessions, steals from the top of another
+// deque, so busy sessions spread over both cores. A server is held by one
+// worker at a time, so FtpServer itself needs no locking.
+//
+// Control-to-worker messages go through FtpSpscQueue rings: add() posts
+// servers to a worker's inbox, and workers stopped by end() post the servers
+// they held to their outbox, where the control task collects them. add(),
+// begin() and end() must all be called from the same task.
+// Callbacks set on pooled servers (setLoopBudget()) run on the worker tasks.
+
+#ifndef FTP_SERVERPOOL_H
+#define FTP_SERVERPOOL_H
+
+#include "ESP32FtpServer.h"
+#include "FtpSpscQueue.h"
+#include <atomic>
+
+#define FTP_POOL_MAX_SERVERS 8   // Power of two
+#define FTP_POOL_MAX_WORKERS 4   // Capped to the number of cores
+#define FTP_POOL_STACK_SIZE 6144 // Bytes per worker task
+#define FTP_POOL_PRIORITY 1
+#define FTP_POOL_YIELD_MS 10     // Busy workers sleep one tick this often
+
+class FtpServerPool
+{
+public:
+  struct WorkerStats
+  {
+    uint32_t steps;  // handleFTP() calls
+    uint32_t steals; // Servers taken from another worker
+    uint32_t sleeps; // Ticks given up while idle or to let the idle task run
+  };
+
+  FtpServerPool();
+  ~FtpServerPool();
+
+  bool add(FtpServer &server);    // The server must be begun, before or after begin()
+  bool begin(uint8_t workers = 0); // 0 starts one worker per core
+  void end();                     // Stops the workers, the servers keep running state
+  bool isRunning() const { return _running.load() > 0; }
+  uint8_t workerCount() const { return _workerCount; }
+  WorkerStats getWorkerStats(uint8_t worker) const;
+
+private:
+  // Bounded Chase-Lev deque: the owner pushes at the bottom, everyone takes
+  // from the top. pop() lets a stopping worker drain its own deque.
+  class Deque
+  {
+  public:
+    Deque();
+    bool push(FtpServer *server);
+    FtpServer *pop();
+    FtpServer *steal();
+    int32_t size() const;
+
+  private:
+    std::atomic<int32_t> _top;
+    std::atomic<int32_t> _bottom;
+    std::atomic<FtpServer *> _slots[FTP_POOL_MAX_SERVERS];
+  };
+
+  struct Worker
+  {
+    FtpServerPool *pool;
+    uint8_t index;
+    Deque deque;
+    FtpSpscQueue<FtpServer *, FTP_POOL_MAX_SERVERS> inbox;  // From the control task
+    FtpSpscQueue<FtpServer *, FTP_POOL_MAX_SERVERS> outbox; // Back to it when stopping
+    std::atomic<uint32_t> steps;
+    std::atomic<uint32_t> steals;
+    std::atomic<uint32_t> sleeps;
+    std::atomic<uint8_t> busy; // Servers with a session in the last pass
+  };
+
+  Worker _workers[FTP_POOL_MAX_WORKERS];
+  uint8_t _workerCount;
+  FtpServer *_parked[FTP_POOL_MAX_SERVERS]; // Held by the control task while stopped
+  uint8_t _parkedCount;
+  uint8_t _servers;    // Servers owned by the pool
+  uint8_t _nextWorker; // Round robin for add()
+  std::atomic<uint8_t> _running; // Workers that haven't exited yet
+  std::atomic<bool> _stop;
+
+  static void workerTask(void *arg);
+  void run(Worker &worker);
+  void claimInbox(Worker &worker);
+  void handBack(Worker &worker);
+  FtpServer *stealFor(Worker &worker, bool balance);
+  void sleep(Worker &worker);
+};
+
+#endif // FTP_SERVERPOOL_H
@@ -0,0 +1,168 @@
+/*
+ * Session resumption tokens for the ESP32-S3 FTP Server
+ *
+ * Token text: FTP_TOKEN_PREFIX, then the slot id and the MAC in lowercase
+ * hex. The MAC covers the slot's whole state, so a token stops working as
+ * soon as its slot is reused, even by a token with the same id.
+ */
+
+#include "FtpSessionTokens.h"
+#include <mbedtls/md.h>
+#include <string.h>
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static int hexValue(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static bool decodeHex(const char *text, uint8_t *out, size_t outSize)
+{
+  for (size_t i = 0; i < outSize; i++)
+  {
+    int high = hexValue(text[2 * i]);
+    int low = hexValue(text[2 * i + 1]);
+    if (high < 0 || low < 0)
+      return false;
+    out[i] = (uint8_t)(high << 4 | low);
+  }
+  return true;
+}
+
+FtpSessionTokens::FtpSessionTokens()
+{
+  memset(_slots, 0, sizeof(_slots));
+  memset(_secret, 0, sizeof(_secret));
+}
+
+void FtpSessionTokens::rekey(const uint8_t *secret)
+{
+  memcpy(_secret, secret, sizeof(_secret));
+  memset(_slots, 0, sizeof(_slots));
+}
+
+bool FtpSessionTokens::issue(const char *user, const Session &session, uint32_t id, uint32_t now, uint32_t ttlMillis,
+                             char *token, size_t tokenSize)
+{
+  if (tokenSize < FTP_TOKEN_LENGTH + 1 || strnlen(session.cwd, sizeof(session.cwd)) >= sizeof(session.cwd))
+  {
+    return false;
+  }
+
+  // An expired slot, or else the one closest to expiring
+  Slot *slot = &_slots[0];
+  for (Slot &candidate : _slots)
+  {
+    if (!isLive(candidate, now))
+    {
+      slot = &candidate;
+      break;
+    }
+    if ((int32_t)(candidate.expires - slot->expires) < 0)
+      slot = &candidate;
+  }
+
+  slot->id = id;
+  slot->expires = (now + ttlMillis) | 1; // 0 marks a free slot
+  slot->session = session;
+
+  uint8_t raw[4 + FTP_TOKEN_MAC_SIZE];
+  memcpy(raw, &slot->id, 4);
+  if (!sign(*slot, user, raw + 4))
+  {
+    slot->expires = 0;
+    return false;
+  }
+
+  token[0] = FTP_TOKEN_PREFIX;
+  for (size_t i = 0; i < sizeof(raw); i++)
+  {
+    token[1 + 2 * i] = HEX_DIGITS[raw[i] >> 4];
+    token[2 + 2 * i] = HEX_DIGITS[raw[i] & 0x0f];
+  }
+  token[FTP_TOKEN_LENGTH] = '\0';
+  return true;
+}
+
+bool FtpSessionTokens::redeem(const char *user, const char *token, uint32_t now, Session &session)
+{
+  uint8_t raw[4 + FTP_TOKEN_MAC_SIZE];
+  if (token[0] != FTP_TOKEN_PREFIX || strlen(token) != FTP_TOKEN_LENGTH || !decodeHex(token + 1, raw, sizeof(raw)))
+  {
+    return false;
+  }
+
+  uint32_t id;
+  memcpy(&id, raw, 4);
+  for (Slot &slot : _slots)
+  {
+    if (slot.id != id || !isLive(slot, now))
+      continue;
+
+    uint8_t mac[FTP_TOKEN_MAC_SIZE];
+    if (!sign(slot, user, mac))
+      return false;
+
+    // Constant time, so response timing doesn't leak how much of the MAC matched
+    uint8_t diff = 0;
+    for (size_t i = 0; i < FTP_TOKEN_MAC_SIZE; i++)
+      diff |= mac[i] ^ raw[4 + i];
+    if (diff != 0)
+      return false;
+
+    session = slot.session;
+    return true;
+  }
+  return false;
+}
+
+size_t FtpSessionTokens::count(uint32_t now) const
+{
+  size_t live = 0;
+  for (const Slot &slot : _slots)
+  {
+    live += isLive(slot, now) ? 1 : 0;
+  }
+  return live;
+}
+
+// Private method implementations
+
+bool FtpSessionTokens::sign(const Slot &slot, const char *user, uint8_t *mac)
+{
+  const mbedtls_md_info_t *info = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  mbedtls_md_context_t ctx;
+  uint8_t digest[32];
+  uint8_t type = (uint8_t)slot.session.type;
+
+  // user is NUL-terminated in the input so it can't run into cwd
+  mbedtls_md_init(&ctx);
+  bool ok = info != nullptr &&
+            mbedtls_md_setup(&ctx, info, 1) == 0 &&
+            mbedtls_md_hmac_starts(&ctx, _secret, sizeof(_secret)) == 0 &&
+            mbedtls_md_hmac_update(&ctx, (const uint8_t *)&slot.id, sizeof(slot.id)) == 0 &&
+            mbedtls_md_hmac_update(&ctx, (const uint8_t *)&slot.expires, sizeof(slot.expires)) == 0 &&
+            mbedtls_md_hmac_update(&ctx, &type, 1) == 0 &&
+            mbedtls_md_hmac_update(&ctx, (const uint8_t *)user, strlen(user) + 1) == 0 &&
+            mbedtls_md_hmac_update(&ctx, (const uint8_t *)slot.session.cwd, strlen(slot.session.cwd)) == 0 &&
+            mbedtls_md_hmac_finish(&ctx, digest) == 0;
+  mbedtls_md_free(&ctx);
+
+  if (ok)
+  {
+    memcpy(mac, digest, FTP_TOKEN_MAC_SIZE);
+  }
+  return ok;
+}
+
+bool FtpSessionTokens::isLive(const Slot &slot, uint32_t now)
+{
+  return slot.expires != 0 && (int32_t)(slot.expires - now) > 0;
+}
@@ -0,0 +1,69 @@
+/*******************************************************************************
+ **                                                                            **
+ **                   SESSION RESUMPTION TOKENS FOR FTP SERVER                 **
+ **                                                                            **
+ *******************************************************************************/
+
+// SITE TOKEN hands a logged-in client a short-lived token; presenting it as
+// "USER @<token>" on a later connection logs in and restores the working
+// directory and transfer type in one round trip, instead of USER, PASS, CWD
+// and TYPE. The session state stays on the device in a fixed table of
+// FTP_TOKEN_SLOTS entries; the token is the entry's random id followed by a
+// truncated HMAC-SHA256 of the id, expiry, user, type and directory, keyed
+// with a secret drawn at begin(). A token can be reused until it expires, so
+// a collector polling more often than FTP_TOKEN_TTL_S logs in with it every
+// time. When the table is full the entry closest to expiring is replaced.
+
+#ifndef FTP_SESSIONTOKENS_H
+#define FTP_SESSIONTOKENS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FTP_TOKEN_SLOTS 4          // Tokens valid at the same time
+#define FTP_TOKEN_TTL_S 600        // Default lifetime for setSessionTokens()
+#define FTP_TOKEN_CWD_SIZE 128     // Longer working directories can't be saved
+#define FTP_TOKEN_PREFIX '@'       // USER @<token> resumes a session
+#define FTP_TOKEN_SECRET_SIZE 32
+#define FTP_TOKEN_MAC_SIZE 12      // Truncated HMAC-SHA256
+#define FTP_TOKEN_LENGTH (1 + 2 * (4 + FTP_TOKEN_MAC_SIZE)) // Prefix and hex digits
+
+class FtpSessionTokens
+{
+public:
+  struct Session
+  {
+    char cwd[FTP_TOKEN_CWD_SIZE];
+    char type; // 'A' or 'I'
+  };
+
+  FtpSessionTokens();
+
+  // Drops every token; secret is FTP_TOKEN_SECRET_SIZE random bytes
+  void rekey(const uint8_t *secret);
+
+  // Writes FTP_TOKEN_LENGTH characters and a NUL to token. id is a random word
+  // from the caller. False if the session doesn't fit or HMAC fails.
+  bool issue(const char *user, const Session &session, uint32_t id, uint32_t now, uint32_t ttlMillis,
+             char *token, size_t tokenSize);
+  // Restores session from a token issued to user that hasn't expired
+  bool redeem(const char *user, const char *token, uint32_t now, Session &session);
+
+  size_t count(uint32_t now) const; // Unexpired tokens
+
+private:
+  struct Slot
+  {
+    uint32_t id;
+    uint32_t expires; // millis(); 0 for a free slot
+    Session session;
+  };
+
+  Slot _slots[FTP_TOKEN_SLOTS];
+  uint8_t _secret[FTP_TOKEN_SECRET_SIZE];
+
+  bool sign(const Slot &slot, const char *user, uint8_t *mac);
+  static bool isLive(const Slot &slot, uint32_t now);
+};
+
+#endif // FTP_SESSIONTOKENS_H
@@ -0,0 +1,85 @@
+/*******************************************************************************
+ **                                                                            **
+ **                 SINGLE-PRODUCER SINGLE-CONSUMER QUEUE FOR FTP SERVER       **
+ **                                                                            **
+ *******************************************************************************/
+
+// Bounded lock-free ring for handing messages between exactly one producer
+// task and one consumer task, e.g. the control loop and a worker. No
+// allocation and no locks: a push or pop is a couple of loads, a copy and
+// one release store. Each side caches the other side's index and only
+// reloads it when the ring looks full (producer) or empty (consumer), so the
+// shared cache lines move between cores only when they have to.
+// No Arduino dependencies, so the host tools can include this header.
+
+#ifndef FTP_SPSCQUEUE_H
+#define FTP_SPSCQUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+
+#define FTP_SPSC_ALIGN 32 // ESP32-S3 cache line
+
+template <typename T, size_t Capacity>
+class FtpSpscQueue
+{
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+  FtpSpscQueue() : _head(0), _tailCache(0), _tail(0), _headCache(0) {}
+
+  // Producer side
+  bool push(const T &item)
+  {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _headCache == Capacity)
+    {
+      _headCache = _head.load(std::memory_order_acquire);
+      if (tail - _headCache == Capacity)
+      {
+        return false; // Full
+      }
+    }
+    _items[tail & (Capacity - 1)] = item;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side
+  bool pop(T &item)
+  {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tailCache)
+    {
+      _tailCache = _tail.load(std::memory_order_acquire);
+      if (head == _tailCache)
+      {
+        return false; // Empty
+      }
+    }
+    item = _items[head & (Capacity - 1)];
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Either side, a snapshot that may be stale by the time it's used
+  size_t size() const
+  {
+    return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+  static constexpr size_t capacity() { return Capacity; }
+
+private:
+  // Consumer-owned line
+  alignas(FTP_SPSC_ALIGN) std::atomic<size_t> _head;
+  size_t _tailCache;
+
+  // Producer-owned line
+  alignas(FTP_SPSC_ALIGN) std::atomic<size_t> _tail;
+  size_t _headCache;
+
+  alignas(FTP_SPSC_ALIGN) T _items[Capacity];
+};
+
+#endif // FTP_SPSCQUEUE_H
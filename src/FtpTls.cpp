@@ -0,0 +1,419 @@
+/*
+ * Explicit FTPS for the ESP32-S3 FTP Server
+ *
+ * The BIO callbacks call lwIP send()/recv() non-blocking on the socket, so
+ * mbedTLS reports WANT_READ/WANT_WRITE instead of waiting; callers either
+ * hand that back to the loop (sendNonBlocking/recvNonBlocking) or wait in
+ * short delays up to FTP_TLS_TIMEOUT_MS (write).
+ */
+
+#include "FtpTls.h"
+#include <errno.h>
+#include <lwip/sockets.h>
+#include <mbedtls/net_sockets.h>
+#include <string.h>
+
+// AES-GCM first: AES runs on the accelerator and GCM needs no extra MAC pass
+static const int FTP_TLS_CIPHERSUITES[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+    0};
+
+FtpTlsContext::FtpTlsContext() : _active(false), _cacheHit(false)
+{
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+FtpTlsContext::~FtpTlsContext()
+{
+  end();
+}
+
+bool FtpTlsContext::begin(const char *certPem, const char *keyPem)
+{
+  end();
+  mbedtls_ssl_config_init(&_config);
+  mbedtls_entropy_init(&_entropy);
+  mbedtls_ctr_drbg_init(&_drbg);
+  mbedtls_x509_crt_init(&_cert);
+  mbedtls_pk_init(&_key);
+#if defined(MBEDTLS_SSL_CACHE_C)
+  mbedtls_ssl_cache_init(&_cache);
+#endif
+  _active = true; // From here end() frees everything
+
+  // PEM parsing wants the terminating NUL counted in the length
+  static const char personalization[] = "ESP32FtpServer";
+  bool ok = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy,
+                                  (const unsigned char *)personalization, sizeof(personalization)) == 0 &&
+            mbedtls_x509_crt_parse(&_cert, (const unsigned char *)certPem, strlen(certPem) + 1) == 0 &&
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+            mbedtls_pk_parse_key(&_key, (const unsigned char *)keyPem, strlen(keyPem) + 1, nullptr, 0,
+                                 mbedtls_ctr_drbg_random, &_drbg) == 0 &&
+#else
+            mbedtls_pk_parse_key(&_key, (const unsigned char *)keyPem, strlen(keyPem) + 1, nullptr, 0) == 0 &&
+#endif
+            mbedtls_ssl_config_defaults(&_config, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                        MBEDTLS_SSL_PRESET_DEFAULT) == 0 &&
+            mbedtls_ssl_conf_own_cert(&_config, &_cert, &_key) == 0;
+  if (!ok)
+  {
+    end();
+    return false;
+  }
+
+  mbedtls_ssl_conf_rng(&_config, mbedtls_ctr_drbg_random, &_drbg);
+  mbedtls_ssl_conf_ciphersuites(&_config, FTP_TLS_CIPHERSUITES);
+#if defined(MBEDTLS_SSL_CACHE_C)
+  mbedtls_ssl_cache_set_max_entries(&_cache, FTP_TLS_CACHE_SIZE);
+  mbedtls_ssl_cache_set_timeout(&_cache, FTP_TLS_CACHE_TIMEOUT);
+  mbedtls_ssl_conf_session_cache(&_config, this, cacheGet, cacheSet);
+#endif
+  memset(&_stats, 0, sizeof(_stats));
+  return true;
+}
+
+void FtpTlsContext::end()
+{
+  if (!_active)
+  {
+    return;
+  }
+  _active = false;
+#if defined(MBEDTLS_SSL_CACHE_C)
+  mbedtls_ssl_cache_free(&_cache);
+#endif
+  mbedtls_pk_free(&_key);
+  mbedtls_x509_crt_free(&_cert);
+  mbedtls_ctr_drbg_free(&_drbg);
+  mbedtls_entropy_free(&_entropy);
+  mbedtls_ssl_config_free(&_config);
+}
+
+// Private method implementations
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+// Wrapped so a lookup that finds the session, i.e. a resumed handshake, is seen
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+int FtpTlsContext::cacheGet(void *data, unsigned char const *id, size_t idLength, mbedtls_ssl_session *session)
+{
+  FtpTlsContext *context = (FtpTlsContext *)data;
+  int ret = mbedtls_ssl_cache_get(&context->_cache, id, idLength, session);
+  context->_cacheHit |= ret == 0;
+  return ret;
+}
+
+int FtpTlsContext::cacheSet(void *data, unsigned char const *id, size_t idLength, const mbedtls_ssl_session *session)
+{
+  return mbedtls_ssl_cache_set(&((FtpTlsContext *)data)->_cache, id, idLength, session);
+}
+#else
+int FtpTlsContext::cacheGet(void *data, mbedtls_ssl_session *session)
+{
+  FtpTlsContext *context = (FtpTlsContext *)data;
+  int ret = mbedtls_ssl_cache_get(&context->_cache, session);
+  context->_cacheHit |= ret == 0;
+  return ret;
+}
+
+int FtpTlsContext::cacheSet(void *data, const mbedtls_ssl_session *session)
+{
+  return mbedtls_ssl_cache_set(&((FtpTlsContext *)data)->_cache, session);
+}
+#endif
+#endif
+
+FtpTlsClient::FtpTlsClient() : _ssl(nullptr),
+                               _context(nullptr),
+                               _handshakeDone(false),
+                               _resumed(false),
+                               _handshakeMicros(0),
+                               _rxStart(0),
+                               _rxEnd(0)
+{
+}
+
+FtpTlsClient::~FtpTlsClient()
+{
+  freeTls();
+}
+
+FtpTlsClient &FtpTlsClient::operator=(const WiFiClient &client)
+{
+  freeTls();
+  WiFiClient::operator=(client);
+  return *this;
+}
+
+bool FtpTlsClient::startTls(FtpTlsContext &context)
+{
+  freeTls();
+  if (!context.isActive())
+  {
+    return false;
+  }
+
+  _ssl = (mbedtls_ssl_context *)malloc(sizeof(mbedtls_ssl_context));
+  if (_ssl == nullptr)
+  {
+    return false;
+  }
+  mbedtls_ssl_init(_ssl);
+  if (mbedtls_ssl_setup(_ssl, &context._config) != 0)
+  {
+    freeTls();
+    return false;
+  }
+  mbedtls_ssl_set_bio(_ssl, this, bioSend, bioRecv, nullptr);
+  _context = &context;
+  _handshakeDone = false;
+  _resumed = false;
+  _handshakeMicros = 0;
+  return true;
+}
+
+size_t FtpTlsClient::memoryUsage() const
+{
+  return _ssl != nullptr ? sizeof(mbedtls_ssl_context) + MBEDTLS_SSL_IN_CONTENT_LEN + MBEDTLS_SSL_OUT_CONTENT_LEN : 0;
+}
+
+int FtpTlsClient::sendNonBlocking(const uint8_t *data, size_t length)
+{
+  if (_ssl == nullptr)
+  {
+    return send(fd(), data, length, MSG_DONTWAIT);
+  }
+  if (!_handshakeDone)
+  {
+    int ret = handshakeStep();
+    if (ret != 0)
+      return ioResult(ret);
+  }
+
+  uint32_t start = micros();
+  int ret = mbedtls_ssl_write(_ssl, data, length);
+  if (ret > 0)
+  {
+    _context->_stats.bulkMicros += micros() - start;
+    _context->_stats.bulkBytes += ret;
+    return ret;
+  }
+  return ioResult(ret);
+}
+
+int FtpTlsClient::recvNonBlocking(uint8_t *data, size_t length)
+{
+  if (_ssl == nullptr)
+  {
+    return recv(fd(), data, length, MSG_DONTWAIT);
+  }
+  if (!_handshakeDone)
+  {
+    int ret = handshakeStep();
+    if (ret != 0)
+      return ioResult(ret);
+  }
+
+  uint32_t start = micros();
+  int ret = mbedtls_ssl_read(_ssl, data, length);
+  if (ret > 0)
+  {
+    _context->_stats.bulkMicros += micros() - start;
+    _context->_stats.bulkBytes += ret;
+    return ret;
+  }
+  // Clients that close without close_notify are common, take it as the end
+  if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_CONN_EOF)
+  {
+    return 0;
+  }
+  return ioResult(ret);
+}
+
+size_t FtpTlsClient::write(uint8_t data)
+{
+  return write(&data, 1);
+}
+
+size_t FtpTlsClient::write(const uint8_t *buf, size_t size)
+{
+  if (_ssl == nullptr)
+  {
+    return WiFiClient::write(buf, size);
+  }
+
+  size_t written = 0;
+  uint32_t start = millis();
+  while (written < size)
+  {
+    int ret = sendNonBlocking(buf + written, size - written);
+    if (ret > 0)
+    {
+      written += ret;
+    }
+    else if (ret < 0 && errno == EAGAIN && millis() - start < FTP_TLS_TIMEOUT_MS)
+    {
+      delay(1);
+    }
+    else
+    {
+      fail();
+      break;
+    }
+  }
+  return written;
+}
+
+int FtpTlsClient::available()
+{
+  if (_ssl == nullptr)
+  {
+    return WiFiClient::available();
+  }
+
+  if (_rxStart == _rxEnd)
+  {
+    int ret = recvNonBlocking(_rx, sizeof(_rx));
+    if (ret == 0)
+    {
+      stop(); // The peer closed the connection
+    }
+    if (ret <= 0)
+    {
+      return 0;
+    }
+    _rxStart = 0;
+    _rxEnd = ret;
+  }
+  return _rxEnd - _rxStart;
+}
+
+int FtpTlsClient::read()
+{
+  if (_ssl == nullptr)
+  {
+    return WiFiClient::read();
+  }
+  return available() > 0 ? _rx[_rxStart++] : -1;
+}
+
+int FtpTlsClient::read(uint8_t *buf, size_t size)
+{
+  if (_ssl == nullptr)
+  {
+    return WiFiClient::read(buf, size);
+  }
+
+  if (available() <= 0)
+  {
+    return -1;
+  }
+  size_t count = min(size, (size_t)(_rxEnd - _rxStart));
+  memcpy(buf, _rx + _rxStart, count);
+  _rxStart += count;
+  return count;
+}
+
+void FtpTlsClient::stop()
+{
+  if (_ssl != nullptr && _handshakeDone)
+  {
+    // Best effort, the peer may be gone already
+    uint32_t start = millis();
+    while (mbedtls_ssl_close_notify(_ssl) == MBEDTLS_ERR_SSL_WANT_WRITE && millis() - start < 100)
+    {
+      delay(1);
+    }
+  }
+  freeTls();
+  WiFiClient::stop();
+}
+
+// Private method implementations
+
+int FtpTlsClient::handshakeStep()
+{
+  uint32_t start = micros();
+  _context->_cacheHit = false;
+  int ret = mbedtls_ssl_handshake(_ssl);
+  _handshakeMicros += micros() - start;
+  _resumed |= _context->_cacheHit;
+
+  FtpTlsContext::Stats &stats = _context->_stats;
+  if (ret == 0)
+  {
+    _handshakeDone = true;
+    if (_resumed)
+    {
+      stats.resumedHandshakes++;
+      stats.resumedMicros += _handshakeMicros;
+    }
+    else
+    {
+      stats.fullHandshakes++;
+      stats.fullMicros += _handshakeMicros;
+    }
+    stats.lastMicros = _handshakeMicros;
+  }
+  else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    stats.failedHandshakes++;
+  }
+  return ret;
+}
+
+int FtpTlsClient::ioResult(int ret)
+{
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  // Failed handshake or damaged record, the connection is unusable
+  fail();
+  errno = EPROTO; // After fail(), closing the socket may set it
+  return -1;
+}
+
+void FtpTlsClient::fail()
+{
+  // Never fall back to the clear on this socket
+  freeTls();
+  WiFiClient::stop();
+}
+
+void FtpTlsClient::freeTls()
+{
+  if (_ssl != nullptr)
+  {
+    mbedtls_ssl_free(_ssl);
+    free(_ssl);
+    _ssl = nullptr;
+  }
+  _context = nullptr;
+  _rxStart = 0;
+  _rxEnd = 0;
+}
+
+int FtpTlsClient::bioSend(void *ctx, const unsigned char *buf, size_t len)
+{
+  int sent = send(((FtpTlsClient *)ctx)->fd(), buf, len, MSG_DONTWAIT);
+  if (sent >= 0)
+  {
+    return sent;
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+int FtpTlsClient::bioRecv(void *ctx, unsigned char *buf, size_t len)
+{
+  int got = recv(((FtpTlsClient *)ctx)->fd(), buf, len, MSG_DONTWAIT);
+  if (got >= 0)
+  {
+    return got; // 0 is the end of the connection
+  }
+  return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+}
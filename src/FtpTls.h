@@ -0,0 +1,132 @@
+/*******************************************************************************
+ **                                                                            **
+ **                      EXPLICIT FTPS (AUTH TLS) FOR FTP SERVER               **
+ **                                                                            **
+ *******************************************************************************/
+
+// TLS for the control and data connections on top of mbedTLS, which the
+// ESP32-S3 core builds with its AES and SHA accelerators. FtpTlsContext holds
+// what every connection of a server shares: certificate, key, RNG and the
+// session cache that lets a data connection resume the control connection's
+// session with an abbreviated handshake instead of a full one.
+// FtpTlsClient is a WiFiClient that, once startTls() is called, encrypts
+// everything going through write()/read(), so the server keeps replying with
+// println(). The handshake is driven by the first read or write after
+// startTls(): the non-blocking calls used by RETR/STOR advance it a step at
+// a time from handleFTP(), blocking writes (replies, listings) wait for it
+// for at most FTP_TLS_TIMEOUT_MS.
+
+#ifndef FTP_TLS_H
+#define FTP_TLS_H
+
+#include <WiFi.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/version.h>
+#include <mbedtls/x509_crt.h>
+
+#define FTP_TLS_TIMEOUT_MS 5000     // Longest a blocking write waits for the handshake or the socket
+#define FTP_TLS_CACHE_SIZE 4        // Sessions kept for data connections to resume
+#define FTP_TLS_CACHE_TIMEOUT 3600  // Seconds a cached session can be resumed
+#define FTP_TLS_RX_SIZE 128         // Decrypted control bytes buffered for read()
+
+class FtpTlsContext
+{
+public:
+  struct Stats
+  {
+    uint32_t fullHandshakes;
+    uint32_t resumedHandshakes;
+    uint32_t failedHandshakes;
+    uint64_t fullMicros;     // CPU time spent in full handshakes
+    uint64_t resumedMicros;  // and in resumed ones
+    uint32_t lastMicros;     // Most recent handshake
+    uint64_t bulkBytes;      // Application data encrypted or decrypted
+    uint64_t bulkMicros;     // Time spent doing it
+  };
+
+  FtpTlsContext();
+  ~FtpTlsContext();
+
+  // PEM certificate chain and private key, NUL-terminated
+  bool begin(const char *certPem, const char *keyPem);
+  void end();
+  bool isActive() const { return _active; }
+
+  const Stats &stats() const { return _stats; }
+
+private:
+  friend class FtpTlsClient;
+
+  mbedtls_ssl_config _config;
+  mbedtls_entropy_context _entropy;
+  mbedtls_ctr_drbg_context _drbg;
+  mbedtls_x509_crt _cert;
+  mbedtls_pk_context _key;
+#if defined(MBEDTLS_SSL_CACHE_C)
+  mbedtls_ssl_cache_context _cache;
+#endif
+  bool _active;
+  bool _cacheHit; // Set when a handshake step resumed a cached session
+  Stats _stats;
+
+#if defined(MBEDTLS_SSL_CACHE_C)
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+  static int cacheGet(void *data, unsigned char const *id, size_t idLength, mbedtls_ssl_session *session);
+  static int cacheSet(void *data, unsigned char const *id, size_t idLength, const mbedtls_ssl_session *session);
+#else
+  static int cacheGet(void *data, mbedtls_ssl_session *session);
+  static int cacheSet(void *data, const mbedtls_ssl_session *session);
+#endif
+#endif
+};
+
+class FtpTlsClient : public WiFiClient
+{
+public:
+  FtpTlsClient();
+  ~FtpTlsClient();
+  FtpTlsClient(const FtpTlsClient &) = delete;
+  FtpTlsClient &operator=(const FtpTlsClient &) = delete;
+  FtpTlsClient &operator=(const WiFiClient &client); // A new connection, in the clear
+
+  // Switches the connection to TLS, the handshake happens on the next I/O
+  bool startTls(FtpTlsContext &context);
+  bool isSecure() const { return _ssl != nullptr; }
+  size_t memoryUsage() const;
+
+  // Non-blocking, with recv()/send() results: -1 and errno EAGAIN when the
+  // socket (or the handshake) isn't ready, 0 from recvNonBlocking() at the end
+  int sendNonBlocking(const uint8_t *data, size_t length);
+  int recvNonBlocking(uint8_t *data, size_t length);
+
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t *buf, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buf, size_t size) override;
+  void stop() override;
+
+private:
+  mbedtls_ssl_context *_ssl;
+  FtpTlsContext *_context;
+  bool _handshakeDone;
+  bool _resumed;
+  uint32_t _handshakeMicros;
+  uint8_t _rx[FTP_TLS_RX_SIZE];
+  uint16_t _rxStart;
+  uint16_t _rxEnd;
+
+  int handshakeStep(); // 0 when done, an mbedTLS error otherwise
+  int ioResult(int ret); // -1 with errno set
+  void fail();
+  void freeTls();
+  static int bioSend(void *ctx, const unsigned char *buf, size_t len);
+  static int bioRecv(void *ctx, unsigned char *buf, size_t len);
+};
+
+#endif // FTP_TLS_H
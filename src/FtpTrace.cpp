@@ -0,0 +1,176 @@
+/*
+ * Control channel trace recorder for the ESP32-S3 FTP Server
+ *
+ * The ring holds whole records only: appending drops records from the head
+ * until the new one fits, so a reader never sees a torn record.
+ */
+
+#include "FtpTrace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define FTP_TRACE_LINE_MAX 255
+
+FtpTrace::FtpTrace() : _ring(nullptr),
+                       _capacity(0),
+                       _head(0),
+                       _used(0),
+                       _dropped(0),
+                       _session(0),
+                       _inSession(false)
+{
+}
+
+bool FtpTrace::begin(size_t capacity)
+{
+  end();
+  if (capacity < sizeof(RecordHeader) + FTP_TRACE_LINE_MAX)
+  {
+    return false;
+  }
+
+  _ring = (uint8_t *)malloc(capacity);
+  if (_ring == nullptr)
+  {
+    return false;
+  }
+  _capacity = capacity;
+  _head = 0;
+  _used = 0;
+  _dropped = 0;
+  _inSession = false;
+  return true;
+}
+
+void FtpTrace::end()
+{
+  free(_ring);
+  _ring = nullptr;
+  _capacity = 0;
+  _used = 0;
+}
+
+void FtpTrace::sessionStart(uint32_t millis, uint32_t ip)
+{
+  _session++;
+  _inSession = true;
+  append(FTP_TRACE_SESSION_START, millis, &ip, sizeof(ip));
+}
+
+void FtpTrace::command(uint32_t millis, const char *line)
+{
+  // Never keep credentials in the trace
+  if (strncasecmp(line, "PASS", 4) == 0 && (line[4] == ' ' || line[4] == '\0'))
+  {
+    line = "PASS ****";
+  }
+
+  size_t length = strlen(line);
+  append(FTP_TRACE_COMMAND, millis, line, length > FTP_TRACE_LINE_MAX ? FTP_TRACE_LINE_MAX : length);
+}
+
+void FtpTrace::transfer(uint32_t millis, bool upload, uint64_t bytes, uint32_t durationMs, bool complete)
+{
+  // The record keeps 32 bits so existing traces still parse
+  uint32_t recorded = bytes > UINT32_MAX ? UINT32_MAX : (uint32_t)bytes;
+  TransferRecord record = {recorded, durationMs, (uint8_t)upload, (uint8_t)complete, 0};
+  append(FTP_TRACE_TRANSFER, millis, &record, sizeof(record));
+}
+
+void FtpTrace::sessionEnd(uint32_t millis)
+{
+  if (_inSession)
+  {
+    _inSession = false;
+    append(FTP_TRACE_SESSION_END, millis, nullptr, 0);
+  }
+}
+
+size_t FtpTrace::read(size_t offset, uint8_t *buffer, size_t length, uint32_t millis) const
+{
+  size_t copied = 0;
+  if (offset < sizeof(FileHeader))
+  {
+    FileHeader header = {FTP_TRACE_MAGIC, FTP_TRACE_VERSION, sizeof(FileHeader), _dropped, millis, (uint32_t)_used};
+    size_t count = sizeof(header) - offset;
+    if (count > length)
+      count = length;
+    memcpy(buffer, (const uint8_t *)&header + offset, count);
+    copied = count;
+    offset += count;
+  }
+
+  offset -= sizeof(FileHeader);
+  if (copied < length && offset < _used)
+  {
+    size_t count = _used - offset;
+    if (count > length - copied)
+      count = length - copied;
+    copyOut(_head + offset, buffer + copied, count);
+    copied += count;
+  }
+  return copied;
+}
+
+void FtpTrace::forEach(const std::function<void(const RecordHeader &header, const uint8_t *payload)> &callback) const
+{
+  uint8_t payload[FTP_TRACE_LINE_MAX + 1];
+  for (size_t offset = 0; offset < _used;)
+  {
+    RecordHeader header;
+    copyOut(_head + offset, &header, sizeof(header));
+    size_t length = header.length < sizeof(payload) ? header.length : sizeof(payload) - 1;
+    copyOut(_head + offset + sizeof(header), payload, length);
+    payload[length] = '\0';
+    callback(header, payload);
+    offset += sizeof(header) + header.length;
+  }
+}
+
+// Private method implementations
+
+void FtpTrace::append(uint8_t event, uint32_t millis, const void *payload, uint16_t length)
+{
+  if (_ring == nullptr)
+  {
+    return;
+  }
+
+  size_t needed = sizeof(RecordHeader) + length;
+  while (_capacity - _used < needed)
+  {
+    RecordHeader oldest;
+    copyOut(_head, &oldest, sizeof(oldest));
+    size_t oldestSize = sizeof(RecordHeader) + oldest.length;
+    _head = (_head + oldestSize) % _capacity;
+    _used -= oldestSize;
+    _dropped++;
+  }
+
+  RecordHeader header = {event, _session, length, millis};
+  size_t tail = _head + _used;
+  copyIn(tail, &header, sizeof(header));
+  copyIn(tail + sizeof(header), payload, length);
+  _used += needed;
+}
+
+void FtpTrace::copyIn(size_t position, const void *data, size_t length)
+{
+  if (length == 0)
+  {
+    return;
+  }
+  position %= _capacity;
+  size_t first = _capacity - position < length ? _capacity - position : length;
+  memcpy(_ring + position, data, first);
+  memcpy(_ring, (const uint8_t *)data + first, length - first);
+}
+
+void FtpTrace::copyOut(size_t position, void *data, size_t length) const
+{
+  position %= _capacity;
+  size_t first = _capacity - position < length ? _capacity - position : length;
+  memcpy(data, _ring + position, first);
+  memcpy((uint8_t *)data + first, _ring, length - first);
+}
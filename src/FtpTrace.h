@@ -0,0 +1,101 @@
+/*******************************************************************************
+ **                                                                            **
+ **                   CONTROL CHANNEL TRACE RECORDER FOR FTP SERVER            **
+ **                                                                            **
+ *******************************************************************************/
+
+// Keeps the most recent sessions as a compact binary trace in a fixed RAM
+// ring: every command line with its arrival time, plus the size and duration
+// of each RETR/STOR. When the ring is full the oldest records are dropped.
+// Clients download the trace as FTP_TRACE_PATH and extras/tools/ftp_replay
+// re-drives it against a server.
+//
+// Trace file layout (little endian): a FileHeader followed by records, each a
+// RecordHeader plus `length` payload bytes. COMMAND payloads are the command
+// line without CRLF (PASS arguments are masked), TRANSFER payloads a
+// TransferRecord and SESSION_START payloads the client IPv4 address.
+// No Arduino dependencies, so the host tools can include this header.
+
+#ifndef FTP_TRACE_H
+#define FTP_TRACE_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FTP_TRACE_PATH "/.trace.bin"
+#define FTP_TRACE_MAGIC 0x31525446 // "FTR1"
+#define FTP_TRACE_VERSION 1
+
+enum FtpTraceEvent
+{
+  FTP_TRACE_SESSION_START = 1,
+  FTP_TRACE_COMMAND,
+  FTP_TRACE_TRANSFER,
+  FTP_TRACE_SESSION_END
+};
+
+class FtpTrace
+{
+public:
+  struct FileHeader
+  {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t dropped; // Records lost to ring overflow
+    uint32_t millis;  // Device clock when the trace was read
+    uint32_t length;  // Record bytes following the header
+  };
+
+  struct RecordHeader
+  {
+    uint8_t event;
+    uint8_t session; // Wraps at 256
+    uint16_t length;
+    uint32_t millis;
+  };
+
+  struct TransferRecord
+  {
+    uint32_t bytes;
+    uint32_t durationMs;
+    uint8_t upload;
+    uint8_t complete;
+    uint16_t reserved;
+  };
+
+  FtpTrace();
+
+  bool begin(size_t capacity);
+  void end();
+  bool isActive() const { return _ring != nullptr; }
+
+  void sessionStart(uint32_t millis, uint32_t ip);
+  void command(uint32_t millis, const char *line);
+  void transfer(uint32_t millis, bool upload, uint64_t bytes, uint32_t durationMs, bool complete); // bytes saturate at 4 GB
+  void sessionEnd(uint32_t millis);
+
+  // The trace as a file: header then records, oldest first
+  size_t size() const { return sizeof(FileHeader) + _used; }
+  size_t read(size_t offset, uint8_t *buffer, size_t length, uint32_t millis) const;
+  uint32_t dropped() const { return _dropped; }
+
+  // Calls callback for each record, oldest first
+  void forEach(const std::function<void(const RecordHeader &header, const uint8_t *payload)> &callback) const;
+
+private:
+  uint8_t *_ring;
+  size_t _capacity;
+  size_t _head; // Oldest record
+  size_t _used;
+  uint32_t _dropped;
+  uint8_t _session;
+  bool _inSession;
+
+  void append(uint8_t event, uint32_t millis, const void *payload, uint16_t length);
+  void copyIn(size_t position, const void *data, size_t length);
+  void copyOut(size_t position, void *data, size_t length) const;
+};
+
+#endif // FTP_TRACE_H